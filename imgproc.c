@@ -66,6 +66,17 @@ SOFTWARE.
 #define FILT_MOVIE_ENCODE_LITERAL       (17)
 #define FILT_MOVIE_ENCODE_QOI           (18)
 #define FILT_MOVIE_ENCODE_PNG           (19)
+#define FILT_MOVIE_ENCODE_PALETTE       (20)
+#define FILT_MOVIE_ENCODE_PREDICT       (21)
+#define FILT_MOVIE_ENCODE_NEARLOSSLESS  (22)
+#define FILT_MOVIE_ENCODE_PROGRESSIVE   (23)
+#define FILT_MOVIE_CROP                 (24)
+#define FILT_MOVIE_ENCODE_RGB565        (25)
+#define FILT_MOVIE_ENCODE_RGBA4444      (26)
+#define FILT_MOVIE_DITHER               (27)
+#define FILT_MOVIE_ENCODE_YUV420        (28)
+
+#define NBATCH          (8)         /* frames read from a movie at a time */
 
 /* gfx_filter */
 
@@ -168,11 +179,48 @@ void gfx_movie_filter(qom *qm, gfx_canvas *can_in, int filtmode, float arg1, flo
         case FILT_MOVIE_ENCODE_PNG:
             qom_setoutputencoding(qm, qomENCODING_PNG);
             break;
+        case FILT_MOVIE_ENCODE_PALETTE:
+            qom_setoutputencoding(qm, qomENCODING_PALETTE);
+            break;
+        case FILT_MOVIE_ENCODE_PREDICT:
+            qom_setoutputencoding(qm, qomENCODING_PREDICT);
+            qom_seteffort(qm, (int)arg1);
+            break;
+        case FILT_MOVIE_ENCODE_NEARLOSSLESS:
+            qom_setoutputencoding(qm, qomENCODING_QOI);
+            qom_settolerance(qm, (int)arg1);
+            break;
+        case FILT_MOVIE_ENCODE_PROGRESSIVE:
+            qom_setoutputencoding(qm, qomENCODING_PROGRESSIVE);
+            break;
+        case FILT_MOVIE_CROP:
+            qom_setcrop(qm, 1);
+            break;
+        case FILT_MOVIE_ENCODE_RGB565:
+            qom_setoutputencoding(qm, qomENCODING_RGB565);
+            break;
+        case FILT_MOVIE_ENCODE_RGBA4444:
+            qom_setoutputencoding(qm, qomENCODING_RGBA4444);
+            break;
+        case FILT_MOVIE_DITHER:
+            qom_setdither(qm, 1);
+            break;
+        case FILT_MOVIE_ENCODE_YUV420:
+            qom_setoutputencoding(qm, qomENCODING_YUV420);
+            break;
     }
 }
 
 #define NOARG   (0.0)
 
+/* per-pixel filters, that doprocess runs together in one pass */
+
+static int ispointop(const char *name)
+{
+    return (strcmp(name,"saturate") == 0) || (strcmp(name,"expand") == 0) ||
+           (strcmp(name,"gammawarp") == 0) || (strcmp(name,"scalergb") == 0);
+}
+
 void doprocess(qom *qm, gfx_canvas *can_in, int argc, char **argv, int frameno, int nframes)
 {
     int movie;
@@ -180,7 +228,10 @@ void doprocess(qom *qm, gfx_canvas *can_in, int argc, char **argv, int frameno,
         movie = 0;
     else
         movie = 1;
+    gfx_pointops *ops = gfx_pointops_new();
     for(int i=3; i<argc; i++) {
+        if(!ispointop(argv[i]))
+            gfx_pointops_apply(ops, can_in);
         if(strcmp(argv[i],"zoom") == 0) {
             if((i+2) >= argc) { 
                 fprintf(stderr, "error: %s needs 2 arguments!\n", argv[i]);
@@ -208,7 +259,7 @@ void doprocess(qom *qm, gfx_canvas *can_in, int argc, char **argv, int frameno,
             }
             i++;
             float sat = atof(argv[i]);
-            gfx_filter(can_in, FILT_SATURATE, sat, NOARG, NOARG, NOARG, NOARG);
+            gfx_pointops_saturate(ops, sat);
         } else if(strcmp(argv[i],"sharpen") == 0) {
             if((i+2) >= argc) { 
                 fprintf(stderr, "error: %s needs 2 arguments!\n", argv[i]);
@@ -258,7 +309,7 @@ void doprocess(qom *qm, gfx_canvas *can_in, int argc, char **argv, int frameno,
             float min = atof(argv[i]);
             i++;
             float max = atof(argv[i]);
-            gfx_filter(can_in, FILT_EXPAND, min, max, NOARG, NOARG, NOARG);
+            gfx_pointops_expand(ops, min, max);
         } else if(strcmp(argv[i],"gammawarp") == 0) {
             if((i+1) >= argc) { 
                 fprintf(stderr, "error: %s needs 1 argument!\n", argv[i]);
@@ -266,7 +317,7 @@ void doprocess(qom *qm, gfx_canvas *can_in, int argc, char **argv, int frameno,
             }
             i++;
             float gamma = atof(argv[i]);
-            gfx_filter(can_in, FILT_GAMMAWARP, gamma, NOARG, NOARG, NOARG, NOARG);
+            gfx_pointops_gammawarp(ops, gamma);
         } else if(strcmp(argv[i],"scalergb") == 0) {
             if((i+3) >= argc) { 
                 fprintf(stderr, "error: %s needs 3 arguments!\n", argv[i]);
@@ -278,7 +329,7 @@ void doprocess(qom *qm, gfx_canvas *can_in, int argc, char **argv, int frameno,
             float scaleg = atof(argv[i]);
             i++;
             float scaleb = atof(argv[i]);
-            gfx_filter(can_in, FILT_SCALERGB, scaler, scaleg, scaleb, NOARG, NOARG);
+            gfx_pointops_scalergba(ops, scaler, scaleg, scaleb, 1.0);
         } else if(strcmp(argv[i],"chromablur") == 0) {
             if((i+1) >= argc) { 
                 fprintf(stderr, "error: %s needs 1 argument!\n", argv[i]);
@@ -347,17 +398,53 @@ void doprocess(qom *qm, gfx_canvas *can_in, int argc, char **argv, int frameno,
             i++;
             int fadeframes = atof(argv[i]);
             gfx_movie_filter(qm, can_in, FILT_MOVIE_BLURINOUT, fadeframes, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(strcmp(argv[i],"threads") == 0) {
+            if((i+1) >= argc) { 
+                fprintf(stderr, "error: %s needs 1 argument!\n", argv[i]);
+                    exit(1);
+            }
+            i++;                        /* main sets the threads before the first frame */
+        } else if(strcmp(argv[i],"SCALAR") == 0) {
+            gfx_setsimd(0);
         } else if(movie && (strcmp(argv[i],"LITERAL") == 0)) {
             gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_LITERAL, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
         } else if(movie && (strcmp(argv[i],"QOI") == 0)) {
             gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_QOI, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
         } else if(movie && (strcmp(argv[i],"PNG") == 0)) {
             gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_PNG, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"PALETTE") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_PALETTE, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"PREDICT") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_PREDICT, qomEFFORT_FAST, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"PREDICT_HIGH") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_PREDICT, qomEFFORT_HIGH, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"NEARLOSSLESS") == 0)) {
+            if((i+1) >= argc) { 
+                fprintf(stderr, "error: %s needs 1 argument!\n", argv[i]);
+                    exit(1);
+            }
+            i++;
+            int tolerance = atoi(argv[i]);
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_NEARLOSSLESS, tolerance, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"PROGRESSIVE") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_PROGRESSIVE, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"CROP") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_CROP, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"RGB565") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_RGB565, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"RGBA4444") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_RGBA4444, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"DITHER") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_DITHER, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
+        } else if(movie && (strcmp(argv[i],"YUV420") == 0)) {
+            gfx_movie_filter(qm, can_in, FILT_MOVIE_ENCODE_YUV420, NOARG, NOARG, NOARG, NOARG, NOARG, frameno, nframes);
         } else {
             fprintf(stderr,"imgproc: strange option [%s]\n",argv[i]);
             exit(1);
         }
     }
+    gfx_pointops_apply(ops, can_in);
+    gfx_pointops_free(ops);
 }
 
 int strendswith(const char *buf, const char *suf)
@@ -403,6 +490,18 @@ static int isqomfilename(const char *name)
     return 0;
 }
 
+/* the threads option applies to the whole run, so look for it up front */
+
+static int argthreads(int argc, char **argv)
+{
+    int nthreads = 0;
+    for(int i=3; i<argc-1; i++) {
+        if(strcmp(argv[i],"threads") == 0)
+            nthreads = atoi(argv[i+1]);
+    }
+    return nthreads;
+}
+
 int main(int argc, char **argv)
 {
     if(argc<4) {
@@ -426,6 +525,8 @@ int main(int argc, char **argv)
         fprintf(stderr,"\t[roundcorners radius exp] roundcorners 0.05 2.0\n");
         fprintf(stderr,"\t[softedge width]          softedge 0.05\n");
         fprintf(stderr,"\t[setaspect aspect]        setaspect 1.0\n");
+        fprintf(stderr,"\t[threads nthreads]        threads 4\n");
+        fprintf(stderr,"\t[SCALAR]                  SCALAR\n");
         fprintf(stderr,"\n");
         fprintf(stderr,"for qom movie files this command can also be used:\n");
         fprintf(stderr,"\t[fadeinout aspect]        fadeinout nframes\n");
@@ -433,6 +534,16 @@ int main(int argc, char **argv)
         fprintf(stderr,"\t[LITERAL]                 LITERAL\n");
         fprintf(stderr,"\t[QOI]                     QOI\n");
         fprintf(stderr,"\t[PNG]                     PNG\n");
+        fprintf(stderr,"\t[PALETTE]                 PALETTE\n");
+        fprintf(stderr,"\t[PREDICT]                 PREDICT\n");
+        fprintf(stderr,"\t[PREDICT_HIGH]            PREDICT_HIGH\n");
+        fprintf(stderr,"\t[NEARLOSSLESS tolerance]  NEARLOSSLESS 2\n");
+        fprintf(stderr,"\t[PROGRESSIVE]             PROGRESSIVE\n");
+        fprintf(stderr,"\t[CROP]                    CROP\n");
+        fprintf(stderr,"\t[RGB565]                  RGB565\n");
+        fprintf(stderr,"\t[RGBA4444]                RGBA4444\n");
+        fprintf(stderr,"\t[DITHER]                  DITHER\n");
+        fprintf(stderr,"\t[YUV420]                  YUV420\n");
         fprintf(stderr,"\n");
         fprintf(stderr,"ops can be chained like this:\n");
         fprintf(stderr,"\timgproc in.jpg out.jpg zoom 0.5 0.5 saturate 1.5 expand 0.1 0.9\n");
@@ -449,15 +560,31 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    int nthreads = argthreads(argc, argv);
+    if(nthreads>0)
+        gfx_setthreads(nthreads);
     if(isqomfilename(argv[1]) && isqomfilename(argv[2])) {
         qom *qm_in = qom_open(argv[1], "r");
         qom *qm_out = qom_open(argv[2], "w");
-        for(int frameno = 0; frameno<qom_getnframes(qm_in); frameno++) {
-            double usec;
-            gfx_canvas *can_in = qom_getframe(qm_in, frameno, &usec);
-            gfx_canvas *temp;
-            doprocess(qm_out, can_in, argc, argv, frameno, qom_getnframes(qm_in));
-            qom_putframe(qm_out, can_in, usec);
+        if(nthreads>0) {
+            qom_setthreads(qm_in, nthreads);
+            qom_setthreads(qm_out, nthreads);
+        }
+        for(int frameno = 0; frameno<qom_getnframes(qm_in); frameno += NBATCH) {
+            gfx_canvas *frames[NBATCH];
+            double usecs[NBATCH];
+            int nbatch = qom_getnframes(qm_in)-frameno;
+            int n = (nbatch<NBATCH) ? nbatch : NBATCH;
+            if(qom_getframes(qm_in, frameno, n, frames, usecs) != n) {
+                fprintf(stderr, "imgproc: %s: can't read frames %d to %d\n", argv[1], frameno, frameno+n-1);
+                exit(1);
+            }
+            for(int i=0; i<n; i++) {
+                gfx_canvas *can_in = frames[i];
+                doprocess(qm_out, can_in, argc, argv, frameno+i, qom_getnframes(qm_in));
+                qom_putframe(qm_out, can_in, usecs[i]);
+                gfx_canvas_free(can_in);
+            }
         }
         qom_close(qm_in);
         qom_close(qm_out);
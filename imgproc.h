@@ -77,6 +77,8 @@ void gfx_canvas_tojpeg(gfx_canvas *in, const char *filename);
 
 gfx_canvas *gfx_canvas_clone(gfx_canvas *c);
 
+gfx_canvas *gfx_canvas_lum(gfx_canvas *in);
+
 void gfx_canvas_swap(gfx_canvas *a, gfx_canvas *b);
 
 float gfx_canvas_diameter(gfx_canvas *in);
@@ -111,6 +113,18 @@ void gfx_canvas_scalergba(gfx_canvas *in, float scaler, float scaleg, float scal
 
 void gfx_canvas_noblack(gfx_canvas *c);
 
+typedef struct gfx_pointops gfx_pointops;
+
+gfx_pointops *gfx_pointops_new(void);
+void gfx_pointops_free(gfx_pointops *p);
+void gfx_pointops_tab(gfx_pointops *p, const unsigned char *rtab, const unsigned char *gtab, const unsigned char *btab, const unsigned char *atab);
+void gfx_pointops_saturate(gfx_pointops *p, float sat);
+void gfx_pointops_expand(gfx_pointops *p, float min, float max);
+void gfx_pointops_gammawarp(gfx_pointops *p, float gamma);
+void gfx_pointops_scalergba(gfx_pointops *p, float scaler, float scaleg, float scaleb, float scalea);
+int gfx_pointops_empty(gfx_pointops *p);
+void gfx_pointops_apply(gfx_pointops *p, gfx_canvas *c);
+
 void gfx_canvas_chromablur(gfx_canvas *in, float smalldiam);
 
 void gfx_canvas_addframe(gfx_canvas *in, int width, float r, float g, float b, float a);
@@ -123,6 +137,13 @@ void gfx_canvas_set_aspect(gfx_canvas *c, float aspect);
 
 float gfx_smoothstep(float x, float min, float max);
 
+void gfx_setsimd(int on);
+int gfx_getsimd(void);
+
+void gfx_setthreads(int nthreads);
+int gfx_getthreads(void);
+void gfx_parallel(int njobs, void (*func)(void *arg, int job), void *arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -183,6 +204,398 @@ int gfx_ilerplimit(int v0, int a0, int v1, int a1)
     return pix;
 }
 
+/* 
+ * SIMD.  The per-pixel loops below that matter most for movies also have 
+ * a vector version, written once with GCC and clang vector types as 8 
+ * pixels at a time in 32 bit lanes.  On x86-64 Linux they are compiled 
+ * for AVX2, SSE4.1 and plain x86-64 with target_clones, and the loader 
+ * picks the best one the CPU has; on ARM they compile to NEON.  They do 
+ * the same integer and float operations as the scalar loops, so the 
+ * results are bit for bit the same.  Each returns how many pixels it did 
+ * and the scalar loop finishes the rest.  IMGPROC_NO_SIMD builds without 
+ * them, and gfx_setsimd(0) turns them off at runtime.
+ */
+static int gfx_simd = 1;
+
+void gfx_setsimd(int on)
+{
+    gfx_simd = on;
+}
+
+int gfx_getsimd(void)
+{
+    return gfx_simd;
+}
+
+#if !defined(IMGPROC_NO_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#define gfx_SIMD
+#define gfx_VLEN            (8)
+
+typedef int gfx_vi __attribute__((vector_size(4*gfx_VLEN)));
+typedef unsigned int gfx_vu __attribute__((vector_size(4*gfx_VLEN)));
+typedef float gfx_vf __attribute__((vector_size(4*gfx_VLEN)));
+
+#if !defined(gfx_CLONES) && defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define gfx_CLONES          __attribute__((target_clones("avx2","sse4.1","default")))
+#endif
+#endif
+#ifndef gfx_CLONES
+#define gfx_CLONES
+#endif
+
+#define gfx_VCHAN(px,shift)     ((gfx_vi)(((px)>>(shift))&0xff))
+#define gfx_VPACK(r,g,b,a)      (((gfx_vu)(r)<<gfx_SHIFT_R) | ((gfx_vu)(g)<<gfx_SHIFT_G) | ((gfx_vu)(b)<<gfx_SHIFT_B) | ((gfx_vu)(a)<<gfx_SHIFT_A))
+#define gfx_VFLOAT(v)           __builtin_convertvector((v), gfx_vf)
+#define gfx_VINT(v)             __builtin_convertvector((v), gfx_vi)
+
+/* macros rather than functions, so no vector is passed between code built for different CPUs */
+
+#define gfx_VLOAD(v,p)          memcpy(&(v), (p), sizeof(v))
+#define gfx_VSTORE(p,v)         memcpy((p), &(v), sizeof(v))
+#define gfx_VMIN255(v)          (((v) & ~((v)>255)) | (((v)>255) & 255))
+#define gfx_VLIMIT(v)           gfx_VMIN255((v) & ((v)>0))
+
+/* d = (d*a0 + s*a1)>>8 for each channel, limited, as gfx_canvas_mix */
+
+gfx_CLONES static int gfx_mix_simd(unsigned int *dptr, const unsigned int *sptr, int n, int a0, int a1)
+{
+    int i;
+    for(i=0; i+gfx_VLEN<=n; i+=gfx_VLEN) {
+        gfx_vu d, s;
+        gfx_VLOAD(d, dptr+i);
+        gfx_VLOAD(s, sptr+i);
+        gfx_vu out = d & 0;
+        for(int shift=0; shift<32; shift+=8) {
+            gfx_vi v = (gfx_VCHAN(d, shift)*a0 + gfx_VCHAN(s, shift)*a1)>>8;
+            out |= (gfx_vu)gfx_VLIMIT(v) << shift;
+        }
+        gfx_VSTORE(dptr+i, out);
+    }
+    return i;
+}
+
+/* mix each color with the luminance, as gfx_canvas_saturate */
+
+gfx_CLONES static int gfx_saturate_simd(unsigned int *lptr, int n, int a0, int a1)
+{
+    int i;
+    for(i=0; i+gfx_VLEN<=n; i+=gfx_VLEN) {
+        gfx_vu px;
+        gfx_VLOAD(px, lptr+i);
+        gfx_vi r = gfx_VCHAN(px, gfx_SHIFT_R);
+        gfx_vi g = gfx_VCHAN(px, gfx_SHIFT_G);
+        gfx_vi b = gfx_VCHAN(px, gfx_SHIFT_B);
+        gfx_vi lum = (gfx_RINTLUM*r + gfx_GINTLUM*g + gfx_BINTLUM*b)>>8;
+        gfx_vi la0 = lum*a0;
+        r = (la0 + r*a1)>>8;
+        g = (la0 + g*a1)>>8;
+        b = (la0 + b*a1)>>8;
+        r = gfx_VLIMIT(r);
+        g = gfx_VLIMIT(g);
+        b = gfx_VLIMIT(b);
+        gfx_vu out = gfx_VPACK(r, g, b, gfx_VCHAN(px, gfx_SHIFT_A));
+        gfx_VSTORE(lptr+i, out);
+    }
+    return i;
+}
+
+/* scale r, g and b by scaletab[illumination], as gfx_canvas_brighten */
+
+gfx_CLONES static int gfx_brighten_simd(unsigned int *optr, const unsigned int *iptr, const unsigned char *bptr, int n, const float *scaletab)
+{
+    int i;
+    for(i=0; i+gfx_VLEN<=n; i+=gfx_VLEN) {
+        gfx_vu px;
+        gfx_VLOAD(px, iptr+i);
+        gfx_vf scale;
+        for(int k=0; k<gfx_VLEN; k++)
+            scale[k] = scaletab[bptr[i+k]];
+        gfx_vi r = gfx_VINT(scale*gfx_VFLOAT(gfx_VCHAN(px, gfx_SHIFT_R)));
+        gfx_vi g = gfx_VINT(scale*gfx_VFLOAT(gfx_VCHAN(px, gfx_SHIFT_G)));
+        gfx_vi b = gfx_VINT(scale*gfx_VFLOAT(gfx_VCHAN(px, gfx_SHIFT_B)));
+        r = gfx_VMIN255(r);
+        g = gfx_VMIN255(g);
+        b = gfx_VMIN255(b);
+        gfx_vu out = gfx_VPACK(r, g, b, gfx_VCHAN(px, gfx_SHIFT_A));
+        gfx_VSTORE(optr+i, out);
+    }
+    return i;
+}
+
+/* 
+ * Integer quotients through float division.  Numerators here are below 
+ * 2^17 and divisors at most 255, so a quotient is never closer than 
+ * 1/255 to the next integer, far more than float rounding moves it, and 
+ * truncating gives the same answer as integer division.
+ */
+#define gfx_VDIV(num,div)       gfx_VINT(gfx_VFLOAT(num)/gfx_VFLOAT(div))
+
+/* scale the colors up so the biggest is 255, black becomes white, as gfx_noblack */
+
+#define gfx_VNOBLACK(r,g,b) {                                       \
+    gfx_vi max = r;                                                 \
+    max = (max & ~(g>max)) | (g & (g>max));                         \
+    max = (max & ~(b>max)) | (b & (b>max));                         \
+    gfx_vi black = (max == 0);                                      \
+    gfx_vi div = max | (black & 1);                                 \
+    r = gfx_VDIV(255*r, div) | (black & 255);                       \
+    g = gfx_VDIV(255*g, div) | (black & 255);                       \
+    b = gfx_VDIV(255*b, div) | (black & 255);                       \
+}
+
+gfx_CLONES static int gfx_noblack_simd(unsigned int *lptr, int n)
+{
+    int i;
+    for(i=0; i+gfx_VLEN<=n; i+=gfx_VLEN) {
+        gfx_vu px;
+        gfx_VLOAD(px, lptr+i);
+        gfx_vi r = gfx_VCHAN(px, gfx_SHIFT_R);
+        gfx_vi g = gfx_VCHAN(px, gfx_SHIFT_G);
+        gfx_vi b = gfx_VCHAN(px, gfx_SHIFT_B);
+        gfx_VNOBLACK(r, g, b);
+        gfx_vu out = gfx_VPACK(r, g, b, gfx_VCHAN(px, gfx_SHIFT_A));
+        gfx_VSTORE(lptr+i, out);
+    }
+    return i;
+}
+
+/* give each pixel the luminance in lptr, as gfx_canvas_setlum */
+
+gfx_CLONES static int gfx_setlum_simd(unsigned int *cptr, const unsigned char *lptr, int n, const unsigned char *togam, const short *rlum, const short *glum, const short *blum)
+{
+    int i;
+    for(i=0; i+gfx_VLEN<=n; i+=gfx_VLEN) {
+        gfx_vu px;
+        gfx_VLOAD(px, cptr+i);
+        gfx_vi r = gfx_VCHAN(px, gfx_SHIFT_R);
+        gfx_vi g = gfx_VCHAN(px, gfx_SHIFT_G);
+        gfx_vi b = gfx_VCHAN(px, gfx_SHIFT_B);
+        gfx_VNOBLACK(r, g, b);
+        gfx_vi lum, wantlum;
+        for(int k=0; k<gfx_VLEN; k++) {
+            lum[k] = togam[rlum[r[k]]+glum[g[k]]+blum[b[k]]];
+            wantlum[k] = lptr[i+k];
+        }
+        gfx_vi darker = (wantlum<=lum);
+        gfx_vi lumdiv = lum | ((lum == 0) & 1);            /* wantlum is 0 too there */
+        gfx_vi colorness = 255-wantlum;
+        gfx_vi whiteness = 255*(wantlum-lum);
+        gfx_vi div = (255-lum) | ((lum == 255) & 1);
+        r = (darker & gfx_VDIV(r*wantlum, lumdiv)) | (~darker & gfx_VDIV(r*colorness + whiteness, div));
+        g = (darker & gfx_VDIV(g*wantlum, lumdiv)) | (~darker & gfx_VDIV(g*colorness + whiteness, div));
+        b = (darker & gfx_VDIV(b*wantlum, lumdiv)) | (~darker & gfx_VDIV(b*colorness + whiteness, div));
+        gfx_vu out = gfx_VPACK(r, g, b, gfx_VCHAN(px, gfx_SHIFT_A));
+        gfx_VSTORE(cptr+i, out);
+    }
+    return i;
+}
+
+/* scale pixels by alpha*wy, as a row of gfx_canvas_softedge */
+
+gfx_CLONES static int gfx_softedge_simd(unsigned int *dptr, const float *wx, float wy, int n)
+{
+    int i;
+    for(i=0; i+gfx_VLEN<=n; i+=gfx_VLEN) {
+        gfx_vu px;
+        gfx_VLOAD(px, dptr+i);
+        gfx_vf alpha;
+        memcpy(&alpha, wx+i, sizeof(alpha));
+        alpha = alpha*wy;
+        gfx_vi r = gfx_VINT(alpha*gfx_VFLOAT(gfx_VCHAN(px, gfx_SHIFT_R)));
+        gfx_vi g = gfx_VINT(alpha*gfx_VFLOAT(gfx_VCHAN(px, gfx_SHIFT_G)));
+        gfx_vi b = gfx_VINT(alpha*gfx_VFLOAT(gfx_VCHAN(px, gfx_SHIFT_B)));
+        gfx_vi a = gfx_VINT(alpha*gfx_VFLOAT(gfx_VCHAN(px, gfx_SHIFT_A)));
+        gfx_vu out = gfx_VPACK(r, g, b, a);
+        gfx_VSTORE(dptr+i, out);
+    }
+    return i;
+}
+#endif
+
+/* 
+ * Threads.  The filters split their work into bands of rows or spans of 
+ * pixels and run them on a pool of worker threads shared by all filters.  
+ * The workers are started the first time they are needed and then wait 
+ * for the next call of gfx_parallel, so a chain of filters on every frame 
+ * of a movie does not start new threads for each one.  The caller works 
+ * on its own jobs too, which lets a job call gfx_parallel again.  Each 
+ * band gives the same pixels it would have in one pass, so the results 
+ * do not depend on the number of threads.  gfx_setthreads sets how many 
+ * threads, counting the caller, the filters use; the default is one per 
+ * CPU, and IMGPROC_NO_THREADS builds without threads.
+ */
+#ifndef IMGPROC_NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define gfx_MINSPAN         (16*1024)
+#define gfx_MINBANDROWS     (4)
+#define gfx_JOBSPERTHREAD   (4)
+
+static int gfx_nthreads = 0;
+
+void gfx_setthreads(int nthreads)
+{
+    gfx_nthreads = nthreads;
+}
+
+static int gfx_ncpus(void)
+{
+    static int ncpus = 0;
+    if(ncpus == 0) {
+#ifndef IMGPROC_NO_THREADS
+        int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        ncpus = (n<1) ? 1 : n;
+#else
+        ncpus = 1;
+#endif
+    }
+    return ncpus;
+}
+
+int gfx_getthreads(void)
+{
+    if(gfx_nthreads<1)
+        return gfx_ncpus();
+    return gfx_nthreads;
+}
+
+typedef struct gfx_jobs {
+    void (*func)(void *arg, int job);
+    void *arg;
+    int njobs;
+    int nextjob;
+    int maxhelpers;
+    int helpers;
+    struct gfx_jobs *next;
+} gfx_jobs;
+
+static void gfx_runjobs(gfx_jobs *jobs)
+{
+    while(1) {
+        int job = __sync_fetch_and_add(&jobs->nextjob, 1);
+        if(job >= jobs->njobs)
+            break;
+        jobs->func(jobs->arg, job);
+    }
+}
+
+#ifndef IMGPROC_NO_THREADS
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    gfx_jobs *head;                     /* calls that still have jobs to hand out */
+    int nworkers;
+} gfx_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static void gfx_unlinkjobs(gfx_jobs *jobs)
+{
+    gfx_jobs **jp = &gfx_pool.head;
+    while(*jp) {
+        if(*jp == jobs) {
+            *jp = jobs->next;
+            return;
+        }
+        jp = &(*jp)->next;
+    }
+}
+
+static void *gfx_workerthread(void *unused)
+{
+    (void)unused;
+    pthread_mutex_lock(&gfx_pool.lock);
+    while(1) {
+        gfx_jobs *jobs = gfx_pool.head;
+        while(jobs && ((__sync_fetch_and_add(&jobs->nextjob, 0) >= jobs->njobs) || (jobs->helpers >= jobs->maxhelpers)))
+            jobs = jobs->next;
+        if(!jobs) {
+            pthread_cond_wait(&gfx_pool.work, &gfx_pool.lock);
+            continue;
+        }
+        jobs->helpers++;
+        pthread_mutex_unlock(&gfx_pool.lock);
+        gfx_runjobs(jobs);
+        pthread_mutex_lock(&gfx_pool.lock);
+        jobs->helpers--;
+        if(jobs->helpers == 0)
+            pthread_cond_broadcast(&gfx_pool.done);
+    }
+    return 0;
+}
+#endif
+
+/* run njobs calls of func on up to gfx_getthreads threads */
+
+void gfx_parallel(int njobs, void (*func)(void *arg, int job), void *arg)
+{
+    gfx_jobs jobs;
+    jobs.func = func;
+    jobs.arg = arg;
+    jobs.njobs = njobs;
+    jobs.nextjob = 0;
+    jobs.helpers = 0;
+    jobs.next = 0;
+    int nthreads = gfx_getthreads();
+#ifndef IMGPROC_NO_THREADS
+    if(nthreads>njobs)
+        nthreads = njobs;
+    if(nthreads>1) {
+        jobs.maxhelpers = nthreads-1;
+        pthread_mutex_lock(&gfx_pool.lock);
+        while(gfx_pool.nworkers < nthreads-1) {
+            pthread_t thread;
+            if(pthread_create(&thread, 0, gfx_workerthread, 0) != 0)
+                break;
+            pthread_detach(thread);
+            gfx_pool.nworkers++;
+        }
+        jobs.next = gfx_pool.head;
+        gfx_pool.head = &jobs;
+        pthread_cond_broadcast(&gfx_pool.work);
+        pthread_mutex_unlock(&gfx_pool.lock);
+        gfx_runjobs(&jobs);
+        pthread_mutex_lock(&gfx_pool.lock);
+        gfx_unlinkjobs(&jobs);
+        while(jobs.helpers > 0)
+            pthread_cond_wait(&gfx_pool.done, &gfx_pool.lock);
+        pthread_mutex_unlock(&gfx_pool.lock);
+        return;
+    }
+#endif
+    gfx_runjobs(&jobs);
+}
+
+/* how many jobs to split n pixels into, and where job i starts */
+
+static int gfx_nspans(int n)
+{
+    int nthreads = gfx_getthreads();
+    if(nthreads<=1)
+        return 1;
+    int njobs = n/gfx_MINSPAN;
+    if(njobs>gfx_JOBSPERTHREAD*nthreads)
+        njobs = gfx_JOBSPERTHREAD*nthreads;
+    return (njobs<1) ? 1 : njobs;
+}
+
+#define gfx_SPANSTART(n,njobs,job)  ((int)(((long long)(n)*(job))/(njobs)))
+
+/*
+ * The filters take RGBA canvases, and the ones that say so gray canvases 
+ * too.  Packed RGB canvases from qom_setoutputchannels(qm, 3) have 3 bytes 
+ * a pixel and are refused, as are gray canvases where RGBA is needed.
+ */
+static int gfx_canvas_check(gfx_canvas *c, int grayok, const char *name)
+{
+    if((c->channels == 4) || (grayok && (c->channels == 1)))
+        return 1;
+    fprintf(stderr, "%s: can't work on a %d channel canvas\n", name, c->channels);
+    return 0;
+}
+
 void gfx_canvas_print(gfx_canvas *c, const char *label)
 {
     fprintf(stderr, "gfx_canvas %s: sizex: %d sizey: %d\n", label, c->sizex, c->sizey); 
@@ -200,6 +613,8 @@ gfx_canvas *gfx_canvas_fromqoi(const char *filename)
 
 void gfx_canvas_toqoi(gfx_canvas *in, const char *filename)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_toqoi"))
+        return;
     qoi_desc desc;
     desc.width = in->sizex;
     desc.height = in->sizey;
@@ -220,6 +635,8 @@ gfx_canvas *gfx_canvas_frompng(const char *filename)
 
 void gfx_canvas_topng(gfx_canvas *in, const char *filename)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_topng"))
+        return;
     stbi_write_png(filename, in->sizex, in->sizey, 4, in->data, 4*in->sizex);
 }
 
@@ -236,22 +653,86 @@ gfx_canvas *gfx_canvas_fromjpeg(const char *filename)
 
 void gfx_canvas_tojpeg(gfx_canvas *in, const char *filename)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_tojpeg"))
+        return;
     stbi_write_jpg(filename, in->sizex, in->sizey, 4, in->data, 100);
 }
 
+/*
+ * Gray canvases hold one byte per pixel.  clone, resize, blur and mix 
+ * work on them as well as on RGBA canvases; the other filters take RGBA.
+ */
+static gfx_canvas *gfx_canvas_new_like(gfx_canvas *c, int sizex, int sizey)
+{
+    if(c->channels == 1)
+        return gfx_canvas_new_gray(sizex, sizey);
+    return gfx_canvas_new(sizex, sizey);
+}
+
 gfx_canvas *gfx_canvas_clone(gfx_canvas *c)
 {
-    gfx_canvas *cc = gfx_canvas_new(c->sizex, c->sizey);
-    memcpy(cc->data, c->data, c->sizex*c->sizey*sizeof(unsigned int));
+    if(!gfx_canvas_check(c, 1, "gfx_canvas_clone"))
+        return 0;
+    gfx_canvas *cc = gfx_canvas_new_like(c, c->sizex, c->sizey);
+    memcpy(cc->data, c->data, c->sizex*c->sizey*cc->channels);
     return cc;
 }
 
+/* a gray canvas of the luminance of in */
+
+typedef struct gfx_spanjob {
+    gfx_canvas *dst;
+    gfx_canvas *src;
+    const unsigned char *bytes;
+    const void *tab;
+    int n;
+    int njobs;
+    int a0, a1;
+    float f;
+} gfx_spanjob;
+
+/* run func over the sj->n pixels in spans on the shared threads */
+
+static void gfx_spans(gfx_spanjob *sj, void (*func)(void *arg, int job))
+{
+    sj->njobs = gfx_nspans(sj->n);
+    gfx_parallel(sj->njobs, func, sj);
+}
+
+static void gfx_lumspan(void *arg, int job)
+{
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    unsigned int *iptr = sj->src->data+start;
+    unsigned char *optr = (unsigned char *)sj->dst->data+start;
+    while(n--) {
+        *optr++ = gfx_ILUM(gfx_RVAL(*iptr), gfx_GVAL(*iptr), gfx_BVAL(*iptr));
+        iptr++;
+    }
+}
+
+gfx_canvas *gfx_canvas_lum(gfx_canvas *in)
+{
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_lum"))
+        return 0;
+    gfx_canvas *out = gfx_canvas_new_gray(in->sizex, in->sizey);
+    gfx_spanjob sj = { 0 };
+    sj.dst = out;
+    sj.src = in;
+    sj.n = in->sizex*in->sizey;
+    gfx_spans(&sj, gfx_lumspan);
+    return out;
+}
+
 void gfx_canvas_swap(gfx_canvas *a, gfx_canvas *b)
 {
     gfx_canvas temp;
     temp = *a;
     *a = *b;
     *b = temp;
+    b->refs = a->refs;                  /* the references stay with the canvas */
+    a->refs = temp.refs;
 }
 
 float gfx_canvas_diameter(gfx_canvas *in)
@@ -270,16 +751,63 @@ int gfx_canvas_sizecheck(gfx_canvas *c1, gfx_canvas *c2)
     return 1;
 }
 
+/*
+ * Resize in bands of output rows.  Each band is resized from the whole 
+ * input with the scale of the whole image and its first row as the 
+ * offset, which gives the same pixels as stbir_resize_uint8 does for 
+ * those rows.  A band only reads the input rows under its own rows plus 
+ * the filter margin, so bands are kept to at least gfx_MINBANDROWS rows.
+ */
+typedef struct gfx_resizejob {
+    gfx_canvas *in;
+    gfx_canvas *out;
+    int njobs;
+} gfx_resizejob;
+
+static void gfx_resizeband(void *arg, int job)
+{
+    gfx_resizejob *rj = (gfx_resizejob *)arg;
+    gfx_canvas *in = rj->in;
+    gfx_canvas *out = rj->out;
+    int y0 = gfx_SPANSTART(out->sizey, rj->njobs, job);
+    int y1 = gfx_SPANSTART(out->sizey, rj->njobs, job+1);
+    unsigned char *optr = (unsigned char *)out->data + y0*out->sizex*out->channels;
+    stbir_resize_subpixel(in->data, in->sizex, in->sizey, 0, optr, out->sizex, y1-y0, 0,
+                          STBIR_TYPE_UINT8, out->channels, STBIR_ALPHA_CHANNEL_NONE, 0,
+                          STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT,
+                          STBIR_COLORSPACE_LINEAR, 0, (float)out->sizex/in->sizex, (float)out->sizey/in->sizey, 0.0, y0);
+}
+
 gfx_canvas *gfx_canvas_resize(gfx_canvas *in, int sizex, int sizey)
 {
-    gfx_canvas *out = gfx_canvas_new(sizex, sizey);
-    stbir_resize_uint8((unsigned char *) in->data,  in->sizex,  in->sizey, 0,
-                       (unsigned char *)out->data, out->sizex, out->sizey, 0, 4);
+    if(!gfx_canvas_check(in, 1, "gfx_canvas_resize"))
+        return 0;
+    gfx_canvas *out = gfx_canvas_new_like(in, sizex, sizey);
+    int npixels = in->sizex*in->sizey;
+    if(npixels < sizex*sizey)
+        npixels = sizex*sizey;
+    int njobs = gfx_getthreads();
+    if(njobs > sizey/gfx_MINBANDROWS)
+        njobs = sizey/gfx_MINBANDROWS;
+    if(njobs > npixels/gfx_MINSPAN)
+        njobs = npixels/gfx_MINSPAN;
+    if(njobs > 1) {
+        gfx_resizejob rj;
+        rj.in = in;
+        rj.out = out;
+        rj.njobs = njobs;
+        gfx_parallel(njobs, gfx_resizeband, &rj);
+    } else {
+        stbir_resize_uint8((unsigned char *) in->data,  in->sizex,  in->sizey, 0,
+                           (unsigned char *)out->data, out->sizex, out->sizey, 0, out->channels);
+    }
     return out;
 }
 
 gfx_canvas *gfx_canvas_blur(gfx_canvas *in, float smalldiam) 
 {
+    if(!gfx_canvas_check(in, 1, "gfx_canvas_blur"))
+        return 0;
     float indiam = gfx_canvas_diameter(in);
     float scaledown = smalldiam/indiam;
     int smallsizex = round(scaledown*in->sizex);
@@ -290,27 +818,49 @@ gfx_canvas *gfx_canvas_blur(gfx_canvas *in, float smalldiam)
     return big;
 }
 
-void gfx_canvas_mix(gfx_canvas *dst, gfx_canvas *src, float factor)
+static void gfx_canvas_mixgray(unsigned char *dptr, const unsigned char *sptr, int n, int a0, int a1)
 {
-    int n;
-    unsigned int *dptr, *sptr;
-    int a0, a1, ia, pix;
+    if(a1 == 256) {
+        memcpy(dptr, sptr, n);
+    } else if((a1>0) && (a1<255)) {
+        while(n--) {
+            *dptr = gfx_ilerp(*dptr, a0, *sptr++, a1);
+            dptr++;
+        }
+    } else {
+        while(n--) {
+            *dptr = gfx_ilerplimit(*dptr, a0, *sptr++, a1);
+            dptr++;
+        }
+    }
+}
 
-    if(!gfx_canvas_sizecheck(dst, src))
-        return;
-    ia = round(256.0*factor);
-    if(ia==0)
+static void gfx_mixspan(void *arg, int job)
+{
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    int a0 = sj->a0;
+    int a1 = sj->a1;
+    if(sj->dst->channels == 1) {
+        gfx_canvas_mixgray((unsigned char *)sj->dst->data+start, (unsigned char *)sj->src->data+start, n, a0, a1);
         return;
-    a1 = ia;
-    a0 = 256-a1;
-    n = src->sizex * src->sizey;
-    dptr = dst->data;
-    sptr = src->data;
-    if(ia == 256) {
+    }
+    unsigned int *dptr = sj->dst->data+start;
+    unsigned int *sptr = sj->src->data+start;
+    if(a1 == 256) {
         while(n--) {
             *dptr++ = *sptr++;
         }
-    } else if((ia>0) && (ia<255)) {
+    } else if((a1>0) && (a1<255)) {
+#ifdef gfx_SIMD
+        if(gfx_simd) {
+            int done = gfx_mix_simd(dptr, sptr, n, a0, a1);
+            dptr += done;
+            sptr += done;
+            n -= done;
+        }
+#endif
         while(n--) {
             *dptr = gfx_CPACK(gfx_ilerp(gfx_RVAL(dptr[0]), a0, gfx_RVAL(sptr[0]), a1), 
                           gfx_ilerp(gfx_GVAL(dptr[0]), a0, gfx_GVAL(sptr[0]), a1), 
@@ -320,6 +870,14 @@ void gfx_canvas_mix(gfx_canvas *dst, gfx_canvas *src, float factor)
             sptr++;
         }
     } else {
+#ifdef gfx_SIMD
+        if(gfx_simd) {
+            int done = gfx_mix_simd(dptr, sptr, n, a0, a1);
+            dptr += done;
+            sptr += done;
+            n -= done;
+        }
+#endif
         while(n--) {
             *dptr = gfx_CPACK(gfx_ilerplimit(gfx_RVAL(dptr[0]), a0, gfx_RVAL(sptr[0]), a1), 
                           gfx_ilerplimit(gfx_GVAL(dptr[0]), a0, gfx_GVAL(sptr[0]), a1), 
@@ -331,6 +889,24 @@ void gfx_canvas_mix(gfx_canvas *dst, gfx_canvas *src, float factor)
     }
 }
 
+void gfx_canvas_mix(gfx_canvas *dst, gfx_canvas *src, float factor)
+{
+    if(!gfx_canvas_check(dst, 1, "gfx_canvas_mix"))
+        return;
+    if(!gfx_canvas_sizecheck(dst, src) || (dst->channels != src->channels))
+        return;
+    int ia = round(256.0*factor);
+    if(ia==0)
+        return;
+    gfx_spanjob sj = { 0 };
+    sj.dst = dst;
+    sj.src = src;
+    sj.n = src->sizex * src->sizey;
+    sj.a1 = ia;
+    sj.a0 = 256-ia;
+    gfx_spans(&sj, gfx_mixspan);
+}
+
 /* zoom */
 
 gfx_canvas *gfx_canvas_zoom(gfx_canvas *in, float x, float y)
@@ -347,13 +923,23 @@ gfx_canvas *gfx_canvas_zoom_to_size(gfx_canvas *in, float x, float y)
 
 /* saturate */
 
-void gfx_canvas_saturate(gfx_canvas *in, float sat)
+static void gfx_saturatespan(void *arg, int job)
 {
-    unsigned int *lptr = in->data;
-    int n = in->sizex*in->sizey;
-    int is = round(256.0*sat);
-    int a1 = is;
-    int a0 = 256-a1;
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    unsigned int *lptr = sj->dst->data+start;
+    float sat = sj->f;
+    int is = sj->a1;
+    int a1 = sj->a1;
+    int a0 = sj->a0;
+#ifdef gfx_SIMD
+    if(gfx_simd) {
+        int done = gfx_saturate_simd(lptr, n, a0, a1);
+        lptr += done;
+        n -= done;
+    }
+#endif
     if(is == 0) {
         while(n--) {
             int r = gfx_RVAL(*lptr);
@@ -384,10 +970,25 @@ void gfx_canvas_saturate(gfx_canvas *in, float sat)
     }
 }
 
+void gfx_canvas_saturate(gfx_canvas *in, float sat)
+{
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_saturate"))
+        return;
+    gfx_spanjob sj = { 0 };
+    sj.dst = in;
+    sj.n = in->sizex*in->sizey;
+    sj.f = sat;
+    sj.a1 = round(256.0*sat);
+    sj.a0 = 256-sj.a1;
+    gfx_spans(&sj, gfx_saturatespan);
+}
+
 /* sharpen */
 
 void gfx_canvas_sharpen(gfx_canvas *in, float smalldiam, float blend)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_sharpen"))
+        return;
     gfx_canvas *blur = gfx_canvas_blur(in, smalldiam);
     gfx_canvas_mix(in, blur, -blend);
     gfx_canvas_free(blur);
@@ -395,23 +996,27 @@ void gfx_canvas_sharpen(gfx_canvas *in, float smalldiam, float blend)
 
 /* gammawarp */
 
+void gfx_gammatab(unsigned char *tab, float gamma)
+{
+    for(int i=0; i<256; i++)
+        tab[i] = round(255.0*pow(i/255.0, gamma));
+}
+
+void gfx_canvas_apply_tab(gfx_canvas *in, unsigned char *tab);
+
 void gfx_canvas_gammawarp(gfx_canvas *in, float gamma)
 {
-    unsigned int *dptr = in->data;
-    int n = in->sizex*in->sizey;
-    while(n--) {
-        int r = round(255.0*pow(gfx_RVAL(*dptr)/255.0, gamma));
-        int g = round(255.0*pow(gfx_GVAL(*dptr)/255.0, gamma));
-        int b = round(255.0*pow(gfx_BVAL(*dptr)/255.0, gamma));
-        int a = gfx_AVAL(*dptr);
-        *dptr++ = gfx_CPACK(r, g, b, a);
-    }
+    unsigned char tab[256];
+    gfx_gammatab(tab, gamma);
+    gfx_canvas_apply_tab(in, tab);
 }
 
 /* softfocus */
 
 void gfx_canvas_softfocus(gfx_canvas *in, float smalldiam, float blend)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_softfocus"))
+        return;
     gfx_canvas *blur = gfx_canvas_blur(in, smalldiam);
     gfx_canvas_mix(in, blur, blend);
     gfx_canvas_free(blur);
@@ -419,64 +1024,125 @@ void gfx_canvas_softfocus(gfx_canvas *in, float smalldiam, float blend)
 
 /* enlighten */
 
-gfx_canvas *gfx_canvas_maxrgb(gfx_canvas *in)
+static void gfx_maxrgbspan(void *arg, int job)
 {
-    gfx_canvas *out = gfx_canvas_new(in->sizex, in->sizey);
-    unsigned int *iptr = in->data;
-    unsigned int *optr = out->data;
-    int n = in->sizex*in->sizey;
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    unsigned int *iptr = sj->src->data+start;
+    unsigned char *optr = (unsigned char *)sj->dst->data+start;
     while(n--) {
         int r = gfx_RVAL(*iptr);
         int g = gfx_GVAL(*iptr);
         int b = gfx_BVAL(*iptr);
-        int a = gfx_AVAL(*iptr);
         int max = r;
         if(max < g) max = g;
         if(max < b) max = b;
-        *optr = gfx_CPACK(max, max, max, a);
+        *optr = max;
         iptr++;
         optr++;
     }
+}
+
+gfx_canvas *gfx_canvas_maxrgb(gfx_canvas *in)
+{
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_maxrgb"))
+        return 0;
+    gfx_canvas *out = gfx_canvas_new_gray(in->sizex, in->sizey);
+    gfx_spanjob sj = { 0 };
+    sj.dst = out;
+    sj.src = in;
+    sj.n = in->sizex*in->sizey;
+    gfx_spans(&sj, gfx_maxrgbspan);
     return out;
 }
 
+/* the values of a map as one byte per pixel, from the red of RGBA maps */
+
+static const unsigned char *gfx_canvas_graybytes(gfx_canvas *map, unsigned char **tofree)
+{
+    *tofree = 0;
+    if(map->channels == 1)
+        return (const unsigned char *)map->data;
+    int n = map->sizex*map->sizey;
+    unsigned char *bytes = (unsigned char *)malloc(n);
+    for(int i=0; i<n; i++)
+        bytes[i] = gfx_RVAL(map->data[i]);
+    *tofree = bytes;
+    return bytes;
+}
+
+static void gfx_brightenspan(void *arg, int job)
+{
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    const float *scaletab = (const float *)sj->tab;
+    const unsigned char *bptr = sj->bytes+start;
+    unsigned int *iptr = sj->src->data+start;
+    unsigned int *optr = sj->dst->data+start;
+#ifdef gfx_SIMD
+    if(gfx_simd) {
+        int done = gfx_brighten_simd(optr, iptr, bptr, n, scaletab);
+        iptr += done;
+        optr += done;
+        bptr += done;
+        n -= done;
+    }
+#endif
+    while(n--) {
+        float scale = scaletab[*bptr];
+        int r = scale*gfx_RVAL(*iptr);
+        int g = scale*gfx_GVAL(*iptr);
+        int b = scale*gfx_BVAL(*iptr);
+        int a = gfx_AVAL(*iptr);
+        if(r>255) r = 255;
+        if(g>255) g = 255;
+        if(b>255) b = 255;
+        *optr = gfx_CPACK(r, g, b, a);
+        iptr++;
+        bptr++;
+        optr++;
+    }
+}
+
 gfx_canvas *gfx_canvas_brighten(gfx_canvas *in, gfx_canvas *maxrgbblur, float param)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_brighten") || !gfx_canvas_check(maxrgbblur, 1, "gfx_canvas_brighten"))
+        return 0;
+    if(!gfx_canvas_sizecheck(in, maxrgbblur))
+        return 0;
     float illummin = 1.0/gfx_flerp(1.0, 10.0, param*param);
     float illummax = 1.0/gfx_flerp(1.0, 1.111, param*param);
     gfx_canvas *out = gfx_canvas_new(in->sizex, in->sizey);
-    unsigned int *iptr = in->data;
-    unsigned int *bptr = maxrgbblur->data;
-    unsigned int *optr = out->data;
-    int n = in->sizex*in->sizey;
-    while(n--) {
-        float illum = gfx_RVAL(*bptr)/255.0;
-        int r = gfx_RVAL(*iptr);
-        int g = gfx_GVAL(*iptr);
-        int b = gfx_BVAL(*iptr);
-        int a = gfx_AVAL(*iptr);
+    unsigned char *tofree;
+    const unsigned char *bptr = gfx_canvas_graybytes(maxrgbblur, &tofree);
+    float scaletab[256];
+    for(int i=0; i<256; i++) {
+        float illum = i/255.0;
         if(illum < illummin)
             illum = illummin;
+        scaletab[i] = 1.0;
         if(illum < illummax) {
             float p = illum/illummax;
-            float scale = (0.4+p*0.6)*(illummax/illum);
-            r = scale*r;
-            if(r>255) r = 255;
-            g = scale*g;
-            if(g>255) g = 255;
-            b = scale*b;
-            if(b>255) b = 255;
+            scaletab[i] = (0.4+p*0.6)*(illummax/illum);
         }
-        *optr = gfx_CPACK(r, g, b, a);
-        iptr++;
-        bptr++;
-        optr++;
     }
+    gfx_spanjob sj = { 0 };
+    sj.dst = out;
+    sj.src = in;
+    sj.bytes = bptr;
+    sj.tab = scaletab;
+    sj.n = in->sizex*in->sizey;
+    gfx_spans(&sj, gfx_brightenspan);
+    free(tofree);
     return out;
 }
 
 gfx_canvas *gfx_canvas_enlighten(gfx_canvas *in, float smalldiam, float param)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_enlighten"))
+        return 0;
     // make a b/w image that has max of [r, g, b] of the input
     gfx_canvas *maxrgb = gfx_canvas_maxrgb(in);
 
@@ -492,10 +1158,13 @@ gfx_canvas *gfx_canvas_enlighten(gfx_canvas *in, float smalldiam, float param)
 
 /* expand */
 
-void gfx_canvas_apply_tab(gfx_canvas *in, unsigned char *tab)
+static void gfx_tabspan(void *arg, int job)
 {
-    unsigned int *lptr = in->data;
-    int n = in->sizex*in->sizey;
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    const unsigned char *tab = (const unsigned char *)sj->tab;
+    unsigned int *lptr = sj->dst->data+start;
     while(n) {
         *lptr = gfx_CPACK(tab[gfx_RVAL(lptr[0])], tab[gfx_GVAL(lptr[0])], tab[gfx_BVAL(lptr[0])], gfx_AVAL(lptr[0]));
         lptr++;
@@ -503,10 +1172,19 @@ void gfx_canvas_apply_tab(gfx_canvas *in, unsigned char *tab)
     }
 }
 
-void gfx_canvas_expand(gfx_canvas *in, float min, float max)
+void gfx_canvas_apply_tab(gfx_canvas *in, unsigned char *tab)
 {
-    unsigned char tab[256];
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_apply_tab"))
+        return;
+    gfx_spanjob sj = { 0 };
+    sj.dst = in;
+    sj.tab = tab;
+    sj.n = in->sizex*in->sizey;
+    gfx_spans(&sj, gfx_tabspan);
+}
 
+void gfx_expandtab(unsigned char *tab, float min, float max)
+{
     float delta = max-min;
     if(delta<0.0001)
         delta = 0.0001;
@@ -516,6 +1194,12 @@ void gfx_canvas_expand(gfx_canvas *in, float min, float max)
         if(val<0) val = 0;
         tab[i] = val;
     }
+}
+
+void gfx_canvas_expand(gfx_canvas *in, float min, float max)
+{
+    unsigned char tab[256];
+    gfx_expandtab(tab, min, max);
     gfx_canvas_apply_tab(in, tab);
 }
 
@@ -623,14 +1307,25 @@ void gfx_histcalc(gfx_hist *h)
     }
 }
 
-gfx_hist *gfx_canvas_hist(gfx_canvas *c, int chan)
+/* each span counts into its own row of counts, and these are added up after */
+
+typedef struct gfx_histjob {
+    gfx_canvas *c;
+    int chan;
+    int n;
+    int njobs;
+    double (*counts)[256];
+} gfx_histjob;
+
+static void gfx_histspan(void *arg, int job)
 {
-    gfx_hist *h = gfx_histnew();
-    unsigned int *lptr = c->data;
-    int n = c->sizex * c->sizey;
-    double *cptr = h->count;
+    gfx_histjob *hj = (gfx_histjob *)arg;
+    int start = gfx_SPANSTART(hj->n, hj->njobs, job);
+    int n = gfx_SPANSTART(hj->n, hj->njobs, job+1)-start;
+    unsigned int *lptr = hj->c->data+start;
+    double *cptr = hj->counts[job];
     double one = 1.0;
-    switch(chan) {
+    switch(hj->chan) {
         case gfx_CHAN_R:
             while(n--) {
                 cptr[gfx_RVAL(*lptr)] += one;
@@ -657,6 +1352,25 @@ gfx_hist *gfx_canvas_hist(gfx_canvas *c, int chan)
                 lptr++;
             }
     }
+}
+
+gfx_hist *gfx_canvas_hist(gfx_canvas *c, int chan)
+{
+    if(!gfx_canvas_check(c, 0, "gfx_canvas_hist"))
+        return gfx_histnew();
+    gfx_hist *h = gfx_histnew();
+    gfx_histjob hj;
+    hj.c = c;
+    hj.chan = chan;
+    hj.n = c->sizex * c->sizey;
+    hj.njobs = gfx_nspans(hj.n);
+    hj.counts = (double (*)[256])calloc(hj.njobs, 256*sizeof(double));
+    gfx_parallel(hj.njobs, gfx_histspan, &hj);
+    for(int job=0; job<hj.njobs; job++) {
+        for(int i=0; i<256; i++)
+            h->count[i] += hj.counts[job][i];
+    }
+    free(hj.counts);
     h->dirty = 1;
     return h;
 }
@@ -719,6 +1433,11 @@ void getminmax(gfx_hist *hr, gfx_hist *hg, gfx_hist *hb, float min, float max, i
 
 void gfx_canvas_perhistvals(gfx_canvas *c, float min, float max, float *emin, float *emax)
 {
+    if(!gfx_canvas_check(c, 0, "gfx_canvas_perhistvals")) {
+        *emin = 0.0;
+        *emax = 1.0;
+        return;
+    }
     int imin, imax;
 
     gfx_hist *hr = gfx_canvas_hist(c, gfx_CHAN_R);
@@ -752,6 +1471,8 @@ void gfx_canvas_perhistvals(gfx_canvas *c, float min, float max, float *emin, fl
 
 void gfx_canvas_perhist(gfx_canvas *c, float min, float max)
 {
+    if(!gfx_canvas_check(c, 0, "gfx_canvas_perhist"))
+        return;
     float emin, emax;
     gfx_canvas_perhistvals(c, min, max, &emin, &emax);
     gfx_canvas_expand(c, emin, emax);
@@ -759,27 +1480,203 @@ void gfx_canvas_perhist(gfx_canvas *c, float min, float max)
 
 /* scalergb */
 
+void gfx_scaletab(unsigned char *tab, float scale)
+{
+    for(int i=0; i<256; i++) {
+        int val = round(i*scale);
+        if(val>255) val = 255;
+        if(val<0) val = 0;
+        tab[i] = val;
+    }
+}
+
 void gfx_canvas_scalergba(gfx_canvas *in, float scaler, float scaleg, float scaleb, float scalea)
 {
-    unsigned int *dptr = in->data;
-    int n = in->sizex*in->sizey;
+    gfx_pointops *p = gfx_pointops_new();
+    gfx_pointops_scalergba(p, scaler, scaleg, scaleb, scalea);
+    gfx_pointops_apply(p, in);
+    gfx_pointops_free(p);
+}
+
+/* 
+ * Point ops.  A gfx_pointops collects a chain of per-pixel filters and 
+ * applies them in one pass over the canvas.  Filters that map each 
+ * channel on its own are composed into one table per channel, so any 
+ * run of expand, gammawarp and scalergba costs one lookup per channel; 
+ * saturate mixes the channels, so it stays a step of its own between 
+ * tables.  The result is the same as running the filters one by one.  
+ * The steps are kept in an array that grows as the chain does.
+ */
+typedef struct gfx_pointstep {
+    int saturate;                       /* else tab */
+    int a0, a1, limit;
+    unsigned char tab[4][256];
+} gfx_pointstep;
+
+struct gfx_pointops {
+    int nsteps;
+    int stepalloc;
+    gfx_pointstep *steps;
+};
+
+gfx_pointops *gfx_pointops_new(void)
+{
+    gfx_pointops *p = (gfx_pointops *)malloc(sizeof(gfx_pointops));
+    p->nsteps = 0;
+    p->stepalloc = 0;
+    p->steps = 0;
+    return p;
+}
+
+void gfx_pointops_free(gfx_pointops *p)
+{
+    if(!p)
+        return;
+    free(p->steps);
+    free(p);
+}
+
+/* a new step at the end of the chain */
+
+static gfx_pointstep *gfx_pointops_newstep(gfx_pointops *p)
+{
+    if(p->nsteps == p->stepalloc) {
+        p->stepalloc = p->stepalloc ? 2*p->stepalloc : 4;
+        p->steps = (gfx_pointstep *)realloc(p->steps, p->stepalloc*sizeof(gfx_pointstep));
+    }
+    return p->steps+p->nsteps++;
+}
+
+int gfx_pointops_empty(gfx_pointops *p)
+{
+    return p->nsteps == 0;
+}
+
+void gfx_pointops_tab(gfx_pointops *p, const unsigned char *rtab, const unsigned char *gtab, const unsigned char *btab, const unsigned char *atab)
+{
+    const unsigned char *tabs[4] = { rtab, gtab, btab, atab };
+    gfx_pointstep *st = p->nsteps ? p->steps+p->nsteps-1 : 0;
+    if(!st || st->saturate) {
+        st = gfx_pointops_newstep(p);
+        st->saturate = 0;
+        for(int c=0; c<4; c++)
+            for(int i=0; i<256; i++)
+                st->tab[c][i] = tabs[c] ? tabs[c][i] : i;
+        return;
+    }
+    for(int c=0; c<4; c++) {
+        if(tabs[c]) {
+            for(int i=0; i<256; i++)
+                st->tab[c][i] = tabs[c][st->tab[c][i]];
+        }
+    }
+}
+
+void gfx_pointops_saturate(gfx_pointops *p, float sat)
+{
+    gfx_pointstep *st = gfx_pointops_newstep(p);
+    st->saturate = 1;
+    st->a1 = round(256.0*sat);
+    st->a0 = 256-st->a1;
+    st->limit = !(sat>0.0 && sat<1.0);
+}
+
+void gfx_pointops_expand(gfx_pointops *p, float min, float max)
+{
+    unsigned char tab[256];
+    gfx_expandtab(tab, min, max);
+    gfx_pointops_tab(p, tab, tab, tab, 0);
+}
+
+void gfx_pointops_gammawarp(gfx_pointops *p, float gamma)
+{
+    unsigned char tab[256];
+    gfx_gammatab(tab, gamma);
+    gfx_pointops_tab(p, tab, tab, tab, 0);
+}
+
+void gfx_pointops_scalergba(gfx_pointops *p, float scaler, float scaleg, float scaleb, float scalea)
+{
+    unsigned char rtab[256], gtab[256], btab[256], atab[256];
+    gfx_scaletab(rtab, scaler);
+    gfx_scaletab(gtab, scaleg);
+    gfx_scaletab(btab, scaleb);
+    gfx_scaletab(atab, scalea);
+    gfx_pointops_tab(p, rtab, gtab, btab, atab);
+}
+
+/* saturate one pixel, as gfx_canvas_saturate does */
+
+static void gfx_saturatepixel(int *r, int *g, int *b, const gfx_pointstep *st)
+{
+    int lum = gfx_ILUM(*r, *g, *b);
+    int a0 = st->a0;
+    int a1 = st->a1;
+    if(a1 == 0) {
+        *r = *g = *b = lum;
+    } else if(!st->limit) {
+        *r = gfx_ilerp(lum, a0, *r, a1);
+        *g = gfx_ilerp(lum, a0, *g, a1);
+        *b = gfx_ilerp(lum, a0, *b, a1);
+    } else {
+        *r = gfx_ilerplimit(lum, a0, *r, a1);
+        *g = gfx_ilerplimit(lum, a0, *g, a1);
+        *b = gfx_ilerplimit(lum, a0, *b, a1);
+    }
+}
+
+static void gfx_pointopsspan(void *arg, int job)
+{
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    const gfx_pointops *p = (const gfx_pointops *)sj->tab;
+    unsigned int *lptr = sj->dst->data+start;
+    int nsteps = p->nsteps;
+    if((nsteps == 1) && !p->steps[0].saturate) {
+        const unsigned char (*tab)[256] = p->steps[0].tab;
+        while(n--) {
+            *lptr = gfx_CPACK(tab[0][gfx_RVAL(*lptr)], tab[1][gfx_GVAL(*lptr)], tab[2][gfx_BVAL(*lptr)], tab[3][gfx_AVAL(*lptr)]);
+            lptr++;
+        }
+        return;
+    }
     while(n--) {
-        int r = round(gfx_RVAL(*dptr)*scaler);
-        int g = round(gfx_GVAL(*dptr)*scaleg);
-        int b = round(gfx_BVAL(*dptr)*scaleb);
-        int a = round(gfx_AVAL(*dptr)*scaleb);
-        if(r>255) r = 255;
-        if(g>255) g = 255;
-        if(b>255) b = 255;
-        if(a>255) a = 255;
-        if(r<0) r = 0;
-        if(g<0) g = 0;
-        if(b<0) b = 0;
-        if(a<0) a = 0;
-        *dptr++ = gfx_CPACK(r, g, b, a);
+        int r = gfx_RVAL(*lptr);
+        int g = gfx_GVAL(*lptr);
+        int b = gfx_BVAL(*lptr);
+        int a = gfx_AVAL(*lptr);
+        for(int i=0; i<nsteps; i++) {
+            const gfx_pointstep *st = p->steps+i;
+            if(st->saturate) {
+                gfx_saturatepixel(&r, &g, &b, st);
+            } else {
+                r = st->tab[0][r];
+                g = st->tab[1][g];
+                b = st->tab[2][b];
+                a = st->tab[3][a];
+            }
+        }
+        *lptr++ = gfx_CPACK(r, g, b, a);
     }
 }
 
+/* run the chain over c and empty it */
+
+void gfx_pointops_apply(gfx_pointops *p, gfx_canvas *c)
+{
+    if(!gfx_canvas_check(c, 0, "gfx_pointops_apply"))
+        return;
+    if(p->nsteps == 0)
+        return;
+    gfx_spanjob sj = { 0 };
+    sj.dst = c;
+    sj.tab = p;
+    sj.n = c->sizex*c->sizey;
+    gfx_spans(&sj, gfx_pointopsspan);
+    p->nsteps = 0;
+}
+
 /* chromablur */
 
 void gfx_noblack(int *r, int *g, int *b)
@@ -798,10 +1695,19 @@ void gfx_noblack(int *r, int *g, int *b)
     }
 }
 
-void gfx_canvas_noblack(gfx_canvas *c)
+static void gfx_noblackspan(void *arg, int job)
 {
-    unsigned int *lptr = c->data;
-    int n = c->sizex*c->sizey;
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    unsigned int *lptr = sj->dst->data+start;
+#ifdef gfx_SIMD
+    if(gfx_simd) {
+        int done = gfx_noblack_simd(lptr, n);
+        lptr += done;
+        n -= done;
+    }
+#endif
     while(n--) {
         int r = gfx_RVAL(*lptr);
         int g = gfx_GVAL(*lptr);
@@ -812,6 +1718,16 @@ void gfx_canvas_noblack(gfx_canvas *c)
     }
 }
 
+void gfx_canvas_noblack(gfx_canvas *c)
+{
+    if(!gfx_canvas_check(c, 0, "gfx_canvas_noblack"))
+        return;
+    gfx_spanjob sj = { 0 };
+    sj.dst = c;
+    sj.n = c->sizex*c->sizey;
+    gfx_spans(&sj, gfx_noblackspan);
+}
+
 #define gfx_LINSTEPS        (16*256)
 #define gfx_GAMSTEPS        (256)
 
@@ -822,33 +1738,58 @@ static short *gfx_BLUMTAB;
 
 #define gfx_ILUMLIN(r,g,b)          (gfx_TOGAMTAB[gfx_RLUMTAB[(r)]+gfx_GLUMTAB[(g)]+gfx_BLUMTAB[(b)]])
 
-void gfx_canvas_setlum(gfx_canvas *c, gfx_canvas *l)
+/* the tables are built once, by whichever thread gets here first */
+
+static void gfx_initlumtabs(void)
 {
     float sc;
 
-    if(!gfx_canvas_sizecheck(c, l))
-        return;
-    if(!gfx_TOGAMTAB) {
-        gfx_TOGAMTAB = (unsigned char *)malloc(gfx_LINSTEPS*sizeof(char));
-        for(int i=0; i<gfx_LINSTEPS; i++)
-            gfx_TOGAMTAB[i] = round(255.0*pow(i/(gfx_LINSTEPS-1.0), gfx_DEFINVGAMMA));
-        gfx_RLUMTAB = (short *)malloc(gfx_GAMSTEPS*sizeof(short));
-        sc = (gfx_LINSTEPS-1.0)*gfx_RLUM;
-        for(int i=0; i<gfx_GAMSTEPS; i++)
-            gfx_RLUMTAB[i] = round(sc*pow(i/(gfx_GAMSTEPS-1.0), gfx_DEFGAMMA));
-        gfx_GLUMTAB = (short *)malloc(gfx_GAMSTEPS*sizeof(short));
-        sc = (gfx_LINSTEPS-1.0)*gfx_GLUM;
-        for(int i=0; i<gfx_GAMSTEPS; i++)
-            gfx_GLUMTAB[i] = round(sc*pow(i/(gfx_GAMSTEPS-1.0), gfx_DEFGAMMA));
-        gfx_BLUMTAB = (short *)malloc(gfx_GAMSTEPS*sizeof(short));
-        sc = (gfx_LINSTEPS-1.0)*gfx_BLUM;
-        for(int i=0; i<gfx_GAMSTEPS; i++)
-            gfx_BLUMTAB[i] = round(sc*pow(i/(gfx_GAMSTEPS-1.0), gfx_DEFGAMMA));
-    }
+    gfx_TOGAMTAB = (unsigned char *)malloc(gfx_LINSTEPS*sizeof(char));
+    for(int i=0; i<gfx_LINSTEPS; i++)
+        gfx_TOGAMTAB[i] = round(255.0*pow(i/(gfx_LINSTEPS-1.0), gfx_DEFINVGAMMA));
+    gfx_RLUMTAB = (short *)malloc(gfx_GAMSTEPS*sizeof(short));
+    sc = (gfx_LINSTEPS-1.0)*gfx_RLUM;
+    for(int i=0; i<gfx_GAMSTEPS; i++)
+        gfx_RLUMTAB[i] = round(sc*pow(i/(gfx_GAMSTEPS-1.0), gfx_DEFGAMMA));
+    gfx_GLUMTAB = (short *)malloc(gfx_GAMSTEPS*sizeof(short));
+    sc = (gfx_LINSTEPS-1.0)*gfx_GLUM;
+    for(int i=0; i<gfx_GAMSTEPS; i++)
+        gfx_GLUMTAB[i] = round(sc*pow(i/(gfx_GAMSTEPS-1.0), gfx_DEFGAMMA));
+    gfx_BLUMTAB = (short *)malloc(gfx_GAMSTEPS*sizeof(short));
+    sc = (gfx_LINSTEPS-1.0)*gfx_BLUM;
+    for(int i=0; i<gfx_GAMSTEPS; i++)
+        gfx_BLUMTAB[i] = round(sc*pow(i/(gfx_GAMSTEPS-1.0), gfx_DEFGAMMA));
+}
+
+#ifndef IMGPROC_NO_THREADS
+static pthread_once_t gfx_lumtabsonce = PTHREAD_ONCE_INIT;
+#endif
+
+static void gfx_lumtabs(void)
+{
+#ifndef IMGPROC_NO_THREADS
+    pthread_once(&gfx_lumtabsonce, gfx_initlumtabs);
+#else
+    if(!gfx_TOGAMTAB)
+        gfx_initlumtabs();
+#endif
+}
 
-    unsigned int *cptr = c->data;
-    unsigned int *lptr = l->data;
-    int n = c->sizex*c->sizey;
+static void gfx_setlumspan(void *arg, int job)
+{
+    gfx_spanjob *sj = (gfx_spanjob *)arg;
+    int start = gfx_SPANSTART(sj->n, sj->njobs, job);
+    int n = gfx_SPANSTART(sj->n, sj->njobs, job+1)-start;
+    const unsigned char *lptr = sj->bytes+start;
+    unsigned int *cptr = sj->dst->data+start;
+#ifdef gfx_SIMD
+    if(gfx_simd) {
+        int done = gfx_setlum_simd(cptr, lptr, n, gfx_TOGAMTAB, gfx_RLUMTAB, gfx_GLUMTAB, gfx_BLUMTAB);
+        cptr += done;
+        lptr += done;
+        n -= done;
+    }
+#endif
     while(n--) {
         int r = gfx_RVAL(*cptr);
         int g = gfx_GVAL(*cptr);
@@ -856,7 +1797,7 @@ void gfx_canvas_setlum(gfx_canvas *c, gfx_canvas *l)
         int a = gfx_AVAL(*cptr);
         gfx_noblack(&r, &g, &b);
         int lum = gfx_ILUMLIN(r, g, b);
-        int wantlum = gfx_RVAL(*lptr++);
+        int wantlum = *lptr++;
         if(wantlum<=lum) {
             if(lum>0) {
                 r = (r * wantlum)/lum;
@@ -879,10 +1820,27 @@ void gfx_canvas_setlum(gfx_canvas *c, gfx_canvas *l)
     }
 }
 
+void gfx_canvas_setlum(gfx_canvas *c, gfx_canvas *l)
+{
+    if(!gfx_canvas_check(c, 0, "gfx_canvas_setlum") || !gfx_canvas_check(l, 1, "gfx_canvas_setlum"))
+        return;
+    if(!gfx_canvas_sizecheck(c, l))
+        return;
+    gfx_lumtabs();
+    unsigned char *tofree;
+    gfx_spanjob sj = { 0 };
+    sj.dst = c;
+    sj.bytes = gfx_canvas_graybytes(l, &tofree);
+    sj.n = c->sizex*c->sizey;
+    gfx_spans(&sj, gfx_setlumspan);
+    free(tofree);
+}
+
 void gfx_canvas_chromablur(gfx_canvas *in, float smalldiam)
 {
-    gfx_canvas *lum = gfx_canvas_clone(in);
-    gfx_canvas_saturate(lum, 0.0);
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_chromablur"))
+        return;
+    gfx_canvas *lum = gfx_canvas_lum(in);
     gfx_canvas *temp = gfx_canvas_clone(in);
     gfx_canvas_noblack(temp);
     gfx_canvas *blur = gfx_canvas_blur(temp, smalldiam);
@@ -1037,6 +1995,8 @@ void gfx_canvas_copy_offset(gfx_canvas *scan, gfx_canvas *dcan, int offsetx, int
 
 void gfx_canvas_addframe(gfx_canvas *in, int width, float r, float g, float b, float a)
 {
+    if(!gfx_canvas_check(in, 0, "gfx_canvas_addframe"))
+        return;
     if(width<1)
         return;
     int sizex = in->sizex;
@@ -1104,15 +2064,31 @@ static float *gfx_softweights(float width, int n)
     return buf;
 }
 
-void gfx_canvas_softedge(gfx_canvas *c, float width)
+typedef struct gfx_softedgejob {
+    gfx_canvas *c;
+    const float *wx;
+    const float *wy;
+    int njobs;
+} gfx_softedgejob;
+
+static void gfx_softedgeband(void *arg, int job)
 {
-    int sizex = c->sizex;
-    int sizey = c->sizey;
-    float *wx = gfx_softweights(width, sizex);
-    float *wy = gfx_softweights(width, sizey);
-    unsigned int *dptr = c->data;
-    for(int y=0; y<sizey; y++) {
-        for(int x=0; x<sizex; x++) {
+    gfx_softedgejob *sj = (gfx_softedgejob *)arg;
+    int sizex = sj->c->sizex;
+    int y0 = gfx_SPANSTART(sj->c->sizey, sj->njobs, job);
+    int y1 = gfx_SPANSTART(sj->c->sizey, sj->njobs, job+1);
+    const float *wx = sj->wx;
+    const float *wy = sj->wy;
+    unsigned int *dptr = sj->c->data+y0*sizex;
+    for(int y=y0; y<y1; y++) {
+        int x = 0;
+#ifdef gfx_SIMD
+        if(gfx_simd) {
+            x = gfx_softedge_simd(dptr, wx, wy[y], sizex);
+            dptr += x;
+        }
+#endif
+        for(; x<sizex; x++) {
             float alpha = wx[x] * wy[y];
             int r = alpha*gfx_RVAL(*dptr);
             int g = alpha*gfx_GVAL(*dptr);
@@ -1121,6 +2097,22 @@ void gfx_canvas_softedge(gfx_canvas *c, float width)
             *dptr++ = gfx_CPACK(r, g, b, a);
         }
     }
+}
+
+void gfx_canvas_softedge(gfx_canvas *c, float width)
+{
+    if(!gfx_canvas_check(c, 0, "gfx_canvas_softedge"))
+        return;
+    float *wx = gfx_softweights(width, c->sizex);
+    float *wy = gfx_softweights(width, c->sizey);
+    gfx_softedgejob sj;
+    sj.c = c;
+    sj.wx = wx;
+    sj.wy = wy;
+    sj.njobs = gfx_nspans(c->sizex*c->sizey);
+    if(sj.njobs > c->sizey)
+        sj.njobs = c->sizey;
+    gfx_parallel(sj.njobs, gfx_softedgeband, &sj);
     free(wx);
     free(wy);
 }
@@ -1139,6 +2131,8 @@ void gfx_canvas_copyto(gfx_canvas *src, gfx_Rect sr, gfx_canvas *dst)
 
 void gfx_canvas_set_aspect(gfx_canvas *c, float aspect)
 {
+    if(!gfx_canvas_check(c, 0, "gfx_canvas_set_aspect"))
+        return;
     gfx_canvas *out;
     gfx_Rect r = gfx_RectAspectInside(gfx_canvas_Rect(c), aspect);
     out = gfx_canvas_new(r.sizex, r.sizey);
@@ -54,6 +54,14 @@ Builds on top of Dominic Szablewski's QOI libary to store sequnces of images.
 //        qom_putframenow(qm, c);
 //    qom_close(qm);
 //
+//  write a movie a few rows at a time
+//
+//    qom *qm = qom_open( "out.qom", "w");
+//        qom_putframe_begin(qm, 400, 300, usec);
+//            qom_putframe_rows(qm, rows, nrows);
+//        qom_putframe_end(qm);
+//    qom_close(qm);
+//
 //  read a movie
 //
 //    qom *qm = qom_open( "out.qom", "r");
@@ -92,6 +100,15 @@ Builds on top of Dominic Szablewski's QOI libary to store sequnces of images.
 //    int frameencoding3;
 //    QOI frame3
 //
+//    int tag;                           side record (optional)
+//    int frameno;
+//    int size;
+//    side data
+//
+//    int nside;                         side trailer (optional)
+//    int side_offset;
+//    int side_magic;
+//
 //    unsigned int time_lo;              frameinfo1
 //    unsigned int time_hi;           
 //    int encoding;
@@ -119,6 +136,19 @@ Builds on top of Dominic Szablewski's QOI libary to store sequnces of images.
 //    int size;
 //    int encoding_usec;
 //
+//    Side records sit between the last frame and the frameinfo.  Readers
+//    that don't know about them find the frameinfo from the end of the
+//    file and never see them.  A restart side record holds decoder
+//    snapshots taken every few rows of a QOI frame, so one frame can be
+//    decoded by several threads at once:
+//
+//    int restartrows;                   restart side record
+//    int nrestarts;
+//    int offset;                        restart1
+//    int run;
+//    int px;
+//    int index[64];
+//
 
 */
 
@@ -128,6 +158,13 @@ Header - Public functions */
 #ifndef QOM_H
 #define QOM_H
 
+#if defined(QOM_IMPLEMENTATION) && defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE                     /* for O_DIRECT, if qom.h comes before other system headers */
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -135,12 +172,24 @@ extern "C" {
 typedef struct gfx_canvas {
     unsigned int *data;
     int sizex, sizey;
+    int channels;                       /* 4, 3 for packed RGB bytes from qom_getframe, 1 for gray bytes */
+    int refs;                           /* gfx_canvas_free only frees the last reference */
+    int pooled;                         /* data came from qom_alloc */
 } gfx_canvas;
 
 #define qomENCODING_LITERAL     (0)
 #define qomENCODING_QOI         (1)
 #define qomENCODING_PNG         (2)
 #define qomENCODING_JPG         (3)     /* no transparency */
+#define qomENCODING_PALETTE     (4)     /* up to 256 colors, others are stored as QOI */
+#define qomENCODING_PREDICT     (5)     /* YCoCg-R and a predictor per row, for photographs */
+#define qomENCODING_PROGRESSIVE (6)     /* Adam7 passes, so a preview needs only the first */
+#define qomENCODING_RGB565      (7)     /* 16 bit pixels, opaque */
+#define qomENCODING_RGBA4444    (8)
+#define qomENCODING_YUV420      (9)     /* YCbCr planes, chroma at half size, for camera pictures */
+
+#define qomEFFORT_FAST          (0)     /* qomENCODING_PREDICT picks predictors by a guess */
+#define qomEFFORT_HIGH          (1)     /* tries each predictor */
 
 #define qomSTART_DIR_STILL      (0)
 #define qomSTART_DIR_INC        (1)
@@ -159,6 +208,7 @@ typedef struct gfx_canvas {
 #define qomERROR_PUTFRAME_WHILE_READ    (6)
 #define qomERROR_GETFRAME_WHILE_WRITE   (7)
 #define qomERROR_FORMAT                 (8)
+#define qomERROR_RANGE                  (9)
 
 typedef struct qom_header {
     int magic;                          /* magic number */
@@ -185,6 +235,71 @@ typedef struct qom_frameinfo {
     int encoding_usec;                  /* the time used to encode and write the data */
 } qom_frameinfo;
 
+typedef struct qom_restart {
+    int offset;                         /* offset of the next op in the QOI data */
+    int run;                            /* pixels left in an open run */
+    unsigned int px;                    /* previous pixel */
+    unsigned int index[64];             /* color index */
+} qom_restart;
+
+typedef struct qom_frameside {
+    int restartrows;                    /* rows between restart points */
+    int nrestarts;
+    qom_restart *restarts;
+    int channels;                       /* 3 if the frame is opaque, 0 if not known */
+    int tolerance;                      /* largest error in R, G or B of a near-lossless frame, 0 if exact */
+    int cropx, cropy;                   /* where a cropped frame goes in the frame it was cut from */
+    int fullsizex, fullsizey;           /* size of that frame, 0 if the frame is not cropped */
+} qom_frameside;
+
+#define qomSIDE_RESTARTS        (1)
+#define qomSIDE_CHANNELS        (2)
+#define qomSIDE_TOLERANCE       (3)
+#define qomSIDE_CROP            (4)
+
+#define qomRESTART_AUTO         (-1)
+#define qomRESTART_NONE         (0)
+#define qomRESTART_PIXELS       (256*1024)  /* pixels between restart points for qomRESTART_AUTO */
+
+typedef void (*qom_rowfunc)(void *arg, int y, const unsigned int *row, int sizex);
+
+typedef struct qom_rowdecoder {
+    int sizex, sizey;                   /* from the QOI header */
+    int x, y;                           /* next pixel */
+    int run;
+    unsigned int px;
+    unsigned int index[64];
+    unsigned char carry[16];            /* header or op split between pushes */
+    int ncarry;
+    unsigned int *row;
+    qom_rowfunc func;
+    void *arg;
+    int error;
+} qom_rowdecoder;
+
+#define QOM_READ_CHUNK          (64*1024)
+
+#define qomFORMAT_RGBA          (0)     /* 4 bytes per pixel, like gfx_canvas */
+#define qomFORMAT_BGRA          (1)
+#define qomFORMAT_RGB           (2)     /* 3 bytes per pixel, opaque */
+#define qomFORMAT_RGBX          (3)     /* 4 bytes per pixel, opaque: alpha is ignored on input, 255 on output */
+#define qomFORMAT_BGRX          (4)
+#define qomFORMAT_ALPHA         (5)     /* 1 byte per pixel, output only */
+#define qomFORMAT_RGB565        (6)     /* 2 bytes per pixel, output only */
+#define qomFORMAT_RGBA4444      (7)
+#define qomFORMAT_RGBA_PREMUL   (8)     /* 4 bytes per pixel, color multiplied by alpha, output only */
+#define qomFORMAT_BGRA_PREMUL   (9)
+
+typedef struct qom_bundle {
+    const unsigned char *data;          /* the mapped file */
+    long size;
+    int nmovies;
+    int nslots;                         /* of the hashed name directory */
+    const unsigned char *slots;
+    const unsigned char *entries;
+    const char *names;
+} qom_bundle;
+
 #define QIOM_HEADER_SIZE        (sizeof(qom_header))
 #define QIOM_FRAME_SIZE         (sizeof(qom_frame))
 
@@ -197,34 +312,147 @@ typedef struct qom {
     qom_header header;
     int mode;
     FILE *f;
+    const unsigned char *mem;           /* bytes of a movie opened from memory, instead of f */
+    long membase;                       /* file offset of mem[0] */
+    long memsize;                       /* file offset of the end of mem */
+    long mempos;
     int error;
     int offset;
     double firstframe_usec;
     int output_encoding;
     qom_frameinfo *frames;
+    qom_frameside *sides;
     int framealloc;
+    int restartrows;
+    int nthreads;
+    int input_format;                   /* of the rows given to qom_putframe_rows */
+    int output_format;                  /* of the canvases from qom_getframe */
+    int effort;                         /* qomEFFORT_FAST or qomEFFORT_HIGH */
+    int tolerance;                      /* of near-lossless QOI frames, 0 for exact */
+    int crop;                           /* store frames cropped to their visible pixels */
+    int dither;                         /* dither 16 bit frames as they are reduced */
+    struct qom_rowframe *rowframe;      /* frame being written a few rows at a time */
+    struct qom_segments *segments;      /* of a movie kept in several files, with a manifest */
+    unsigned char *batch;               /* bytes of the frames read by qom_getframes */
+    long batchalloc;
+    char *filename;                     /* of a movie opened for reading */
+    int fd;                             /* for reads by a qom_reader, -1 until then */
+    int fddirect;                       /* fd was opened with O_DIRECT */
+    int writebehind;                    /* size of the write-behind buffers, 0 to write through stdio */
+    long preallocate;                   /* bytes to reserve for each file written */
+    int sync;                           /* qomSYNC_NONE, qomSYNC_CLOSE or fdatasync every sync frames */
+    struct _qom_writer *writer;         /* write-behind buffers of the file being written */
 } qom;
 
 gfx_canvas *gfx_canvas_new(int sizex, int sizey);
+gfx_canvas *gfx_canvas_new_gray(int sizex, int sizey);
 gfx_canvas *gfx_canvas_new_withdata(int sizex, int sizey, void *data);
+gfx_canvas *gfx_canvas_ref(gfx_canvas *c);
 void gfx_canvas_free(gfx_canvas *c);
 
+typedef void *(*qom_allocfunc)(size_t size, void *arg);
+typedef void (*qom_freefunc)(void *ptr, size_t size, void *arg);
+
+#define qomPOOL_HUGEPAGES       (1)     /* back big blocks with huge pages */
+
+void *qom_alloc(size_t size);
+void qom_free(void *ptr);
+void qom_setallocator(qom_allocfunc alloc, qom_freefunc free, void *arg);
+void qom_setpool(size_t maxbytes, int flags);
+
 qom *qom_open(const char *filename, const char *mode);
+qom *qom_open_memory(const void *buf, size_t len);
 void qom_putframe(qom *qm, gfx_canvas *c, double usec);
 void qom_putframenow(qom *qm, gfx_canvas *c);
+void qom_putframe_begin(qom *qm, int sizex, int sizey, double usec);
+void qom_putframe_rows(qom *qm, const void *rows, int nrows);
+void qom_putframe_end(qom *qm);
 gfx_canvas *qom_getframe(qom *qm, int n, double *usec);
+int qom_getframes(qom *qm, int first, int count, gfx_canvas **frames, double *usecs);
+int qom_getframe_rows(qom *qm, int n, double *usec, qom_rowfunc func, void *arg);
+int qom_getframe_format(qom *qm, int n, double *usec, void *pixels, int format);
+int qom_getframe16(qom *qm, int n, double *usec, unsigned short *pixels, int stride, int format);
+int qom_getframe_alpha(qom *qm, int n, unsigned char **alpha);
+unsigned char *qom_getframe_planes(qom *qm, int n, double *usec, int *sizex, int *sizey);
+int qom_getframe_indexed(qom *qm, int n, double *usec, unsigned char **indices, unsigned int *palette, int *ncolors);
+gfx_canvas *qom_getframe_progressive(qom *qm, int n, double *usec, int maxpass);
+gfx_canvas *qom_getframe_cropped(qom *qm, int n, double *usec, int *x, int *y);
+int qom_getframe_opaque(qom *qm, int n);
 double qom_getduration(qom *qm);
 int qom_close(qom *qm);
 
 int qom_getnframes(qom *qm);
+
+qom_bundle *qom_bundle_open(const char *filename);
+qom *qom_bundle_get(qom_bundle *b, const char *name);
+int qom_bundle_getnmovies(qom_bundle *b);
+const char *qom_bundle_getname(qom_bundle *b, int i);
+void qom_bundle_close(qom_bundle *b);
+int qom_bundle_write(const char *filename, int nmovies, const char **names, const char **files);
+qom *qom_open_segmented(const char *manifest, int maxframes, long maxbytes);
+int qom_getnsegments(qom *qm);
+const char *qom_getsegment(qom *qm, int i, int *firstframe, int *nframes);
 void qom_print(qom *qm, const char *label);
 void qom_readbenchmark(const char *filename);
+int qom_verify(const char *filename);
 
 int qom_geterror(qom *qm);
 
 void qom_setoutputencoding(qom *qm, int encoding);
 int qom_getoutputencoding(qom *qm);
 
+void qom_setrestartrows(qom *qm, int rows);
+int qom_getrestartrows(qom *qm);
+
+void qom_setthreads(qom *qm, int nthreads);
+int qom_getthreads(qom *qm);
+
+void qom_setinputformat(qom *qm, int format);
+int qom_getinputformat(qom *qm);
+
+void qom_setoutputchannels(qom *qm, int channels);
+int qom_getoutputchannels(qom *qm);
+
+void qom_setoutputformat(qom *qm, int format);
+int qom_getoutputformat(qom *qm);
+
+void qom_seteffort(qom *qm, int effort);
+int qom_geteffort(qom *qm);
+
+void qom_settolerance(qom *qm, int tolerance);
+int qom_gettolerance(qom *qm);
+
+void qom_setcrop(qom *qm, int crop);
+int qom_getcrop(qom *qm);
+
+void qom_setdither(qom *qm, int dither);
+int qom_getdither(qom *qm);
+
+#define qomSYNC_NONE            (0)
+#define qomSYNC_CLOSE           (-1)    /* fdatasync once, at qom_close; n>0 does it every n frames */
+
+void qom_setwritebehind(qom *qm, int buffersize);
+int qom_getwritebehind(qom *qm);
+void qom_setpreallocate(qom *qm, long bytes);
+long qom_getpreallocate(qom *qm);
+void qom_setsync(qom *qm, int sync);
+int qom_getsync(qom *qm);
+
+typedef void (*qom_framefunc)(void *arg, int n, gfx_canvas *c, double usec);
+typedef struct qom_reader qom_reader;
+
+#define qomREADER_DIRECT        (1)     /* read with O_DIRECT where the file system allows it */
+
+qom_reader *qom_reader_new(int niothreads, int ndecoders, int flags);
+void qom_reader_getframe(qom_reader *r, qom *qm, int n, qom_framefunc func, void *arg);
+void qom_reader_wait(qom_reader *r);
+void qom_reader_free(qom_reader *r);
+
+qom_rowdecoder *qom_rowdecoder_new(qom_rowfunc func, void *arg);
+int qom_rowdecoder_push(qom_rowdecoder *rd, const void *data, int size);
+int qom_rowdecoder_done(qom_rowdecoder *rd);
+void qom_rowdecoder_free(qom_rowdecoder *rd);
+
 void qom_setstarttime(qom *qm, double starttime);
 void qom_setstartdir(qom *qm, int dir);
 void qom_setleftbounce(qom *qm, int bounce);
@@ -249,11 +477,203 @@ Implementation */
 #include "stdlib.h"
 #include "math.h"
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#endif
+#ifndef QOM_NO_THREADS
+#include <pthread.h>
+#endif
+
+/* glibc declares O_DIRECT only with _GNU_SOURCE, but always as __O_DIRECT */
+#if defined(O_DIRECT)
+#define _qom_O_DIRECT   O_DIRECT
+#elif defined(__O_DIRECT)
+#define _qom_O_DIRECT   __O_DIRECT
+#endif
 
 #define oQOM_MAGIC (0x54FF)
 #define ooQOM_MAGIC (0x54FE)
 #define oooQOM_MAGIC (0x5501)
 #define QOM_MAGIC (0x5301)
+#define QOM_SIDE_MAGIC (0x51534944)
+#define QOM_SEGMENTS_MAGIC (0x514f4d53)     /* QOMS, at the start of a manifest */
+
+/* 
+ * Canvas pool.  Pixels live in 64 byte aligned blocks from qom_alloc, 
+ * and qom_free keeps a freed block on a list for its size class, so the 
+ * next frame of that size takes it back without going through malloc 
+ * or faulting in fresh pages.  Classes are a quarter of a power of two 
+ * apart, so a block is at most a fifth bigger than asked for.  Up to 
+ * qom_setpool bytes wait on the lists; qomPOOL_HUGEPAGES asks for huge 
+ * pages for blocks of 2MB or more.  Blocks come from qom_setallocator's 
+ * alloc, which must return 64 byte aligned memory.
+ */
+#define QOM_POOL_ALIGN          (64)
+#define QOM_POOL_NCLASSES       (4*64)
+#define QOM_POOL_BYTES          (256*1024*1024L)
+#define QOM_HUGEPAGE            (2*1024*1024)
+
+typedef struct _qom_block {
+    struct _qom_block *next;
+    size_t size;                        /* header included */
+    int sizeclass;
+    qom_freefunc free;                  /* where it goes back to */
+    void *arg;
+} _qom_block;
+
+static void *_qom_sysalloc(size_t size, void *arg);
+static void _qom_sysfree(void *ptr, size_t size, void *arg);
+
+static struct {
+    _qom_block *lists[QOM_POOL_NCLASSES];
+    size_t cached;
+    size_t max;
+    int flags;
+    qom_allocfunc alloc;
+    qom_freefunc free;
+    void *arg;
+#ifndef QOM_NO_THREADS
+    pthread_mutex_t lock;
+#endif
+} _qom_pool = {
+    { 0 }, 0, QOM_POOL_BYTES, 0, _qom_sysalloc, _qom_sysfree, 0,
+#ifndef QOM_NO_THREADS
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void _qom_poollock(void)
+{
+#ifndef QOM_NO_THREADS
+    pthread_mutex_lock(&_qom_pool.lock);
+#endif
+}
+
+static void _qom_poolunlock(void)
+{
+#ifndef QOM_NO_THREADS
+    pthread_mutex_unlock(&_qom_pool.lock);
+#endif
+}
+
+static void *_qom_sysalloc(size_t size, void *arg)
+{
+    (void)arg;
+    void *ptr;
+    int huge = (_qom_pool.flags & qomPOOL_HUGEPAGES) && (size>=QOM_HUGEPAGE);
+    if(posix_memalign(&ptr, huge ? QOM_HUGEPAGE : QOM_POOL_ALIGN, size) != 0)
+        return 0;
+#ifdef MADV_HUGEPAGE
+    if(huge)
+        madvise(ptr, size & ~(size_t)(QOM_HUGEPAGE-1), MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
+static void _qom_sysfree(void *ptr, size_t size, void *arg)
+{
+    (void)size;
+    (void)arg;
+    free(ptr);
+}
+
+/* the class of a block of size bytes, and the size of the blocks in it */
+
+static int _qom_sizeclass(size_t size, size_t *classsize)
+{
+    size_t n = size-1;
+    int e = 0;
+    while(n>>(e+1))
+        e++;
+    int q = (n>>(e-2)) & 3;
+    *classsize = (size_t)(5+q)<<(e-2);
+    return 4*e+q;
+}
+
+void *qom_alloc(size_t size)
+{
+    size_t classsize;
+    int sizeclass = _qom_sizeclass(size+QOM_POOL_ALIGN, &classsize);
+    _qom_poollock();
+    _qom_block *b = _qom_pool.lists[sizeclass];
+    if(b) {
+        _qom_pool.lists[sizeclass] = b->next;
+        _qom_pool.cached -= b->size;
+    }
+    _qom_poolunlock();
+    if(!b) {
+        b = (_qom_block *)_qom_pool.alloc(classsize, _qom_pool.arg);
+        if(!b) {
+            fprintf(stderr, "qom_alloc: can't allocate %ld bytes\n", (long)size);
+            exit(1);
+        }
+        b->size = classsize;
+        b->sizeclass = sizeclass;
+        b->free = _qom_pool.free;
+        b->arg = _qom_pool.arg;
+    }
+    return (unsigned char *)b+QOM_POOL_ALIGN;
+}
+
+void qom_free(void *ptr)
+{
+    if(!ptr)
+        return;
+    _qom_block *b = (_qom_block *)((unsigned char *)ptr-QOM_POOL_ALIGN);
+    _qom_poollock();
+    int keep = (b->free == _qom_pool.free) && (b->arg == _qom_pool.arg) && (_qom_pool.cached+b->size <= _qom_pool.max);
+    if(keep) {
+        b->next = _qom_pool.lists[b->sizeclass];
+        _qom_pool.lists[b->sizeclass] = b;
+        _qom_pool.cached += b->size;
+    }
+    _qom_poolunlock();
+    if(!keep)
+        b->free(b, b->size, b->arg);
+}
+
+/* give back the blocks waiting in the pool until no more than max bytes are left */
+
+static void _qom_pooltrim(size_t max)
+{
+    _qom_poollock();
+    for(int i=QOM_POOL_NCLASSES-1; (i>=0) && (_qom_pool.cached>max); i--) {
+        while(_qom_pool.lists[i] && (_qom_pool.cached>max)) {
+            _qom_block *b = _qom_pool.lists[i];
+            _qom_pool.lists[i] = b->next;
+            _qom_pool.cached -= b->size;
+            b->free(b, b->size, b->arg);
+        }
+    }
+    _qom_poolunlock();
+}
+
+/* alloc and free replace posix_memalign and free, 0 puts them back */
+
+void qom_setallocator(qom_allocfunc alloc, qom_freefunc free, void *arg)
+{
+    _qom_pooltrim(0);
+    _qom_poollock();
+    _qom_pool.alloc = alloc ? alloc : _qom_sysalloc;
+    _qom_pool.free = alloc ? free : _qom_sysfree;
+    _qom_pool.arg = alloc ? arg : 0;
+    _qom_poolunlock();
+}
+
+void qom_setpool(size_t maxbytes, int flags)
+{
+    _qom_poollock();
+    _qom_pool.max = maxbytes;
+    _qom_pool.flags = flags;
+    _qom_poolunlock();
+    _qom_pooltrim(maxbytes);
+}
 
 /* support for canvas data structure */
 
@@ -262,24 +682,73 @@ gfx_canvas *gfx_canvas_new(int sizex, int sizey)
     gfx_canvas *c = (gfx_canvas *)malloc(sizeof(gfx_canvas));
     c->sizex = sizex;
     c->sizey = sizey;
-    c->data = (unsigned int *)malloc(sizex*sizey*sizeof(unsigned int));
+    c->channels = 4;
+    c->refs = 1;
+    c->pooled = 1;
+    c->data = (unsigned int *)qom_alloc(sizex*sizey*sizeof(unsigned int));
     return c;
 }
 
+/* one byte per pixel, for luminance, masks and illumination maps */
+
+gfx_canvas *gfx_canvas_new_gray(int sizex, int sizey)
+{
+    gfx_canvas *c = gfx_canvas_new_withdata(sizex, sizey, qom_alloc(sizex*sizey));
+    c->channels = 1;
+    c->pooled = 1;
+    return c;
+}
+
+/* data is freed with free(), as from malloc or stbi_load */
+
 gfx_canvas *gfx_canvas_new_withdata(int sizex, int sizey, void *data)
 {
     gfx_canvas *c = (gfx_canvas *)malloc(sizeof(gfx_canvas));
     c->sizex = sizex;
     c->sizey = sizey;
+    c->channels = 4;
+    c->refs = 1;
+    c->pooled = 0;
     c->data = (unsigned int *)data;
     return c;
 }
 
+/* a canvas holding data from qom_alloc */
+
+static gfx_canvas *_qom_poolcanvas(int sizex, int sizey, void *data)
+{
+    gfx_canvas *c = gfx_canvas_new_withdata(sizex, sizey, data);
+    c->pooled = 1;
+    return c;
+}
+
+/* another reference to c, that needs its own gfx_canvas_free */
+
+gfx_canvas *gfx_canvas_ref(gfx_canvas *c)
+{
+#ifndef QOM_NO_THREADS
+    __sync_add_and_fetch(&c->refs, 1);
+#else
+    c->refs++;
+#endif
+    return c;
+}
+
 void gfx_canvas_free(gfx_canvas *c)
 {
     if(!c)
         return;
-    free(c->data);
+#ifndef QOM_NO_THREADS
+    if(__sync_sub_and_fetch(&c->refs, 1) > 0)
+        return;
+#else
+    if(--c->refs > 0)
+        return;
+#endif
+    if(c->pooled)
+        qom_free(c->data);
+    else
+        free(c->data);
     free(c);
 }
 
@@ -298,9 +767,71 @@ static double _qom_getusec(void)
     return (1000000*(sec-_qom_startsec))+tv.tv_usec;
 }
 
+/* sysconf reads /sys on Linux, so ask once rather than on every qom_open */
+
+static int _qom_ncpus(void)
+{
+    static int ncpus = 0;
+    if(ncpus == 0) {
+        int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        ncpus = (n<1) ? 1 : n;
+    }
+    return ncpus;
+}
+
+/* run njobs calls of func on up to nthreads threads */
+
+typedef struct _qom_jobs {
+    void (*func)(void *arg, int job);
+    void *arg;
+    int njobs;
+    int nextjob;
+} _qom_jobs;
+
+static void *_qom_jobthread(void *arg)
+{
+    _qom_jobs *jobs = (_qom_jobs *)arg;
+    while(1) {
+        int job = __sync_fetch_and_add(&jobs->nextjob, 1);
+        if(job >= jobs->njobs)
+            break;
+        jobs->func(jobs->arg, job);
+    }
+    return 0;
+}
+
+static void _qom_parallel(int njobs, int nthreads, void (*func)(void *arg, int job), void *arg)
+{
+    _qom_jobs jobs;
+    jobs.func = func;
+    jobs.arg = arg;
+    jobs.njobs = njobs;
+    jobs.nextjob = 0;
+#ifndef QOM_NO_THREADS
+    if(nthreads>njobs)
+        nthreads = njobs;
+    if(nthreads>1) {
+        pthread_t *threads = (pthread_t *)malloc((nthreads-1)*sizeof(pthread_t));
+        int nstarted = 0;
+        for(int i=0; i<nthreads-1; i++) {
+            if(pthread_create(threads+nstarted, 0, _qom_jobthread, &jobs) == 0)
+                nstarted++;
+        }
+        _qom_jobthread(&jobs);
+        for(int i=0; i<nstarted; i++)
+            pthread_join(threads[i], 0);
+        free(threads);
+        return;
+    }
+#endif
+    _qom_jobthread(&jobs);
+}
+
+static int _qom_write(qom *qm, const void *data, int size);
+
 static int _qom_writeframe_LITERAL(qom *qm, gfx_canvas *c) {
     int size = 4*c->sizex * c->sizey;
-    int bytes_write = fwrite(c->data, 1, size, qm->f);
+    int bytes_write = _qom_write(qm, c->data, size);
     if(bytes_write != size) {
         fprintf(stderr, "qoiwriteframe error\n");
         exit(1);
@@ -328,496 +859,5496 @@ static unsigned int qom_read_32(const unsigned char *bytes, int *p) {
     return a << 24 | b << 16 | c << 8 | d;
 }
 
-static void _qom_writeint(qom *qm, int val) 
+/*
+ * A segmented movie is a manifest and a series of plain .qom files, each 
+ * holding the next few frames.  Its qom has the frame table of all the 
+ * segments, with global frame numbers and times, and keeps the file of 
+ * one segment open at a time.  _qom_getframeinfo notes the segment of 
+ * each frame it looks up, and the next seek opens that segment's file.
+ */
+typedef struct qom_segment {
+    int firstframe;
+    int nframes;
+    unsigned int start_lo, start_hi;    /* of its first frame, from the first frame of the movie */
+    char *name;                         /* as in the manifest, relative to its directory */
+    char *path;
+    int fd;                             /* for reads by a qom_reader, -1 until then */
+    int fddirect;
+} qom_segment;
+
+typedef struct qom_segments {
+    char *manifest;
+    qom_segment *segs;
+    int nsegs;
+    int segalloc;
+    int current;                        /* segment whose file is open */
+    int want;                           /* segment of the frame looked up last */
+    int maxframes;                      /* of each segment written, 0 for no limit */
+    long maxbytes;
+    int nframes;                        /* in the segments written so far */
+    double firstframe_usec;             /* of the movie being written */
+} qom_segments;
+
+static int _qom_segmentof(qom_segments *ss, int frameno)
 {
-    int p = 0;
-    qom_write_32((unsigned char *)&val, &p, val);
-    int bytes_write = fwrite(&val, 1, sizeof(int), qm->f);
-    if(bytes_write != sizeof(int)) {
-        fprintf(stderr, "qom: _qom_writeint error\n");
-        exit(1);
-        qm->error = qomERROR_WRITE;
-        return;
+    int lo = 0;
+    int hi = ss->nsegs-1;
+    while(lo<hi) {
+        int mid = (lo+hi+1)/2;
+        if(ss->segs[mid].firstframe <= frameno)
+            lo = mid;
+        else
+            hi = mid-1;
     }
+    return lo;
 }
 
-static int _qom_readint(qom *qm) 
+static void _qom_opensegment(qom *qm)
 {
-    int val;
-    int bytes_read = fread(&val, 1, sizeof(int), qm->f);
-    if(bytes_read != sizeof(int)) {
-        fprintf(stderr, "qom: _qom_readint error\n");
-        exit(1);
-        qm->error = qomERROR_READ;
-        return 0;
+    qom_segments *ss = qm->segments;
+    if(qm->f)
+        fclose(qm->f);
+    ss->current = ss->want;
+    qm->f = fopen(ss->segs[ss->current].path, "rb");
+    if(!qm->f) {
+        fprintf(stderr, "qom: can't open segment [%s]\n", ss->segs[ss->current].path);
+        qm->error = qomERROR_OPEN_READ;
     }
-    int p = 0;
-    return qom_read_32((unsigned char *)&val, &p);
 }
 
+/*
+ * Write-behind.  With qom_setwritebehind, writes are copied into one of 
+ * a few big aligned buffers, and a thread writes out each full buffer 
+ * with pwrite at its place in the file, so a capture thread only waits 
+ * for the disk when every buffer is full.  Seeks start a new buffer at 
+ * the new place.  The thread reserves space with fallocate ahead of the 
+ * writes, qm->preallocate bytes at a time, so long captures are less 
+ * fragmented, and runs fdatasync after the buffers that end a run of 
+ * qm->sync frames.  The space is reserved without changing the size of 
+ * the file, since readers find the frame table from the end.
+ */
+#define QOM_WRITER_NBUFS        (4)
 
-static int _qom_writeframe_QOI(qom *qm, gfx_canvas *c) {
-    qoi_desc desc;
-    desc.width = (unsigned int)c->sizex;
-    desc.height = (unsigned int)c->sizey;
-    desc.channels = 4;
-    desc.colorspace = QOI_SRGB;
-    int size;
-    void *encoded = qoi_encode(c->data, &desc, &size);
-    if (!encoded) {
-        fprintf(stderr, "qoiwriteframe encode error\n");
-        exit(1);
-    }
-    int bytes_write = fwrite(encoded, 1, size, qm->f);
-    if(bytes_write != size) {
-        fprintf(stderr, "qoiwriteframe error\n");
-        exit(1);
+typedef struct _qom_wbuf {
+    struct _qom_wbuf *next;
+    unsigned char *bytes;
+    int len;
+    long offset;                        /* in the file of bytes[0] */
+    int sync;                           /* fdatasync once it is written */
+} _qom_wbuf;
+
+typedef struct _qom_writer {
+    int fd;
+    int bufsize;
+    _qom_wbuf *cur;                     /* being filled */
+    _qom_wbuf *empty;
+    _qom_wbuf *head, *tail;             /* full, for the thread to write */
+    long end;                           /* of the data written to the file */
+    long reserved;                      /* bytes reserved with fallocate */
+    long step;
+    int error;
+    int busy;                           /* the thread is writing a buffer */
+    int quit;
+#ifndef QOM_NO_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t full;
+    pthread_cond_t done;
+    pthread_t thread;
+    int started;
+#endif
+} _qom_writer;
+
+/* reserve len bytes at offset without changing the size of the file, where the system allows */
+
+static void _qom_preallocate(int fd, long offset, long len)
+{
+#if defined(__linux__) && defined(SYS_fallocate)
+    syscall(SYS_fallocate, fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len);
+#elif defined(F_PREALLOCATE)
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, len, 0 };
+    if(fcntl(fd, F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        fcntl(fd, F_PREALLOCATE, &store);
     }
-    free(encoded);
-    return size;
+#endif
 }
 
-static int _qom_writeframe_PNG(qom *qm, gfx_canvas *c) 
+static int _qom_datasync(int fd)
 {
-    int size;
-    unsigned char *encoded = stbi_write_png_to_mem((unsigned char *)c->data, 4*c->sizex, c->sizex, c->sizey, 4, &size);
-    int bytes_write = fwrite(encoded, 1, size, qm->f);
-    if(bytes_write != size) {
-        fprintf(stderr, "qoiwriteframe error\n");
-        exit(1);
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+static void _qom_writer_write(_qom_writer *w, _qom_wbuf *b)
+{
+    if(w->step && (b->offset+b->len > w->reserved)) {
+        long want = b->offset+b->len-w->reserved;
+        long len = ((want+w->step-1)/w->step)*w->step;
+        _qom_preallocate(w->fd, w->reserved, len);
+        w->reserved += len;
     }
-    free(encoded);
-    return size;
+    long done = 0;
+    while(done < b->len) {
+        ssize_t n = pwrite(w->fd, b->bytes+done, b->len-done, b->offset+done);
+        if(n <= 0) {
+            if((n<0) && (errno == EINTR))
+                continue;
+            w->error = 1;
+            break;
+        }
+        done += n;
+    }
+    if(b->sync && (_qom_datasync(w->fd) != 0))
+        w->error = 1;
 }
 
-static int _qom_writeframe_JPG(qom *qm, gfx_canvas *c) 
+#ifndef QOM_NO_THREADS
+static void *_qom_writerthread(void *arg)
 {
+    _qom_writer *w = (_qom_writer *)arg;
+    pthread_mutex_lock(&w->lock);
+    while(1) {
+        while(!w->head && !w->quit)
+            pthread_cond_wait(&w->full, &w->lock);
+        if(!w->head)
+            break;
+        _qom_wbuf *b = w->head;
+        w->head = b->next;
+        if(!w->head)
+            w->tail = 0;
+        w->busy = 1;
+        pthread_mutex_unlock(&w->lock);
+        _qom_writer_write(w, b);
+        pthread_mutex_lock(&w->lock);
+        w->busy = 0;
+        b->next = w->empty;
+        w->empty = b;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
     return 0;
 }
+#endif
 
+/* hand the current buffer to the thread and take an empty one, to fill from offset */
 
-static gfx_canvas *_qom_readframe_LITERAL(qom *qm, int size) 
+static void _qom_writer_submit(_qom_writer *w, long offset, int sync)
 {
-    int sizex = _qom_readint(qm);
-    int sizey = _qom_readint(qm);
-    void *data = malloc(4 *sizex * sizey);
-    int bytes_read = fread(data, 1, size, qm->f);
-    return gfx_canvas_new_withdata(sizex, sizey, data);
+    _qom_wbuf *b = w->cur;
+    b->sync = sync;
+    if(b->offset+b->len > w->end)
+        w->end = b->offset+b->len;
+    if((b->len == 0) && !sync) {
+        b->offset = offset;
+        return;
+    }
+#ifndef QOM_NO_THREADS
+    if(w->started) {
+        pthread_mutex_lock(&w->lock);
+        b->next = 0;
+        if(w->tail)
+            w->tail->next = b;
+        else
+            w->head = b;
+        w->tail = b;
+        pthread_cond_signal(&w->full);
+        while(!w->empty)
+            pthread_cond_wait(&w->done, &w->lock);
+        w->cur = w->empty;
+        w->empty = w->cur->next;
+        pthread_mutex_unlock(&w->lock);
+        w->cur->len = 0;
+        w->cur->offset = offset;
+        return;
+    }
+#endif
+    _qom_writer_write(w, b);
+    b->len = 0;
+    b->offset = offset;
 }
 
-static gfx_canvas *_qom_readframe_QOI(qom *qm, int size) 
+static int _qom_writer_put(_qom_writer *w, const void *data, int size)
 {
-    qoi_desc desc;
-    void *data = malloc(size);
-    int bytes_read = fread(data, 1, size, qm->f);
-    void *pixels = qoi_decode(data, bytes_read, &desc, 4);
-    if(!pixels) {
-        fprintf(stderr, "qom_readframe_QOI: decode error\n");
-        exit(1);
+    const unsigned char *bytes = (const unsigned char *)data;
+    int left = size;
+    while(left>0) {
+        _qom_wbuf *b = w->cur;
+        int n = w->bufsize-b->len;
+        if(n>left)
+            n = left;
+        memcpy(b->bytes+b->len, bytes, n);
+        b->len += n;
+        bytes += n;
+        left -= n;
+        if(b->len == w->bufsize)
+            _qom_writer_submit(w, b->offset+b->len, 0);
     }
-    free(data);
-
-    int channels = desc.channels;
-    int sizex = desc.width;
-    int sizey = desc.height;
-    return gfx_canvas_new_withdata(sizex, sizey, pixels);
+    return size;
 }
 
-static gfx_canvas *_qom_readframe_PNG(qom *qm, int size) 
+static void _qom_writer_begin(qom *qm)
 {
-    int sizex, sizey, n;
-    void *data = stbi_load_from_file(qm->f, &sizex, &sizey, &n, 4);
-    if(!data) {
-        fprintf(stderr, "qom_readframe_PNG: decode error\n");
-        exit(1);
+    fflush(qm->f);
+    _qom_writer *w = (_qom_writer *)malloc(sizeof(_qom_writer));
+    w->fd = fileno(qm->f);
+    w->bufsize = qm->writebehind;
+    w->empty = 0;
+    for(int i=0; i<QOM_WRITER_NBUFS; i++) {
+        _qom_wbuf *b = (_qom_wbuf *)malloc(sizeof(_qom_wbuf));
+        if(posix_memalign((void **)&b->bytes, 4096, w->bufsize) != 0) {
+            fprintf(stderr, "qom: can't allocate write-behind buffers\n");
+            exit(1);
+        }
+        b->len = 0;
+        b->offset = 0;
+        b->sync = 0;
+        b->next = w->empty;
+        w->empty = b;
     }
-    return gfx_canvas_new_withdata(sizex, sizey, data);
+    w->cur = w->empty;
+    w->empty = w->cur->next;
+    w->cur->offset = ftell(qm->f);
+    w->head = w->tail = 0;
+    w->end = w->cur->offset;
+    w->reserved = 0;
+    w->step = qm->preallocate;
+    w->error = 0;
+    w->busy = 0;
+    w->quit = 0;
+#ifndef QOM_NO_THREADS
+    pthread_mutex_init(&w->lock, 0);
+    pthread_cond_init(&w->full, 0);
+    pthread_cond_init(&w->done, 0);
+    w->started = (pthread_create(&w->thread, 0, _qom_writerthread, w) == 0);
+#endif
+    qm->writer = w;
 }
 
-static gfx_canvas *_qom_readframe_JPG(qom *qm, int size)
+/* write out everything, run the sync policy and go back to writing through stdio */
+
+static int _qom_writer_end(qom *qm)
 {
-    return gfx_canvas_new(1,1);
+    _qom_writer *w = qm->writer;
+    long pos = w->cur->offset+w->cur->len;
+    _qom_writer_submit(w, pos, qm->sync != qomSYNC_NONE);
+#ifndef QOM_NO_THREADS
+    if(w->started) {
+        pthread_mutex_lock(&w->lock);
+        while(w->head || w->busy)
+            pthread_cond_wait(&w->done, &w->lock);
+        w->quit = 1;
+        pthread_cond_signal(&w->full);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, 0);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->full);
+    pthread_cond_destroy(&w->done);
+#endif
+    if(w->reserved > w->end)
+        ftruncate(w->fd, w->end);           /* gives back the reserved space past the end */
+    int error = w->error;
+    w->cur->next = w->empty;
+    while(w->cur) {
+        _qom_wbuf *b = w->cur;
+        w->cur = b->next;
+        free(b->bytes);
+        free(b);
+    }
+    free(w);
+    qm->writer = 0;
+    fseek(qm->f, pos, SEEK_SET);
+    if(error) {
+        fprintf(stderr, "qom: write-behind error\n");
+        qm->error = qomERROR_WRITE;
+    }
+    return !error;
 }
 
+/* before closing a file being written */
 
-static void _qom_addframeinfo(qom *qm, qom_frameinfo *fi, int pos)
+static void _qom_finishfile(qom *qm)
 {
-    if(pos >= qm->framealloc) {
-        if(qm->framealloc == 0) {
-            qm->framealloc = 30;
-            qm->frames = (qom_frameinfo *)malloc(qm->framealloc*sizeof(qom_frameinfo));
-        } else {
-            qm->framealloc = ((3*qm->framealloc)/2) + 1;
-            qm->frames = (qom_frameinfo *)realloc(qm->frames, qm->framealloc*sizeof(qom_frameinfo));
-        }
+    if(qm->writer) {
+        _qom_writer_end(qm);
+        return;
     }
-    qm->frames[pos] = *fi;
+    fflush(qm->f);
+    if(qm->preallocate) {
+        fseek(qm->f, 0, SEEK_END);
+        ftruncate(fileno(qm->f), ftell(qm->f));
+    }
+    if(qm->sync != qomSYNC_NONE)
+        _qom_datasync(fileno(qm->f));
 }
 
-static qom_frameinfo *_qom_getframeinfo(qom *qm, int index)
+/* after each frame is written */
+
+static void _qom_syncframe(qom *qm)
 {
-    if((index<0) || (index>=qm->header.nframes)) {
-        fprintf(stderr, "_qom_ilistget: index out of range\n");
-        assert(0);
+    if((qm->sync <= 0) || ((qom_getnframes(qm) % qm->sync) != 0))
+        return;
+    if(qm->writer) {
+        _qom_writer *w = qm->writer;
+        _qom_writer_submit(w, w->cur->offset+w->cur->len, 1);
+    } else {
+        fflush(qm->f);
+        _qom_datasync(fileno(qm->f));
     }
-    return qm->frames+index;
 }
 
-static void _qom_free(qom *qm)
+static int _qom_write(qom *qm, const void *data, int size)
 {
-    if(!qm)
-        return;
-    if(qm->frames)
-        free(qm->frames);
-    free(qm);
+    if(qm->writer)
+        return _qom_writer_put(qm->writer, data, size);
+    return fwrite(data, 1, size, qm->f);
 }
 
-static void _qom_readheader(qom *qm) 
+/* 
+ * Movies are read from a file, or from bytes in memory when qm->mem is 
+ * set, which never goes through stdio.  Reads past the end come up short, 
+ * like fread.
+ */
+static int _qom_read(qom *qm, void *data, int size)
 {
-    qm->header.magic = _qom_readint(qm);    
-    qm->header.nframes = _qom_readint(qm);
-    qm->header.duration_lo = _qom_readint(qm);
-    qm->header.duration_hi = _qom_readint(qm);
-    qm->header.sizex = _qom_readint(qm);
-    qm->header.sizey = _qom_readint(qm);
-    qm->header.default_starttime_lo = _qom_readint(qm);    
-    qm->header.default_starttime_hi = _qom_readint(qm);    
-    qm->header.default_startdir = _qom_readint(qm);     
-    qm->header.default_leftbounce = _qom_readint(qm);   
-    qm->header.default_rightbounce = _qom_readint(qm);   
+    if(!qm->mem)
+        return qm->f ? fread(data, 1, size, qm->f) : 0;
+    long left = qm->memsize-qm->mempos;
+    if(size > left)
+        size = (left>0) ? left : 0;
+    memcpy(data, qm->mem+(qm->mempos-qm->membase), size);
+    qm->mempos += size;
+    return size;
 }
 
-static void _qom_writeheader(qom *qm) 
+static int _qom_seek(qom *qm, long offset, int whence)
 {
-    qm->header.magic = QOM_MAGIC;
-    _qom_writeint(qm, qm->header.magic);
-    _qom_writeint(qm, qm->header.nframes);
-    _qom_writeint(qm, qm->header.duration_lo);
-    _qom_writeint(qm, qm->header.duration_hi);
-    _qom_writeint(qm, qm->header.sizex);
-    _qom_writeint(qm, qm->header.sizey);
-    _qom_writeint(qm, qm->header.default_starttime_lo);
-    _qom_writeint(qm, qm->header.default_starttime_hi);
-    _qom_writeint(qm, qm->header.default_startdir);
-    _qom_writeint(qm, qm->header.default_leftbounce);
-    _qom_writeint(qm, qm->header.default_rightbounce);
+    if(qm->segments && (qm->mode == qomMODE_R) && (qm->segments->want != qm->segments->current))
+        _qom_opensegment(qm);
+    if(!qm->f && !qm->mem)
+        return -1;
+    if(qm->writer) {
+        _qom_writer *w = qm->writer;
+        long pos = w->cur->offset+w->cur->len;
+        if(whence == SEEK_CUR)
+            offset += pos;
+        else if(whence == SEEK_END)
+            offset += (pos>w->end) ? pos : w->end;
+        if(offset<0)
+            return -1;
+        if(offset != pos)
+            _qom_writer_submit(w, offset, 0);
+        return 0;
+    }
+    if(!qm->mem)
+        return fseek(qm->f, offset, whence);
+    if(whence == SEEK_CUR)
+        offset += qm->mempos;
+    else if(whence == SEEK_END)
+        offset += qm->memsize;
+    if(offset<qm->membase)
+        return -1;
+    qm->mempos = offset;
+    return 0;
 }
 
-static void _qom_readframeinfo(qom *qm) 
+static long _qom_tell(qom *qm)
 {
-    qm->frames = (qom_frameinfo *)malloc(qm->header.nframes*sizeof(qom_frameinfo));
-    qm->framealloc = qm->header.nframes;
-    qom_frameinfo *fi = qm->frames;
-    for(int i=0; i<qm->header.nframes; i++) {
-        fi->time_lo = _qom_readint(qm);    
-        fi->time_hi = _qom_readint(qm);    
-        fi->encoding = _qom_readint(qm);    
-        fi->sizex = _qom_readint(qm);    
-        fi->sizey = _qom_readint(qm);    
-        fi->offset = _qom_readint(qm);    
-        fi->size = _qom_readint(qm);    
-        fi->encoding_usec = _qom_readint(qm);    
-        fi++;
+    if(qm->writer)
+        return qm->writer->cur->offset+qm->writer->cur->len;
+    if(!qm->mem)
+        return ftell(qm->f);
+    return qm->mempos;
+}
+
+static void _qom_writeint(qom *qm, int val) 
+{
+    int p = 0;
+    qom_write_32((unsigned char *)&val, &p, val);
+    int bytes_write = _qom_write(qm, &val, sizeof(int));
+    if(bytes_write != sizeof(int)) {
+        fprintf(stderr, "qom: _qom_writeint error\n");
+        exit(1);
+        qm->error = qomERROR_WRITE;
+        return;
     }
 }
 
-static void _qom_writeframeinfo(qom *qm) 
+static int _qom_readint(qom *qm) 
 {
-    qom_frameinfo *fi = qm->frames;
-    for(int i=0; i<qm->header.nframes; i++) {
-        _qom_writeint(qm, fi->time_lo);
-        _qom_writeint(qm, fi->time_hi);
-        _qom_writeint(qm, fi->encoding);
-        _qom_writeint(qm, fi->sizex);
-        _qom_writeint(qm, fi->sizey);
-        _qom_writeint(qm, fi->offset);
-        _qom_writeint(qm, fi->size);
-        _qom_writeint(qm, fi->encoding_usec);
-        fi++;
+    int val;
+    int bytes_read = _qom_read(qm, &val, sizeof(int));
+    if(bytes_read != sizeof(int)) {
+        fprintf(stderr, "qom: _qom_readint error\n");
+        exit(1);
+        qm->error = qomERROR_READ;
+        return 0;
     }
+    int p = 0;
+    return qom_read_32((unsigned char *)&val, &p);
 }
 
-static int _qom_openread(qom *qm, const char *filename, int mode) 
+
+/* QOI coding with restart points */
+
+static unsigned int _qom_pxtoint(unsigned int v)
 {
-    qm->f = 0;
-    switch(mode) { 
-        case qomMODE_R:
-            qm->f = fopen(filename, "rb");
-            break;
-        case qomMODE_RW:
-            qm->f = fopen(filename, "rwb");
+    qoi_rgba_t px;
+    px.v = v;
+    return ((unsigned int)px.rgba.r<<24) | ((unsigned int)px.rgba.g<<16) | ((unsigned int)px.rgba.b<<8) | (unsigned int)px.rgba.a;
+}
+
+static unsigned int _qom_inttopx(unsigned int i)
+{
+    qoi_rgba_t px;
+    px.rgba.r = (i>>24) & 0xff;
+    px.rgba.g = (i>>16) & 0xff;
+    px.rgba.b = (i>>8) & 0xff;
+    px.rgba.a = i & 0xff;
+    return px.v;
+}
+
+static void _qom_freeside(qom_frameside *side)
+{
+    free(side->restarts);
+    side->restarts = 0;
+    side->nrestarts = 0;
+    side->restartrows = 0;
+    side->channels = 0;
+    side->tolerance = 0;
+    side->fullsizex = 0;
+    side->fullsizey = 0;
+}
+
+static int _qom_restartrows(int restartrows, int sizex)
+{
+    if(restartrows != qomRESTART_AUTO)
+        return restartrows;
+    int rows = (qomRESTART_PIXELS+sizex-1)/sizex;
+    if(rows<16)
+        rows = 16;
+    return rows;
+}
+
+static void _qom_addrestart(qom_frameside *side, int offset, int run, qoi_rgba_t px, qoi_rgba_t *index)
+{
+    int n = side->nrestarts;
+    if((n & (n-1)) == 0)
+        side->restarts = (qom_restart *)realloc(side->restarts, (n ? 2*n : 1)*sizeof(qom_restart));
+    qom_restart *rs = side->restarts+side->nrestarts;
+    rs->offset = offset;
+    rs->run = run;
+    rs->px = px.v;
+    memcpy(rs->index, index, sizeof(rs->index));
+    side->nrestarts++;
+}
+
+/* 
+ * Restart points taken while a run is still open get their offset and run 
+ * count once the run op has been written.  Until then run holds minus the 
+ * number of run pixels before the restart point.
+ */
+static void _qom_endrun(qom_frameside *side, int p, int run)
+{
+    for(int i=side->nrestarts-1; i>=0; i--) {
+        qom_restart *rs = side->restarts+i;
+        if(rs->run >= 0)
             break;
+        rs->offset = p;
+        rs->run = run+rs->run;
     }
-    qm->mode = mode;
-    if(!qm->f) {
-        fprintf(stderr, "qom: can't open input file [%s]\n", filename);
-        qm->error = qomERROR_OPEN_READ;
-        return 0;
+}
+
+/*
+ * QOI encoder state.  Pixels px_begin up to px_end of a frame are encoded 
+ * as one stripe, a few pixels at a time.  For the first stripe of a frame 
+ * this produces exactly the bytes qoi_encode does for 4 channel data.  A 
+ * resync stripe can follow any other stripe: it starts with an explicit 
+ * QOI_OP_RGBA and only uses index entries it has written itself, since the 
+ * decoder's index is unknown when the stripe starts.  Its index starts out 
+ * with a color in each slot that hashes to a different slot, so no pixel 
+ * can match an entry it has not written.  The decoder state is 
+ * recorded in side every restart_step pixels, at offset base plus the 
+ * bytes written by the current call.
+ */
+typedef struct _qom_qoienc {
+    qoi_rgba_t index[64];
+    qoi_rgba_t px_prev;
+    int run;
+    int px_pos;
+    int px_begin, px_end;
+    int resync;
+    int restart_step;
+    int next_restart;
+    int base;
+    int format;
+    qom_frameside *side;
+} _qom_qoienc;
+
+static void _qom_qoienc_init(_qom_qoienc *e, int px_begin, int px_end, int resync, int restart_step, qom_frameside *side)
+{
+    QOI_ZEROARR(e->index);
+    e->px_prev.rgba.r = 0;
+    e->px_prev.rgba.g = 0;
+    e->px_prev.rgba.b = 0;
+    e->px_prev.rgba.a = 255;
+    e->run = 0;
+    e->px_pos = px_begin;
+    e->px_begin = px_begin;
+    e->px_end = px_end;
+    e->resync = resync;
+    e->restart_step = restart_step;
+    e->next_restart = px_end;
+    e->base = 0;
+    e->format = qomFORMAT_RGBA;
+    e->side = side;
+    if(restart_step>0) {
+        e->next_restart = px_begin+restart_step;
+        if(resync)
+            _qom_addrestart(side, 0, 0, e->px_prev, e->index);
     }
-    _qom_readheader(qm);
-    if(qm->header.magic != QOM_MAGIC) {
-        fprintf(stderr, "qom: good magic: 0x%x  bad magic 0x%x\n", QOM_MAGIC, qm->header.magic);
-        qm->error = qomERROR_MAGIC;
-        return 0;
+    if(resync) {
+        for(int i=0; i<64; i++)
+            e->index[i].rgba.a = (35*(i+1)) & 63;  /* 35 is 1/11 mod 64, so this hashes to i+1 */
     }
-    fseek(qm->f, -(qm->header.nframes*sizeof(qom_frameinfo)), SEEK_END);
-    _qom_readframeinfo(qm);
-    return 1;
 }
 
-static int _qom_openwrite(qom *qm, const char *filename, int mode) 
+/*
+ * Pixel formats.  The QOI coders below are generated for each format so 
+ * the per pixel loops carry no tests of the format, and the coders for 
+ * opaque formats never compare alpha.  The right one is picked once per 
+ * call.
+ */
+static int _qom_formatbytes(int format)
 {
-    qm->f = fopen(filename, "wb");
-    qm->mode = mode;
-    if(!qm->f) {
-        fprintf(stderr, "qom: can't open output file [%s]\n", filename);
-        qm->error = qomERROR_OPEN_WRITE;
-        return 0;
+    switch(format) {
+        case qomFORMAT_RGB:
+            return 3;
+        case qomFORMAT_ALPHA:
+            return 1;
+        case qomFORMAT_RGB565:
+        case qomFORMAT_RGBA4444:
+            return 2;
     }
-    _qom_writeheader(qm);
-    return 1;
+    return 4;
 }
 
-qom *qom_open(const char *filename, const char *mode)
+static int _qom_formatopaque(int format)
 {
-    qom *qm = (qom *)malloc(sizeof(qom));
-    qm->header.magic = 0;
-    qm->header.nframes = 0;
-    qm->header.duration_lo = 0;
-    qm->header.duration_hi = 0;
-    qm->header.sizex = -1;
-    qm->header.sizey = -1;
-    qm->header.default_starttime_lo = 0;  
-    qm->header.default_starttime_hi = 0;  
-    qm->header.default_startdir = qomSTART_DIR_INC;
-    qm->header.default_leftbounce = qomBOUNCE_REV;
-    qm->header.default_rightbounce = qomBOUNCE_REV;
-    qm->mode = qomMODE_NONE;
-    qm->f = 0;
-    qm->error = qomERROR_NONE;
-    qm->firstframe_usec = 0;
-    qm->frames = 0;
-    qm->framealloc = 0;
-    qm->output_encoding = qomENCODING_QOI;
+    return (format == qomFORMAT_RGB) || (format == qomFORMAT_RGBX) || (format == qomFORMAT_BGRX);
+}
 
-    if(strcmp(mode, "r") == 0) {
-        if(!_qom_openread(qm, filename, qomMODE_R)) {
-           if(qm->f)
-               fclose(qm->f);
-            _qom_free(qm);
-            return 0;
+/* 
+ * All the pixels have alpha 255.  The loop has no early exit so the 
+ * compiler can vectorize it.
+ */
+static int _qom_isopaque(const unsigned int *data, int npixels)
+{
+    unsigned int all = 0xffffffff;
+    for(int i=0; i<npixels; i++)
+        all &= data[i];
+    qoi_rgba_t px;
+    px.v = all;
+    return px.rgba.a == 255;
+}
+
+/* some pixel has alpha, again with no early exit */
+
+static int _qom_rowvisible(const unsigned int *row, int n)
+{
+    unsigned int any = 0;
+    for(int i=0; i<n; i++)
+        any |= row[i];
+    qoi_rgba_t px;
+    px.v = any;
+    return px.rgba.a != 0;
+}
+
+/* 
+ * The box x0 <= x < x1, y0 <= y < y1 around the pixels with alpha, or 0 
+ * if there are none.  Whole rows are tested with _qom_rowvisible, and 
+ * only the margins beside the box found so far are searched pixel by 
+ * pixel, so most of the work is vectorized.
+ */
+static int _qom_bbox(const unsigned int *data, int sizex, int sizey, int *x0, int *y0, int *x1, int *y1)
+{
+    int top = 0;
+    while((top<sizey) && !_qom_rowvisible(data+top*sizex, sizex))
+        top++;
+    if(top == sizey)
+        return 0;
+    int bottom = sizey-1;
+    while(!_qom_rowvisible(data+bottom*sizex, sizex))
+        bottom--;
+    int left = sizex;
+    int right = -1;
+    for(int y=top; y<=bottom; y++) {
+        const unsigned int *row = data+y*sizex;
+        if((left>0) && _qom_rowvisible(row, left)) {
+            left = 0;
+            while(!_qom_rowvisible(row+left, 1))
+                left++;
         }
-    } else if(strcmp(mode, "rw") == 0) {
-        if(!_qom_openread(qm, filename, qomMODE_RW)) {
-           if(qm->f)
-               fclose(qm->f);
-            _qom_free(qm);
-            return 0;
+        if((right<sizex-1) && _qom_rowvisible(row+right+1, sizex-right-1)) {
+            right = sizex-1;
+            while(!_qom_rowvisible(row+right, 1))
+                right--;
         }
-    } else if(strcmp(mode, "w") == 0) {
-        if(!_qom_openwrite(qm, filename, qomMODE_W)) {
-           if(qm->f)
-               fclose(qm->f);
-            _qom_free(qm);
-            return 0;
+    }
+    *x0 = left;
+    *y0 = top;
+    *x1 = right+1;
+    *y1 = bottom+1;
+    return 1;
+}
+
+#define _QOM_LOAD_RGBA(px, s)   memcpy(&(px).v, (s), 4)
+#define _QOM_LOAD_BGRA(px, s)   ((px).rgba.r = (s)[2], (px).rgba.g = (s)[1], (px).rgba.b = (s)[0], (px).rgba.a = (s)[3])
+#define _QOM_LOAD_RGB(px, s)    ((px).rgba.r = (s)[0], (px).rgba.g = (s)[1], (px).rgba.b = (s)[2], (px).rgba.a = 255)
+#define _QOM_LOAD_RGBX(px, s)   (memcpy(&(px).v, (s), 4), (px).rgba.a = 255)
+#define _QOM_LOAD_BGRX(px, s)   ((px).rgba.r = (s)[2], (px).rgba.g = (s)[1], (px).rgba.b = (s)[0], (px).rgba.a = 255)
+
+#define _QOM_STORE_RGBA(d, px)  memcpy((d), &(px).v, 4)
+#define _QOM_STORE_BGRA(d, px)  ((d)[0] = (px).rgba.b, (d)[1] = (px).rgba.g, (d)[2] = (px).rgba.r, (d)[3] = (px).rgba.a)
+#define _QOM_STORE_RGB(d, px)   ((d)[0] = (px).rgba.r, (d)[1] = (px).rgba.g, (d)[2] = (px).rgba.b)
+#define _QOM_STORE_RGBX(d, px)  ((d)[0] = (px).rgba.r, (d)[1] = (px).rgba.g, (d)[2] = (px).rgba.b, (d)[3] = 255)
+#define _QOM_STORE_BGRX(d, px)  ((d)[0] = (px).rgba.b, (d)[1] = (px).rgba.g, (d)[2] = (px).rgba.r, (d)[3] = 255)
+#define _QOM_STORE_ALPHA(d, px) ((d)[0] = (px).rgba.a)
+
+/* c*a/255 rounded, exactly */
+
+#define _QOM_PREMUL(c, a)       ((((c)*(a)+128) + (((c)*(a)+128)>>8))>>8)
+#define _QOM_STORE_RGBA_PREMUL(d, px)   ((d)[0] = _QOM_PREMUL((px).rgba.r, (px).rgba.a), (d)[1] = _QOM_PREMUL((px).rgba.g, (px).rgba.a), \
+                                         (d)[2] = _QOM_PREMUL((px).rgba.b, (px).rgba.a), (d)[3] = (px).rgba.a)
+#define _QOM_STORE_BGRA_PREMUL(d, px)   ((d)[0] = _QOM_PREMUL((px).rgba.b, (px).rgba.a), (d)[1] = _QOM_PREMUL((px).rgba.g, (px).rgba.a), \
+                                         (d)[2] = _QOM_PREMUL((px).rgba.r, (px).rgba.a), (d)[3] = (px).rgba.a)
+
+/* 
+ * Generate an encoder for the next npixels pixels, at most 5 bytes each, 
+ * that returns the number of bytes.  OPAQUE encoders are for formats 
+ * without alpha.
+ */
+#define _QOM_QOIENC_ENCODE(name, BPP, LOAD, OPAQUE)                                 \
+static int name(_qom_qoienc *e, unsigned char *bytes, const unsigned char *data, int npixels) \
+{                                                                                   \
+    qoi_rgba_t index[64];                                                           \
+    memcpy(index, e->index, sizeof(index));                                         \
+    qoi_rgba_t px, px_prev = e->px_prev;                                            \
+    int run = e->run;                                                               \
+    int next_restart = e->next_restart;                                             \
+    int restart_step = e->restart_step;                                             \
+    int px_last = e->px_end-1;                                                      \
+    qom_frameside *side = e->side;                                                  \
+    int base = e->base;                                                             \
+    int p = 0;                                                                      \
+                                                                                    \
+    int px_pos = e->px_pos;                                                         \
+    int px_end = px_pos+npixels;                                                    \
+    if(e->resync && px_pos == e->px_begin && px_pos<px_end) {                       \
+        LOAD(px, data);                                                             \
+        data += BPP;                                                                \
+        int index_pos = QOI_COLOR_HASH(px) % 64;                                    \
+        index[index_pos] = px;                                                      \
+        bytes[p++] = QOI_OP_RGBA;                                                   \
+        bytes[p++] = px.rgba.r;                                                     \
+        bytes[p++] = px.rgba.g;                                                     \
+        bytes[p++] = px.rgba.b;                                                     \
+        bytes[p++] = px.rgba.a;                                                     \
+        px_prev = px;                                                               \
+        px_pos++;                                                                   \
+    }                                                                               \
+    for(; px_pos<px_end; px_pos++) {                                                \
+        if(px_pos == next_restart) {                                                \
+            _qom_addrestart(side, base+p, -run, px_prev, index);                    \
+            next_restart += restart_step;                                           \
+        }                                                                           \
+        LOAD(px, data);                                                             \
+        data += BPP;                                                                \
+        if(px.v == px_prev.v) {                                                     \
+            run++;                                                                  \
+            if(run == 62 || px_pos == px_last) {                                    \
+                bytes[p++] = QOI_OP_RUN | (run-1);                                  \
+                _qom_endrun(side, base+p, run);                                     \
+                run = 0;                                                            \
+            }                                                                       \
+        } else {                                                                    \
+            if(run>0) {                                                             \
+                bytes[p++] = QOI_OP_RUN | (run-1);                                  \
+                _qom_endrun(side, base+p, run);                                     \
+                run = 0;                                                            \
+            }                                                                       \
+            int index_pos = QOI_COLOR_HASH(px) % 64;                                \
+            if(index[index_pos].v == px.v) {                                        \
+                bytes[p++] = QOI_OP_INDEX | index_pos;                              \
+            } else {                                                                \
+                index[index_pos] = px;                                              \
+                if(OPAQUE || px.rgba.a == px_prev.rgba.a) {                         \
+                    signed char vr = px.rgba.r - px_prev.rgba.r;                    \
+                    signed char vg = px.rgba.g - px_prev.rgba.g;                    \
+                    signed char vb = px.rgba.b - px_prev.rgba.b;                    \
+                    signed char vg_r = vr - vg;                                     \
+                    signed char vg_b = vb - vg;                                     \
+                    if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) { \
+                        bytes[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2); \
+                    } else if(vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) { \
+                        bytes[p++] = QOI_OP_LUMA | (vg + 32);                       \
+                        bytes[p++] = (vg_r + 8) << 4 | (vg_b + 8);                  \
+                    } else {                                                        \
+                        bytes[p++] = QOI_OP_RGB;                                    \
+                        bytes[p++] = px.rgba.r;                                     \
+                        bytes[p++] = px.rgba.g;                                     \
+                        bytes[p++] = px.rgba.b;                                     \
+                    }                                                               \
+                } else {                                                            \
+                    bytes[p++] = QOI_OP_RGBA;                                       \
+                    bytes[p++] = px.rgba.r;                                         \
+                    bytes[p++] = px.rgba.g;                                         \
+                    bytes[p++] = px.rgba.b;                                         \
+                    bytes[p++] = px.rgba.a;                                         \
+                }                                                                   \
+            }                                                                       \
+        }                                                                           \
+        px_prev = px;                                                               \
+    }                                                                               \
+    memcpy(e->index, index, sizeof(index));                                         \
+    e->px_prev = px_prev;                                                           \
+    e->run = run;                                                                   \
+    e->next_restart = next_restart;                                                 \
+    e->px_pos = px_end;                                                             \
+    return p;                                                                       \
+}
+
+_QOM_QOIENC_ENCODE(_qom_qoienc_rgba, 4, _QOM_LOAD_RGBA, 0)
+_QOM_QOIENC_ENCODE(_qom_qoienc_bgra, 4, _QOM_LOAD_BGRA, 0)
+_QOM_QOIENC_ENCODE(_qom_qoienc_rgb, 3, _QOM_LOAD_RGB, 1)
+_QOM_QOIENC_ENCODE(_qom_qoienc_rgbx, 4, _QOM_LOAD_RGBX, 1)
+_QOM_QOIENC_ENCODE(_qom_qoienc_bgrx, 4, _QOM_LOAD_BGRX, 1)
+
+/*
+ * 16 bit pixels, for displays that take RGB565 or RGBA4444.  Each channel 
+ * is a field of the pixel with red in the high bits.  8 bit values are 
+ * rounded to the nearest level, or with dithering moved up or down by a 
+ * 4x4 Bayer threshold, and expanded back by bit replication.
+ */
+typedef struct _qom_layout16 {
+    int shift[4];                       /* of the r, g, b and a fields */
+    int bits[4];                        /* 0 for no alpha */
+    int dbits[3];                       /* of r, g and b in a DELTA op */
+} _qom_layout16;
+
+static const _qom_layout16 _qom_rgb565 = { {11, 5, 0, 0}, {5, 6, 5, 0}, {4, 5, 4} };
+static const _qom_layout16 _qom_rgba4444 = { {12, 8, 4, 0}, {4, 4, 4, 4}, {4, 4, 4} };
+
+static const unsigned char _qom_bayer[16] = {
+     0,  8,  2, 10,
+    12,  4, 14,  6,
+     3, 11,  1,  9,
+    15,  7, 13,  5,
+};
+
+typedef struct _qom_quant16 {
+    const _qom_layout16 *l;
+    int dither;
+    unsigned short q[4][16][256];       /* field for each threshold and value, in place */
+} _qom_quant16;
+
+static _qom_quant16 *_qom_quant16_new(const _qom_layout16 *l, int dither)
+{
+    _qom_quant16 *qt = (_qom_quant16 *)malloc(sizeof(_qom_quant16));
+    qt->l = l;
+    qt->dither = dither;
+    int nd = dither ? 16 : 1;
+    for(int c=0; c<4; c++) {
+        int max = (1<<l->bits[c])-1;
+        for(int d=0; d<nd; d++) {
+            for(int v=0; v<256; v++) {
+                int q = dither ? (v*max*32 + (2*d+1)*255)/(255*32) : (v*max*2 + 255)/510;
+                qt->q[c][d][v] = q<<l->shift[c];
+            }
         }
-    } else {
-        fprintf(stderr, "qom: strange mode for open [%s]\n", mode);
-        _qom_free(qm);
-        return 0;
     }
-    return qm;
+    return qt;
 }
 
-int qom_getnframes(qom *qm) 
+static void _qom_quant16_row(const _qom_quant16 *qt, unsigned short *dst, const unsigned int *src, int n, int y)
 {
-    return qm->header.nframes;
+    qoi_rgba_t px;
+    if(!qt->dither) {
+        for(int x=0; x<n; x++) {
+            px.v = src[x];
+            dst[x] = qt->q[0][0][px.rgba.r] | qt->q[1][0][px.rgba.g] | qt->q[2][0][px.rgba.b] | qt->q[3][0][px.rgba.a];
+        }
+        return;
+    }
+    const unsigned char *b = _qom_bayer+(y&3)*4;
+    for(int x=0; x<n; x++) {
+        int d = b[x&3];
+        px.v = src[x];
+        dst[x] = qt->q[0][d][px.rgba.r] | qt->q[1][d][px.rgba.g] | qt->q[2][d][px.rgba.b] | qt->q[3][d][px.rgba.a];
+    }
 }
 
-double gfx_64ToUsec(unsigned int lo, unsigned int hi)
+static void _qom_expand16(const _qom_layout16 *l, unsigned int *dst, const unsigned short *src, int npixels)
 {
-    double dlo = lo;
-    double dhi = hi;
-    double dscale = 256*256;
-    dscale = dscale*dscale;
-    return ((dhi*dscale) + lo);
+    unsigned char e[4][64];
+    for(int c=0; c<4; c++) {
+        int max = (1<<l->bits[c])-1;
+        for(int q=0; q<=max; q++)
+            e[c][q] = max ? (q*255 + max/2)/max : 255;
+    }
+    int m[4];
+    for(int c=0; c<4; c++)
+        m[c] = (1<<l->bits[c])-1;
+    qoi_rgba_t px;
+    for(int i=0; i<npixels; i++) {
+        int v = src[i];
+        px.rgba.r = e[0][(v>>l->shift[0]) & m[0]];
+        px.rgba.g = e[1][(v>>l->shift[1]) & m[1]];
+        px.rgba.b = e[2][(v>>l->shift[2]) & m[2]];
+        px.rgba.a = e[3][(v>>l->shift[3]) & m[3]];
+        dst[i] = px.v;
+    }
 }
 
-void gfx_UsecTo64(double t, unsigned int *lo, unsigned int *hi)
+static const _qom_layout16 *_qom_formatlayout16(int format)
 {
-    double dscale = 256*256;
-    dscale = dscale*dscale;
-    double dhi = floor(t/dscale);
-    double dlo = t-(dhi*dscale);
-    *hi = dhi;
-    *lo = dlo;
+    switch(format) {
+        case qomFORMAT_RGB565:
+            return &_qom_rgb565;
+        case qomFORMAT_RGBA4444:
+            return &_qom_rgba4444;
+    }
+    return 0;
 }
 
-gfx_canvas *qom_getframe(qom *qm, int n, double *usec) 
+/* convert between gfx_canvas pixels and pixels in format */
+
+static void _qom_torgba(unsigned int *dst, const void *src, int npixels, int format)
 {
-    if((qm->mode == qomMODE_R) || (qm->mode == qomMODE_RW)) {
-        qom_frameinfo *info = _qom_getframeinfo(qm, n);
+    const unsigned char *s = (const unsigned char *)src;
+    qoi_rgba_t px;
+    switch(format) {
+        case qomFORMAT_BGRA:
+            for(int i=0; i<npixels; i++, s += 4) {
+                _QOM_LOAD_BGRA(px, s);
+                dst[i] = px.v;
+            }
+            return;
+        case qomFORMAT_RGB:
+            for(int i=0; i<npixels; i++, s += 3) {
+                _QOM_LOAD_RGB(px, s);
+                dst[i] = px.v;
+            }
+            return;
+        case qomFORMAT_RGBX:
+            for(int i=0; i<npixels; i++, s += 4) {
+                _QOM_LOAD_RGBX(px, s);
+                dst[i] = px.v;
+            }
+            return;
+        case qomFORMAT_BGRX:
+            for(int i=0; i<npixels; i++, s += 4) {
+                _QOM_LOAD_BGRX(px, s);
+                dst[i] = px.v;
+            }
+            return;
+    }
+    memcpy(dst, src, npixels*sizeof(unsigned int));
+}
 
-        fseek(qm->f, info->offset, SEEK_SET);
-        int input_encoding = _qom_readint(qm);
-        int imgdatasize = info->size-4;
-        *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
-        switch(input_encoding) {
-            case qomENCODING_LITERAL:
-                return _qom_readframe_LITERAL(qm, imgdatasize);
-            case qomENCODING_QOI:
-                return _qom_readframe_QOI(qm, imgdatasize);
-            case qomENCODING_PNG:
-                return _qom_readframe_PNG(qm, imgdatasize);
-            case qomENCODING_JPG:
-                return _qom_readframe_JPG(qm, imgdatasize);
-            default:
-                fprintf(stderr, "qom: strange frame encoding %d\n", input_encoding);
-                qm->error = qomERROR_FORMAT;
-                return 0;
+static void _qom_fromrgba(void *dst, const unsigned int *src, int npixels, int format)
+{
+    unsigned char *d = (unsigned char *)dst;
+    qoi_rgba_t px;
+    switch(format) {
+        case qomFORMAT_BGRA:
+            for(int i=0; i<npixels; i++, d += 4) {
+                px.v = src[i];
+                _QOM_STORE_BGRA(d, px);
+            }
+            return;
+        case qomFORMAT_RGB:
+            for(int i=0; i<npixels; i++, d += 3) {
+                px.v = src[i];
+                _QOM_STORE_RGB(d, px);
+            }
+            return;
+        case qomFORMAT_RGBX:
+            for(int i=0; i<npixels; i++, d += 4) {
+                px.v = src[i];
+                _QOM_STORE_RGBX(d, px);
+            }
+            return;
+        case qomFORMAT_BGRX:
+            for(int i=0; i<npixels; i++, d += 4) {
+                px.v = src[i];
+                _QOM_STORE_BGRX(d, px);
+            }
+            return;
+        case qomFORMAT_ALPHA:
+            for(int i=0; i<npixels; i++, d++) {
+                px.v = src[i];
+                _QOM_STORE_ALPHA(d, px);
+            }
+            return;
+        case qomFORMAT_RGBA_PREMUL:
+            for(int i=0; i<npixels; i++, d += 4) {
+                px.v = src[i];
+                _QOM_STORE_RGBA_PREMUL(d, px);
+            }
+            return;
+        case qomFORMAT_BGRA_PREMUL:
+            for(int i=0; i<npixels; i++, d += 4) {
+                px.v = src[i];
+                _QOM_STORE_BGRA_PREMUL(d, px);
+            }
+            return;
+        case qomFORMAT_RGB565:
+        case qomFORMAT_RGBA4444: {
+            _qom_quant16 *qt = _qom_quant16_new(_qom_formatlayout16(format), 0);
+            _qom_quant16_row(qt, (unsigned short *)dst, src, npixels, 0);
+            free(qt);
+            return;
         }
-    } else {
-        fprintf(stderr, "qom: can't getframe from movie being written\n");
-        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
-        return 0;
     }
+    memcpy(dst, src, npixels*sizeof(unsigned int));
 }
 
-double qom_getduration(qom *qm) 
+static int _qom_qoienc_encode(_qom_qoienc *e, unsigned char *bytes, const void *data, int npixels)
 {
-    return gfx_64ToUsec(qm->header.duration_lo, qm->header.duration_hi);
+    const unsigned char *d = (const unsigned char *)data;
+    switch(e->format) {
+        case qomFORMAT_BGRA:
+            return _qom_qoienc_bgra(e, bytes, d, npixels);
+        case qomFORMAT_RGB:
+            return _qom_qoienc_rgb(e, bytes, d, npixels);
+        case qomFORMAT_RGBX:
+            return _qom_qoienc_rgbx(e, bytes, d, npixels);
+        case qomFORMAT_BGRX:
+            return _qom_qoienc_bgrx(e, bytes, d, npixels);
+    }
+    return _qom_qoienc_rgba(e, bytes, d, npixels);
 }
 
-void qom_putframe(qom *qm, gfx_canvas *c, double usec) 
+/* frames in an opaque format are marked as 3 channel, the ops are the same */
+
+static int _qom_qoi_writeheader(unsigned char *bytes, int sizex, int sizey, int format)
 {
-    if((qm->mode == qomMODE_W) || (qm->mode == qomMODE_RW)) {
-        if(qom_getnframes(qm) == 0) {
-            qm->header.sizex = c->sizex;
-            qm->header.sizey = c->sizey;
-            qm->offset = sizeof(qom_header);
-            qm->firstframe_usec = usec;
-        }
-        double curframe_usec = usec-qm->firstframe_usec;
-        double startput_usec = _qom_getusec();
-        int size;
-        switch(qm->output_encoding) {
-            case qomENCODING_LITERAL:
-                _qom_writeint(qm, qomENCODING_LITERAL);
-                size = 4 + _qom_writeframe_LITERAL(qm, c);
-                break;
-            case qomENCODING_QOI:
-                _qom_writeint(qm, qomENCODING_QOI);
-                size = 4 + _qom_writeframe_QOI(qm, c);
-                break;
-            case qomENCODING_PNG:
-                _qom_writeint(qm, qomENCODING_PNG);
-                size = 4 + _qom_writeframe_PNG(qm, c);
-                break;
-            case qomENCODING_JPG:
-                _qom_writeint(qm, qomENCODING_JPG);
-                size = 4 + _qom_writeframe_JPG(qm, c);
-                break;
-            default:
-                fprintf(stderr, "qom: strange frame encoding %d\n", qm->output_encoding);
-                qm->error = qomERROR_FORMAT;
-                return;
-        }
-
-        qom_frameinfo fi;
-        gfx_UsecTo64(curframe_usec, &fi.time_lo, &fi.time_hi);
-        fi.encoding = qm->output_encoding;
-        fi.sizex = c->sizex;
-        fi.sizey = c->sizey;
-        fi.offset = qm->offset;
-        fi.size = size;
-        fi.encoding_usec = _qom_getusec()-startput_usec;
-        _qom_addframeinfo(qm, &fi, qm->header.nframes);
-
-        gfx_UsecTo64(curframe_usec, &qm->header.duration_lo, &qm->header.duration_hi);
-        qm->header.nframes++;
-        qm->offset += size;
-    } else {
-        fprintf(stderr, "qom: can't put a frame while reading a movie\n");
-        qm->error = qomERROR_PUTFRAME_WHILE_READ;
-    }
+    int p = 0;
+    qoi_write_32(bytes, &p, QOI_MAGIC);
+    qoi_write_32(bytes, &p, sizex);
+    qoi_write_32(bytes, &p, sizey);
+    bytes[p++] = _qom_formatopaque(format) ? 3 : 4;
+    bytes[p++] = QOI_SRGB;
+    return p;
 }
 
-void qom_putframenow(qom *qm, gfx_canvas *c) 
+/* encoded data goes to a sink, which returns 0 if it can't take it */
+
+typedef struct _qom_sink {
+    int (*write)(void *arg, const void *bytes, int size);
+    void *arg;
+} _qom_sink;
+
+/*
+ * Row encoder.  Rows are encoded into a fixed size buffer that goes to the 
+ * sink whenever the next rows might not fit, so a frame of any size is 
+ * encoded in bounded memory.  A pixel takes at most 5 bytes, but the first 
+ * pixel of a call can also end a run left from the call before, so each 
+ * call needs one more byte.
+ */
+typedef struct _qom_rowencoder {
+    _qom_qoienc enc;
+    qom_frameside *side;
+    _qom_sink sink;
+    unsigned char *bytes;
+    int bufsize;
+    int p;
+    int written;
+    int sizex, sizey;
+    int y;
+    int error;
+} _qom_rowencoder;
+
+#define QOM_WRITE_CHUNK         (64*1024)
+
+static _qom_rowencoder *_qom_rowencoder_new(int sizex, int sizey, int format, int restartrows, qom_frameside *side, _qom_sink sink)
 {
-    qom_putframe(qm, c, _qom_getusec()); 
+    _qom_rowencoder *re = (_qom_rowencoder *)malloc(sizeof(_qom_rowencoder));
+    side->restartrows = restartrows;
+    side->nrestarts = 0;
+    side->restarts = 0;
+    side->channels = _qom_formatopaque(format) ? 3 : 0;
+    side->tolerance = 0;
+    _qom_qoienc_init(&re->enc, 0, sizex*sizey, 0, restartrows*sizex, side);
+    re->enc.format = format;
+    re->side = side;
+    re->sink = sink;
+    re->bufsize = QOM_WRITE_CHUNK;
+    if(re->bufsize < 5*sizex+1+QOI_HEADER_SIZE+(int)sizeof(qoi_padding))
+        re->bufsize = 5*sizex+1+QOI_HEADER_SIZE+(int)sizeof(qoi_padding);
+    re->bytes = (unsigned char *)QOI_MALLOC(re->bufsize);
+    re->written = 0;
+    re->sizex = sizex;
+    re->sizey = sizey;
+    re->y = 0;
+    re->error = 0;
+    re->p = _qom_qoi_writeheader(re->bytes, sizex, sizey, format);
+    return re;
 }
 
-static const char *qom_encodingname(int encoding) 
+static void _qom_rowencoder_flush(_qom_rowencoder *re)
 {
-    switch(encoding) {
-        case qomENCODING_LITERAL:
-            return "LIT";
-        case qomENCODING_QOI:
-            return "QOI";
-        case qomENCODING_PNG:
-            return "PNG";
-        case qomENCODING_JPG:
-            return "JPG";
+    if((re->p>0) && !re->error) {
+        if(!re->sink.write(re->sink.arg, re->bytes, re->p))
+            re->error = 1;
     }
-    return "strange....";
+    re->written += re->p;
+    re->p = 0;
+}
+
+static void _qom_rowencoder_rows(_qom_rowencoder *re, const void *rows, int nrows)
+{
+    const unsigned char *data = (const unsigned char *)rows;
+    int rowbytes = re->sizex*_qom_formatbytes(re->enc.format);
+    if(re->y+nrows > re->sizey)
+        nrows = re->sizey-re->y;
+    int rowsfit = (re->bufsize-1-(int)sizeof(qoi_padding))/(5*re->sizex);
+    while(nrows>0) {
+        int n = (re->bufsize-re->p-1-(int)sizeof(qoi_padding))/(5*re->sizex);
+        if(n == 0) {
+            _qom_rowencoder_flush(re);
+            n = rowsfit;
+        }
+        if(n>nrows)
+            n = nrows;
+        re->enc.base = re->written+re->p;
+        re->p += _qom_qoienc_encode(&re->enc, re->bytes+re->p, data, n*re->sizex);
+        data += n*rowbytes;
+        re->y += n;
+        nrows -= n;
+    }
+}
+
+/* returns the size of the encoded frame, or 0 if it could not be written */
+
+static int _qom_rowencoder_end(_qom_rowencoder *re)
+{
+    int size = 0;
+    if(re->y == re->sizey) {
+        if(re->p+(int)sizeof(qoi_padding) > re->bufsize)
+            _qom_rowencoder_flush(re);
+        for(int i=0; i<(int)sizeof(qoi_padding); i++)
+            re->bytes[re->p++] = qoi_padding[i];
+        _qom_rowencoder_flush(re);
+        if(!re->error)
+            size = re->written;
+    }
+    QOI_FREE(re->bytes);
+    free(re);
+    return size;
+}
+
+/* 
+ * A frame is encoded as a number of stripes that are written one after 
+ * the other.  The first stripe holds the QOI header and the last one the 
+ * padding, so together they are one plain QOI image.
+ */
+typedef struct _qom_stripe {
+    unsigned char *bytes;
+    int size;
+    qom_frameside side;
+} _qom_stripe;
+
+typedef struct _qom_encodejob {
+    const unsigned char *data;
+    int format;
+    int sizex, sizey;
+    int stripe_pixels;
+    int restart_step;
+    int nstripes;
+    int first;
+    _qom_stripe *stripes;
+} _qom_encodejob;
+
+#define QOM_STRIPE_PIXELS       (64*1024)   /* smallest stripe worth a thread */
+
+static void _qom_encodestripe(void *arg, int job)
+{
+    _qom_encodejob *ej = (_qom_encodejob *)arg;
+    int i = ej->first+job;
+    _qom_stripe *st = ej->stripes+job;
+    int px_begin = i*ej->stripe_pixels;
+    int px_end = (i == ej->nstripes-1) ? ej->sizex*ej->sizey : px_begin+ej->stripe_pixels;
+    int head = (i == 0) ? QOI_HEADER_SIZE : 0;
+    int tail = (i == ej->nstripes-1) ? (int)sizeof(qoi_padding) : 0;
+
+    st->size = 0;
+    st->side.restartrows = 0;
+    st->side.nrestarts = 0;
+    st->side.restarts = 0;
+    st->side.channels = 0;
+    st->side.tolerance = 0;
+    st->bytes = (unsigned char *)QOI_MALLOC(head + (px_end-px_begin)*5 + tail);
+    if(!st->bytes)
+        return;
+    int p = 0;
+    if(head)
+        p += _qom_qoi_writeheader(st->bytes, ej->sizex, ej->sizey, ej->format);
+    _qom_qoienc enc;
+    _qom_qoienc_init(&enc, px_begin, px_end, i>0, ej->restart_step, &st->side);
+    enc.base = head;
+    enc.format = ej->format;
+    p += _qom_qoienc_encode(&enc, st->bytes+p, ej->data+px_begin*_qom_formatbytes(ej->format), px_end-px_begin);
+    for(int j=0; j<tail; j++)
+        st->bytes[p++] = qoi_padding[j];
+    st->size = p;
+}
+
+static int _qom_stripe_rows(int sizex, int sizey, int restartrows, int nthreads)
+{
+    if(nthreads<=1)
+        return sizey;
+    int min_rows = (QOM_STRIPE_PIXELS+sizex-1)/sizex;
+    int stripe_rows = (sizey+4*nthreads-1)/(4*nthreads);
+    if(stripe_rows<min_rows)
+        stripe_rows = min_rows;
+    if(restartrows>0)
+        stripe_rows = restartrows*((stripe_rows+restartrows-1)/restartrows);
+    if(stripe_rows>sizey)
+        stripe_rows = sizey;
+    return stripe_rows;
+}
+
+/*
+ * Encode a frame to sink.  Frames big enough to split are encoded in 
+ * stripes on up to nthreads threads, nthreads stripes at a time to bound 
+ * memory.  Stripes always start on a restart point, and the restart 
+ * points of all the stripes are gathered into side with offsets from the 
+ * start of the QOI data.  Otherwise the row encoder does the work.  
+ * Returns the size of the encoded frame, or 0 on failure.
+ */
+static int _qom_qoi_encodeframe(const void *data, int sizex, int sizey, int format, int restartrows, int nthreads, qom_frameside *side, _qom_sink sink)
+{
+    int stripe_rows = _qom_stripe_rows(sizex, sizey, restartrows, nthreads);
+    if(stripe_rows == sizey) {
+        _qom_rowencoder *re = _qom_rowencoder_new(sizex, sizey, format, restartrows, side, sink);
+        _qom_rowencoder_rows(re, data, sizey);
+        return _qom_rowencoder_end(re);
+    }
+
+    _qom_encodejob ej;
+    ej.data = (const unsigned char *)data;
+    ej.format = format;
+    ej.sizex = sizex;
+    ej.sizey = sizey;
+    ej.stripe_pixels = stripe_rows*sizex;
+    ej.restart_step = restartrows*sizex;
+    ej.nstripes = (sizey+stripe_rows-1)/stripe_rows;
+    ej.stripes = (_qom_stripe *)calloc(nthreads, sizeof(_qom_stripe));
+
+    side->restartrows = restartrows;
+    side->nrestarts = 0;
+    side->restarts = 0;
+    side->channels = _qom_formatopaque(format) ? 3 : 0;
+    side->tolerance = 0;
+    int base = 0;
+    for(ej.first = 0; ej.first<ej.nstripes; ej.first += nthreads) {
+        int njobs = ej.nstripes-ej.first;
+        if(njobs>nthreads)
+            njobs = nthreads;
+        _qom_parallel(njobs, nthreads, _qom_encodestripe, &ej);
+        for(int i=0; i<njobs; i++) {
+            _qom_stripe *st = ej.stripes+i;
+            if(st->bytes && (base>=0)) {
+                if(sink.write(sink.arg, st->bytes, st->size)) {
+                    if(st->side.nrestarts>0) {
+                        side->restarts = (qom_restart *)realloc(side->restarts, (side->nrestarts+st->side.nrestarts)*sizeof(qom_restart));
+                        for(int j=0; j<st->side.nrestarts; j++) {
+                            qom_restart *rs = side->restarts+side->nrestarts+j;
+                            *rs = st->side.restarts[j];
+                            rs->offset += base;
+                        }
+                        side->nrestarts += st->side.nrestarts;
+                    }
+                    base += st->size;
+                } else {
+                    base = -1;
+                }
+            } else {
+                base = -1;
+            }
+            QOI_FREE(st->bytes);
+            _qom_freeside(&st->side);
+        }
+    }
+    free(ej.stripes);
+    if(base<0) {
+        _qom_freeside(side);
+        return 0;
+    }
+    return base;
+}
+
+/* encode a frame into one buffer */
+
+typedef struct _qom_membuf {
+    unsigned char *bytes;
+    int size;
+    int alloc;
+} _qom_membuf;
+
+static int _qom_memwrite(void *arg, const void *bytes, int size)
+{
+    _qom_membuf *mb = (_qom_membuf *)arg;
+    if(mb->size+size > mb->alloc) {
+        mb->alloc = 2*(mb->size+size);
+        mb->bytes = (unsigned char *)realloc(mb->bytes, mb->alloc);
+    }
+    memcpy(mb->bytes+mb->size, bytes, size);
+    mb->size += size;
+    return 1;
+}
+
+static unsigned char *_qom_qoi_encode(const void *data, int sizex, int sizey, int format, int restartrows, int nthreads, qom_frameside *side, int *out_len)
+{
+    _qom_membuf mb;
+    mb.bytes = 0;
+    mb.size = 0;
+    mb.alloc = 0;
+    _qom_sink sink;
+    sink.write = _qom_memwrite;
+    sink.arg = &mb;
+    *out_len = _qom_qoi_encodeframe(data, sizex, sizey, format, restartrows, nthreads, side, sink);
+    if(*out_len == 0) {
+        free(mb.bytes);
+        return 0;
+    }
+    return mb.bytes;
+}
+
+/* decoder state at restart point rs, or at the start if rs is 0 */
+
+static void _qom_qoi_decodestart(const qom_restart *rs, int *p, int *run, qoi_rgba_t *px, qoi_rgba_t *index)
+{
+    if(rs) {
+        *p = rs->offset;
+        *run = rs->run;
+        px->v = rs->px;
+        memcpy(index, rs->index, 64*sizeof(qoi_rgba_t));
+    } else {
+        *p = QOI_HEADER_SIZE;
+        *run = 0;
+        px->rgba.r = 0;
+        px->rgba.g = 0;
+        px->rgba.b = 0;
+        px->rgba.a = 255;
+        memset(index, 0, 64*sizeof(qoi_rgba_t));
+    }
+}
+
+/* generate a decoder for pixels px_pos up to px_end starting from restart point rs */
+
+#define _QOM_QOI_DECODESPAN(name, BPP, STORE)                                       \
+static void name(const unsigned char *bytes, int size, const qom_restart *rs, unsigned char *pixels, int px_pos, int px_end) \
+{                                                                                   \
+    qoi_rgba_t index[64];                                                           \
+    qoi_rgba_t px;                                                                  \
+    int p, run;                                                                     \
+                                                                                    \
+    _qom_qoi_decodestart(rs, &p, &run, &px, index);                                 \
+    unsigned char *dst = pixels+px_pos*BPP;                                         \
+    int chunks_len = size - (int)sizeof(qoi_padding);                               \
+    for(; px_pos<px_end; px_pos++) {                                                \
+        if(run>0) {                                                                 \
+            run--;                                                                  \
+        } else if(p<chunks_len) {                                                   \
+            int b1 = bytes[p++];                                                    \
+            if(b1 == QOI_OP_RGB) {                                                  \
+                px.rgba.r = bytes[p++];                                             \
+                px.rgba.g = bytes[p++];                                             \
+                px.rgba.b = bytes[p++];                                             \
+            } else if(b1 == QOI_OP_RGBA) {                                          \
+                px.rgba.r = bytes[p++];                                             \
+                px.rgba.g = bytes[p++];                                             \
+                px.rgba.b = bytes[p++];                                             \
+                px.rgba.a = bytes[p++];                                             \
+            } else if((b1 & QOI_MASK_2) == QOI_OP_INDEX) {                          \
+                px = index[b1];                                                     \
+            } else if((b1 & QOI_MASK_2) == QOI_OP_DIFF) {                           \
+                px.rgba.r += ((b1 >> 4) & 0x03) - 2;                                \
+                px.rgba.g += ((b1 >> 2) & 0x03) - 2;                                \
+                px.rgba.b += ( b1       & 0x03) - 2;                                \
+            } else if((b1 & QOI_MASK_2) == QOI_OP_LUMA) {                           \
+                int b2 = bytes[p++];                                                \
+                int vg = (b1 & 0x3f) - 32;                                          \
+                px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);                           \
+                px.rgba.g += vg;                                                    \
+                px.rgba.b += vg - 8 +  (b2       & 0x0f);                           \
+            } else if((b1 & QOI_MASK_2) == QOI_OP_RUN) {                            \
+                run = (b1 & 0x3f);                                                  \
+            }                                                                       \
+            index[QOI_COLOR_HASH(px) % 64] = px;                                    \
+        }                                                                           \
+        STORE(dst, px);                                                             \
+        dst += BPP;                                                                 \
+    }                                                                               \
+}
+
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_rgba, 4, _QOM_STORE_RGBA)
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_bgra, 4, _QOM_STORE_BGRA)
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_rgb, 3, _QOM_STORE_RGB)
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_rgbx, 4, _QOM_STORE_RGBX)
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_bgrx, 4, _QOM_STORE_BGRX)
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_alpha, 1, _QOM_STORE_ALPHA)
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_rgba_premul, 4, _QOM_STORE_RGBA_PREMUL)
+_QOM_QOI_DECODESPAN(_qom_qoi_decodespan_bgra_premul, 4, _QOM_STORE_BGRA_PREMUL)
+
+typedef void (*_qom_decodespanfunc)(const unsigned char *bytes, int size, const qom_restart *rs, unsigned char *pixels, int px_pos, int px_end);
+
+static _qom_decodespanfunc _qom_qoi_decodespanfunc(int format)
+{
+    switch(format) {
+        case qomFORMAT_BGRA:
+            return _qom_qoi_decodespan_bgra;
+        case qomFORMAT_RGB:
+            return _qom_qoi_decodespan_rgb;
+        case qomFORMAT_RGBX:
+            return _qom_qoi_decodespan_rgbx;
+        case qomFORMAT_BGRX:
+            return _qom_qoi_decodespan_bgrx;
+        case qomFORMAT_ALPHA:
+            return _qom_qoi_decodespan_alpha;
+        case qomFORMAT_RGBA_PREMUL:
+            return _qom_qoi_decodespan_rgba_premul;
+        case qomFORMAT_BGRA_PREMUL:
+            return _qom_qoi_decodespan_bgra_premul;
+    }
+    return _qom_qoi_decodespan_rgba;
+}
+
+typedef struct _qom_decodejob {
+    const unsigned char *bytes;
+    int size;
+    const qom_frameside *side;
+    _qom_decodespanfunc span;
+    unsigned char *pixels;
+    int px_len;
+    int step;
+} _qom_decodejob;
+
+static void _qom_decodesegment(void *arg, int seg)
+{
+    _qom_decodejob *dj = (_qom_decodejob *)arg;
+    int px_pos = seg*dj->step;
+    int px_end = (seg == dj->side->nrestarts) ? dj->px_len : px_pos+dj->step;
+    const qom_restart *rs = (seg == 0) ? 0 : dj->side->restarts+(seg-1);
+    dj->span(dj->bytes, dj->size, rs, dj->pixels, px_pos, px_end);
+}
+
+static int _qom_qoi_header(const unsigned char *bytes, int size, int *sizex, int *sizey)
+{
+    if(size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding))
+        return 0;
+    int p = 0;
+    unsigned int magic = qom_read_32(bytes, &p);
+    *sizex = qom_read_32(bytes, &p);
+    *sizey = qom_read_32(bytes, &p);
+    return (magic == QOI_MAGIC) && (*sizex > 0) && (*sizey > 0);
+}
+
+/* the restart points of side fit a QOI frame of size bytes */
+
+static int _qom_restartsvalid(const qom_frameside *side, int size, int sizex, int sizey)
+{
+    int px_len = sizex*sizey;
+    int step = side->restartrows*sizex;
+    if(side->restartrows<=0 || side->nrestarts*step >= px_len || (side->nrestarts+1)*step < px_len)
+        return 0;
+    for(int i=0; i<side->nrestarts; i++) {
+        if(side->restarts[i].offset<QOI_HEADER_SIZE || side->restarts[i].offset>size || side->restarts[i].run<0 || side->restarts[i].run>62)
+            return 0;
+    }
+    return 1;
+}
+
+/* 
+ * Decode a QOI frame into pixels in format, splitting it across threads 
+ * at its restart points if it has any.
+ */
+static void _qom_qoi_decodeinto(const unsigned char *bytes, int size, const qom_frameside *side, int nthreads, int format, void *pixels, int sizex, int sizey)
+{
+    _qom_decodejob dj;
+    dj.bytes = bytes;
+    dj.size = size;
+    dj.side = side;
+    dj.span = _qom_qoi_decodespanfunc(format);
+    dj.pixels = (unsigned char *)pixels;
+    dj.px_len = sizex*sizey;
+    dj.step = side ? side->restartrows*sizex : 0;
+    if((nthreads>1) && side && (side->nrestarts>0) && _qom_restartsvalid(side, size, sizex, sizey))
+        _qom_parallel(side->nrestarts+1, nthreads, _qom_decodesegment, &dj);
+    else
+        dj.span(bytes, size, 0, dj.pixels, 0, dj.px_len);
+}
+
+static unsigned int *_qom_qoi_decode(const unsigned char *bytes, int size, const qom_frameside *side, int nthreads, int *sizex, int *sizey)
+{
+    if(!_qom_qoi_header(bytes, size, sizex, sizey))
+        return 0;
+    unsigned int *pixels = (unsigned int *)qom_alloc(*sizex * *sizey * sizeof(unsigned int));
+    _qom_qoi_decodeinto(bytes, size, side, nthreads, qomFORMAT_RGBA, pixels, *sizex, *sizey);
+    return pixels;
+}
+
+static int _qom_filewrite(void *arg, const void *bytes, int size)
+{
+    return _qom_write((qom *)arg, bytes, size) == size;
+}
+
+static _qom_sink _qom_filesink(qom *qm)
+{
+    _qom_sink sink;
+    sink.write = _qom_filewrite;
+    sink.arg = qm;
+    return sink;
+}
+
+/*
+ * Near-lossless QOI.  Each pixel may move by up to tolerance in R, G and 
+ * B, alpha is kept, so that QOI codes it more cheaply: it continues the 
+ * run of the previous pixel, matches the color index, or fits a DIFF or 
+ * LUMA op.  Decisions follow the pixels the decoder will see, so errors 
+ * don't build up, and the result is coded as plain QOI.
+ */
+static int _qom_within(qoi_rgba_t a, qoi_rgba_t b, int tolerance)
+{
+    return (a.rgba.a == b.rgba.a) && (abs(a.rgba.r-b.rgba.r)<=tolerance) && (abs(a.rgba.g-b.rgba.g)<=tolerance) && (abs(a.rgba.b-b.rgba.b)<=tolerance);
+}
+
+static int _qom_clamp(int v, int lo, int hi)
+{
+    return (v<lo) ? lo : ((v>hi) ? hi : v);
+}
+
+static void _qom_nearlossless(unsigned int *out, const unsigned int *in, int npixels, int tolerance)
+{
+    qoi_rgba_t index[64];
+    memset(index, 0, sizeof(index));
+    qoi_rgba_t prev;
+    prev.rgba.r = 0;
+    prev.rgba.g = 0;
+    prev.rgba.b = 0;
+    prev.rgba.a = 255;
+    for(int i=0; i<npixels; i++) {
+        qoi_rgba_t px;
+        px.v = in[i];
+        if(_qom_within(px, prev, tolerance)) {
+            out[i] = prev.v;
+            continue;
+        }
+        qoi_rgba_t q = index[QOI_COLOR_HASH(px) % 64];
+        if(!_qom_within(px, q, tolerance)) {
+            int vr = (signed char)(px.rgba.r-prev.rgba.r);
+            int vg = (signed char)(px.rgba.g-prev.rgba.g);
+            int vb = (signed char)(px.rgba.b-prev.rgba.b);
+            q = prev;
+            q.rgba.r += _qom_clamp(vr, -2, 1);
+            q.rgba.g += _qom_clamp(vg, -2, 1);
+            q.rgba.b += _qom_clamp(vb, -2, 1);
+            if(!_qom_within(px, q, tolerance)) {
+                int dg = _qom_clamp(vg, -32, 31);
+                q = prev;
+                q.rgba.r += dg+_qom_clamp(vr-dg, -8, 7);
+                q.rgba.g += dg;
+                q.rgba.b += dg+_qom_clamp(vb-dg, -8, 7);
+                if(!_qom_within(px, q, tolerance))
+                    q = px;
+            }
+        }
+        index[QOI_COLOR_HASH(q) % 64] = q;
+        prev = q;
+        out[i] = q.v;
+    }
+}
+
+static int _qom_writeframe_QOI(qom *qm, gfx_canvas *c, qom_frameside *side) {
+    int restartrows = _qom_restartrows(qm->restartrows, c->sizex);
+    int format = _qom_isopaque(c->data, c->sizex*c->sizey) ? qomFORMAT_RGBX : qomFORMAT_RGBA;
+    unsigned int *data = c->data;
+    if(qm->tolerance>0) {
+        data = (unsigned int *)qom_alloc(c->sizex*c->sizey*sizeof(unsigned int));
+        _qom_nearlossless(data, c->data, c->sizex*c->sizey, qm->tolerance);
+    }
+    int size = _qom_qoi_encodeframe(data, c->sizex, c->sizey, format, restartrows, qm->nthreads, side, _qom_filesink(qm));
+    if (size == 0) {
+        fprintf(stderr, "qoiwriteframe error\n");
+        exit(1);
+    }
+    if(data != c->data) {
+        qom_free(data);
+        side->tolerance = qm->tolerance;
+    }
+    return size;
+}
+
+static int _qom_writeframe_PNG(qom *qm, gfx_canvas *c) 
+{
+    int size;
+    unsigned char *encoded = stbi_write_png_to_mem((unsigned char *)c->data, 4*c->sizex, c->sizex, c->sizey, 4, &size);
+    int bytes_write = _qom_write(qm, encoded, size);
+    if(bytes_write != size) {
+        fprintf(stderr, "qoiwriteframe error\n");
+        exit(1);
+    }
+    free(encoded);
+    return size;
+}
+
+static int _qom_writeframe_JPG(qom *qm, gfx_canvas *c) 
+{
+    (void)qm;
+    (void)c;
+    return 0;
+}
+
+
+/* LITERAL frames are just the pixels, so the size comes from the frame table */
+
+static gfx_canvas *_qom_readframe_LITERAL(qom *qm, int size, qom_frameinfo *info) 
+{
+    int sizex = info->sizex;
+    int sizey = info->sizey;
+    if(size != 4*sizex*sizey) {
+        fprintf(stderr, "qom_readframe_LITERAL: strange frame size %d\n", size);
+        exit(1);
+    }
+    void *data = qom_alloc(size);
+    int bytes_read = _qom_read(qm, data, size);
+    return _qom_poolcanvas(sizex, sizey, data);
+}
+
+static gfx_canvas *_qom_readframe_QOI(qom *qm, int size, qom_frameside *side) 
+{
+    void *data = qom_alloc(size);
+    int bytes_read = _qom_read(qm, data, size);
+    int sizex, sizey;
+    unsigned int *pixels = _qom_qoi_decode((unsigned char *)data, bytes_read, side, qm->nthreads, &sizex, &sizey);
+    if(!pixels) {
+        fprintf(stderr, "qom_readframe_QOI: decode error\n");
+        exit(1);
+    }
+    qom_free(data);
+    return _qom_poolcanvas(sizex, sizey, pixels);
+}
+
+static gfx_canvas *_qom_readframe_PNG(qom *qm, int size) 
+{
+    unsigned char *bytes = (unsigned char *)qom_alloc(size);
+    int bytes_read = _qom_read(qm, bytes, size);
+    int sizex, sizey, n;
+    void *data = stbi_load_from_memory(bytes, bytes_read, &sizex, &sizey, &n, 4);
+    qom_free(bytes);
+    if(!data) {
+        fprintf(stderr, "qom_readframe_PNG: decode error\n");
+        exit(1);
+    }
+    return gfx_canvas_new_withdata(sizex, sizey, data);
+}
+
+static gfx_canvas *_qom_readframe_JPG(qom *qm, int size)
+{
+    (void)qm;
+    (void)size;
+    return gfx_canvas_new(1,1);
+}
+
+/* 
+ * Palette coding.  Frames with at most 256 colors are stored as a palette 
+ * and an index for each pixel, packed two to a byte for up to 16 colors, 
+ * and run length coded with PackBits.  The payload is
+ *
+ *     sizex sizey ncolors bits palette[ncolors] ncoded coded[ncoded]
+ *
+ * with a 4 byte int for each item but coded.
+ */
+#define QOM_PALETTE_COLORS      (256)
+#define _QOM_PALETTE_HASH       (1024)  /* power of 2, a few times QOM_PALETTE_COLORS */
+
+/* returns the number of colors, or 0 if there are too many */
+
+static int _qom_palette_build(const unsigned int *data, int npixels, unsigned int *palette, unsigned char *indices)
+{
+    unsigned int keys[_QOM_PALETTE_HASH];
+    short slots[_QOM_PALETTE_HASH];
+    for(int h=0; h<_QOM_PALETTE_HASH; h++)
+        slots[h] = -1;
+    int ncolors = 0;
+    unsigned int last = 0;
+    int lastindex = -1;
+    for(int i=0; i<npixels; i++) {
+        unsigned int v = data[i];
+        if((v != last) || (lastindex<0)) {
+            unsigned int h = (v*2654435761u) >> 22;
+            while((slots[h] >= 0) && (keys[h] != v))
+                h = (h+1) & (_QOM_PALETTE_HASH-1);
+            if(slots[h] < 0) {
+                if(ncolors == QOM_PALETTE_COLORS)
+                    return 0;
+                keys[h] = v;
+                slots[h] = ncolors;
+                palette[ncolors++] = v;
+            }
+            last = v;
+            lastindex = slots[h];
+        }
+        indices[i] = lastindex;
+    }
+    return ncolors;
+}
+
+/* PackBits: n+1 literal bytes follow a header n below 128, a header n above 128 repeats the next byte 257-n times */
+
+static int _qom_packbits(const unsigned char *in, int n, unsigned char *out)
+{
+    int p = 0;
+    int i = 0;
+    while(i<n) {
+        int run = 1;
+        while((i+run<n) && (run<128) && (in[i+run] == in[i]))
+            run++;
+        if(run>=3) {
+            out[p++] = 257-run;
+            out[p++] = in[i];
+            i += run;
+            continue;
+        }
+        int start = i;
+        int len = 0;
+        while((i<n) && (len<128)) {
+            if((i+2<n) && (in[i] == in[i+1]) && (in[i] == in[i+2]))
+                break;
+            i++;
+            len++;
+        }
+        out[p++] = len-1;
+        memcpy(out+p, in+start, len);
+        p += len;
+    }
+    return p;
+}
+
+static int _qom_unpackbits(const unsigned char *in, int size, unsigned char *out, int n)
+{
+    int p = 0;
+    int o = 0;
+    while((p<size) && (o<n)) {
+        int h = in[p++];
+        if(h<128) {
+            int len = h+1;
+            if((p+len>size) || (o+len>n))
+                return 0;
+            memcpy(out+o, in+p, len);
+            p += len;
+            o += len;
+        } else if(h>128) {
+            int len = 257-h;
+            if((p>=size) || (o+len>n))
+                return 0;
+            memset(out+o, in[p++], len);
+            o += len;
+        }
+    }
+    return o == n;
+}
+
+/* returns the payload, or 0 if the frame has too many colors */
+
+static unsigned char *_qom_palette_encode(const unsigned int *data, int sizex, int sizey, int *out_len)
+{
+    int npixels = sizex*sizey;
+    unsigned int palette[QOM_PALETTE_COLORS];
+    unsigned char *indices = (unsigned char *)malloc(npixels);
+    int ncolors = _qom_palette_build(data, npixels, palette, indices);
+    if(ncolors == 0) {
+        free(indices);
+        return 0;
+    }
+    int bits = 8;
+    int nindex = npixels;
+    if(ncolors<=16) {
+        bits = 4;
+        nindex = (npixels+1)/2;
+        for(int i=0; i<nindex; i++) {
+            int lo = (2*i+1<npixels) ? indices[2*i+1] : 0;
+            indices[i] = (indices[2*i]<<4) | lo;
+        }
+    }
+    unsigned char *bytes = (unsigned char *)malloc(20+4*ncolors+nindex+nindex/128+1);
+    int p = 0;
+    qom_write_32(bytes, &p, sizex);
+    qom_write_32(bytes, &p, sizey);
+    qom_write_32(bytes, &p, ncolors);
+    qom_write_32(bytes, &p, bits);
+    for(int i=0; i<ncolors; i++)
+        qom_write_32(bytes, &p, _qom_pxtoint(palette[i]));
+    int ncoded = _qom_packbits(indices, nindex, bytes+p+4);
+    qom_write_32(bytes, &p, ncoded);
+    free(indices);
+    *out_len = p+ncoded;
+    return bytes;
+}
+
+/* returns one index per pixel, or 0 if the payload is bad */
+
+static unsigned char *_qom_palette_decode(const unsigned char *bytes, int size, int *sizex, int *sizey, unsigned int *palette, int *ncolors)
+{
+    if(size<20)
+        return 0;
+    int p = 0;
+    *sizex = qom_read_32(bytes, &p);
+    *sizey = qom_read_32(bytes, &p);
+    *ncolors = qom_read_32(bytes, &p);
+    int bits = qom_read_32(bytes, &p);
+    if((*sizex<=0) || (*sizey<=0) || (*ncolors<1) || (*ncolors>QOM_PALETTE_COLORS) || ((bits != 4) && (bits != 8)))
+        return 0;
+    if(p+4*(*ncolors)+4 > size)
+        return 0;
+    for(int i=0; i<*ncolors; i++)
+        palette[i] = _qom_inttopx(qom_read_32(bytes, &p));
+    int ncoded = qom_read_32(bytes, &p);
+    if(p+ncoded > size)
+        return 0;
+    int npixels = *sizex * *sizey;
+    int nindex = (bits == 4) ? (npixels+1)/2 : npixels;
+    unsigned char *indices = (unsigned char *)malloc(npixels+1);
+    if(!_qom_unpackbits(bytes+p, ncoded, indices, nindex)) {
+        free(indices);
+        return 0;
+    }
+    if(bits == 4) {
+        for(int i=nindex-1; i>=0; i--) {
+            int b = indices[i];
+            indices[2*i] = b>>4;
+            indices[2*i+1] = b & 0xf;
+        }
+    }
+    for(int i=0; i<npixels; i++) {
+        if(indices[i] >= *ncolors) {
+            free(indices);
+            return 0;
+        }
+    }
+    return indices;
+}
+
+/* a lookup per pixel, simple enough for the compiler to use gathers */
+
+static void _qom_palette_expand(unsigned int *pixels, const unsigned char *indices, int npixels, const unsigned int *palette)
+{
+    for(int i=0; i<npixels; i++)
+        pixels[i] = palette[indices[i]];
+}
+
+/* returns the frame size, or 0 if the frame has too many colors and nothing was written */
+
+static int _qom_writeframe_PALETTE(qom *qm, gfx_canvas *c)
+{
+    int size;
+    unsigned char *bytes = _qom_palette_encode(c->data, c->sizex, c->sizey, &size);
+    if(!bytes)
+        return 0;
+    _qom_writeint(qm, qomENCODING_PALETTE);
+    int bytes_write = _qom_write(qm, bytes, size);
+    if(bytes_write != size) {
+        fprintf(stderr, "qoiwriteframe error\n");
+        exit(1);
+    }
+    free(bytes);
+    return 4 + size;
+}
+
+static unsigned char *_qom_readframe_indices(qom *qm, int size, int *sizex, int *sizey, unsigned int *palette, int *ncolors)
+{
+    unsigned char *data = (unsigned char *)qom_alloc(size);
+    int bytes_read = _qom_read(qm, data, size);
+    unsigned char *indices = _qom_palette_decode(data, bytes_read, sizex, sizey, palette, ncolors);
+    qom_free(data);
+    return indices;
+}
+
+static gfx_canvas *_qom_readframe_PALETTE(qom *qm, int size)
+{
+    int sizex, sizey, ncolors;
+    unsigned int palette[QOM_PALETTE_COLORS];
+    unsigned char *indices = _qom_readframe_indices(qm, size, &sizex, &sizey, palette, &ncolors);
+    if(!indices) {
+        fprintf(stderr, "qom_readframe_PALETTE: decode error\n");
+        exit(1);
+    }
+    gfx_canvas *c = gfx_canvas_new(sizex, sizey);
+    _qom_palette_expand(c->data, indices, sizex*sizey, palette);
+    free(indices);
+    return c;
+}
+
+/* 
+ * Predictive coding, for photographic frames.  Each pixel goes through a 
+ * reversible YCoCg-R transform done mod 256, with Co and Cg offset by 128 
+ * so gray is 128.  Each row then picks one of four predictors, as in PNG, 
+ * and the residuals are coded with QOI's ops against a zero residual 
+ * instead of the previous pixel.  The payload is
+ *
+ *     sizex sizey { predictor ops... } for each row
+ *
+ * with 4 byte ints and a byte for the predictor.  Runs never cross rows.  
+ * qomEFFORT_FAST picks the predictor with the smallest sum of residuals, 
+ * qomEFFORT_HIGH codes the row with each of them and keeps the shortest.
+ */
+#define _QOM_PRED_LEFT          (0)
+#define _QOM_PRED_UP            (1)
+#define _QOM_PRED_AVG           (2)
+#define _QOM_PRED_PAETH         (3)
+#define _QOM_NPRED              (4)
+#define _QOM_PRED_PAD           (8)     /* zero bytes after the payload, so ops can read ahead */
+
+static void _qom_ycocg_row(unsigned char *out, const unsigned int *in, int n)
+{
+    const unsigned char *s = (const unsigned char *)in;
+    for(int i=0; i<n; i++) {
+        unsigned char co = s[0]-s[2];
+        unsigned char t = s[2] + (((signed char)co)>>1);
+        unsigned char cg = s[1]-t;
+        out[0] = t + (((signed char)cg)>>1);
+        out[1] = co+128;
+        out[2] = cg+128;
+        out[3] = s[3];
+        s += 4;
+        out += 4;
+    }
+}
+
+static void _qom_rgb_row(unsigned int *out, const unsigned char *in, int n)
+{
+    unsigned char *d = (unsigned char *)out;
+    for(int i=0; i<n; i++) {
+        unsigned char co = in[1]-128;
+        unsigned char cg = in[2]-128;
+        unsigned char t = in[0] - (((signed char)cg)>>1);
+        unsigned char b = t - (((signed char)co)>>1);
+        d[0] = b+co;
+        d[1] = cg+t;
+        d[2] = b;
+        d[3] = in[3];
+        in += 4;
+        d += 4;
+    }
+}
+
+/* written so the compiler can use conditional moves, rows are mostly Paeth */
+
+static int _qom_paeth(int a, int b, int c)
+{
+    int pa = abs(b-c);
+    int pb = abs(a-c);
+    int pc = abs(a+b-c-c);
+    int ab = (pa<=pb) ? a : b;
+    int pab = (pa<=pb) ? pa : pb;
+    return (pab<=pc) ? ab : c;
+}
+
+/* n bytes of residuals for the row cur under the row prev */
+
+static void _qom_predict_row(unsigned char *res, const unsigned char *cur, const unsigned char *prev, int n, int pred)
+{
+    int i;
+    switch(pred) {
+        case _QOM_PRED_LEFT:
+            for(i=0; i<4; i++)
+                res[i] = cur[i];
+            for(; i<n; i++)
+                res[i] = cur[i]-cur[i-4];
+            break;
+        case _QOM_PRED_UP:
+            for(i=0; i<n; i++)
+                res[i] = cur[i]-prev[i];
+            break;
+        case _QOM_PRED_AVG:
+            for(i=0; i<4; i++)
+                res[i] = cur[i]-(prev[i]>>1);
+            for(; i<n; i++)
+                res[i] = cur[i]-((cur[i-4]+prev[i])>>1);
+            break;
+        case _QOM_PRED_PAETH:
+            for(i=0; i<4; i++)
+                res[i] = cur[i]-prev[i];
+            for(; i<n; i++)
+                res[i] = cur[i]-_qom_paeth(cur[i-4], prev[i], prev[i-4]);
+            break;
+    }
+}
+
+static void _qom_unpredict_row(unsigned char *cur, const unsigned char *res, const unsigned char *prev, int n, int pred)
+{
+    int i;
+    switch(pred) {
+        case _QOM_PRED_LEFT:
+            for(i=0; i<4; i++)
+                cur[i] = res[i];
+            for(; i<n; i++)
+                cur[i] = res[i]+cur[i-4];
+            break;
+        case _QOM_PRED_UP:
+            for(i=0; i<n; i++)
+                cur[i] = res[i]+prev[i];
+            break;
+        case _QOM_PRED_AVG:
+            for(i=0; i<4; i++)
+                cur[i] = res[i]+(prev[i]>>1);
+            for(; i<n; i++)
+                cur[i] = res[i]+((cur[i-4]+prev[i])>>1);
+            break;
+        case _QOM_PRED_PAETH:
+            for(i=0; i<4; i++)
+                cur[i] = res[i]+prev[i];
+            for(; i<n; i++)
+                cur[i] = res[i]+_qom_paeth(cur[i-4], prev[i], prev[i-4]);
+            break;
+    }
+}
+
+static int _qom_predict_cost(const unsigned char *res, int n)
+{
+    int cost = 0;
+    for(int i=0; i<n; i++)
+        cost += abs((signed char)res[i]);
+    return cost;
+}
+
+/* code a row of residuals, returns the number of bytes */
+
+static int _qom_predict_ops(unsigned char *bytes, const unsigned char *res, int sizex, qoi_rgba_t *index)
+{
+    int p = 0;
+    int run = 0;
+    for(int x=0; x<sizex; x++, res += 4) {
+        qoi_rgba_t px;
+        memcpy(&px, res, 4);
+        if(px.v == 0) {
+            run++;
+            if(run == 62) {
+                bytes[p++] = QOI_OP_RUN | (run-1);
+                run = 0;
+            }
+            continue;
+        }
+        if(run>0) {
+            bytes[p++] = QOI_OP_RUN | (run-1);
+            run = 0;
+        }
+        int index_pos = QOI_COLOR_HASH(px) % 64;
+        if(index[index_pos].v == px.v) {
+            bytes[p++] = QOI_OP_INDEX | index_pos;
+            continue;
+        }
+        index[index_pos] = px;
+        if(res[3] == 0) {
+            signed char vy = res[0];
+            signed char vco = res[1];
+            signed char vcg = res[2];
+            if((vy>-3) && (vy<2) && (vco>-3) && (vco<2) && (vcg>-3) && (vcg<2)) {
+                bytes[p++] = QOI_OP_DIFF | (vy+2)<<4 | (vco+2)<<2 | (vcg+2);
+            } else if((vy>-33) && (vy<32) && (vco>-9) && (vco<8) && (vcg>-9) && (vcg<8)) {
+                bytes[p++] = QOI_OP_LUMA | (vy+32);
+                bytes[p++] = (vco+8)<<4 | (vcg+8);
+            } else {
+                bytes[p++] = QOI_OP_RGB;
+                bytes[p++] = res[0];
+                bytes[p++] = res[1];
+                bytes[p++] = res[2];
+            }
+        } else {
+            bytes[p++] = QOI_OP_RGBA;
+            bytes[p++] = res[0];
+            bytes[p++] = res[1];
+            bytes[p++] = res[2];
+            bytes[p++] = res[3];
+        }
+    }
+    if(run>0)
+        bytes[p++] = QOI_OP_RUN | (run-1);
+    return p;
+}
+
+/* decode a row of residuals starting at bytes[p], returns the new p or -1 */
+
+static int _qom_predict_unops(unsigned char *res, int sizex, const unsigned char *bytes, int p, int size, qoi_rgba_t *index)
+{
+    unsigned char *end = res+4*sizex;
+    while(res<end) {
+        if(p>=size)
+            return -1;
+        int b1 = bytes[p++];
+        if(b1 == QOI_OP_RGB) {
+            res[0] = bytes[p];
+            res[1] = bytes[p+1];
+            res[2] = bytes[p+2];
+            res[3] = 0;
+            p += 3;
+        } else if(b1 == QOI_OP_RGBA) {
+            memcpy(res, bytes+p, 4);
+            p += 4;
+        } else if((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+            int run = (b1 & 0x3f)+1;
+            if(res+4*run>end)
+                return -1;
+            memset(res, 0, 4*run);
+            res += 4*run;
+            continue;
+        } else if((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+            memcpy(res, index+b1, 4);
+            res += 4;
+            continue;
+        } else if((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+            res[0] = ((b1>>4) & 0x03)-2;
+            res[1] = ((b1>>2) & 0x03)-2;
+            res[2] = (b1 & 0x03)-2;
+            res[3] = 0;
+        } else {
+            int b2 = bytes[p++];
+            res[0] = (b1 & 0x3f)-32;
+            res[1] = (b2>>4)-8;
+            res[2] = (b2 & 0x0f)-8;
+            res[3] = 0;
+        }
+        qoi_rgba_t px;
+        memcpy(&px, res, 4);
+        index[QOI_COLOR_HASH(px) % 64] = px;
+        res += 4;
+    }
+    return (p<=size) ? p : -1;
+}
+
+static unsigned char *_qom_predict_encode(const unsigned int *data, int sizex, int sizey, int effort, int *out_len)
+{
+    int n = 4*sizex;
+    unsigned char *bytes = (unsigned char *)malloc(8+sizey*(1+5*sizex)+_QOM_PRED_PAD);
+    unsigned char *cur = (unsigned char *)malloc(n);
+    unsigned char *prev = (unsigned char *)calloc(n, 1);
+    unsigned char *res = (unsigned char *)malloc(_QOM_NPRED*n);
+    unsigned char *trial = (unsigned char *)malloc(_QOM_NPRED*5*sizex);
+    qoi_rgba_t index[64];
+    qoi_rgba_t trialindex[_QOM_NPRED][64];
+    memset(index, 0, sizeof(index));
+    int p = 0;
+    qom_write_32(bytes, &p, sizex);
+    qom_write_32(bytes, &p, sizey);
+    for(int y=0; y<sizey; y++) {
+        _qom_ycocg_row(cur, data+y*sizex, sizex);
+        int best = 0;
+        if(effort == qomEFFORT_HIGH) {
+            int len[_QOM_NPRED];
+            for(int pr=0; pr<_QOM_NPRED; pr++) {
+                _qom_predict_row(res, cur, prev, n, pr);
+                memcpy(trialindex[pr], index, sizeof(index));
+                len[pr] = _qom_predict_ops(trial+pr*5*sizex, res, sizex, trialindex[pr]);
+                if(len[pr]<len[best])
+                    best = pr;
+            }
+            bytes[p++] = best;
+            memcpy(bytes+p, trial+best*5*sizex, len[best]);
+            p += len[best];
+            memcpy(index, trialindex[best], sizeof(index));
+        } else {
+            int bestcost = 0;
+            for(int pr=0; pr<_QOM_NPRED; pr++) {
+                _qom_predict_row(res+pr*n, cur, prev, n, pr);
+                int cost = _qom_predict_cost(res+pr*n, n);
+                if((pr == 0) || (cost<bestcost)) {
+                    best = pr;
+                    bestcost = cost;
+                }
+            }
+            bytes[p++] = best;
+            p += _qom_predict_ops(bytes+p, res+best*n, sizex, index);
+        }
+        unsigned char *t = prev;
+        prev = cur;
+        cur = t;
+    }
+    memset(bytes+p, 0, _QOM_PRED_PAD);
+    free(trial);
+    free(res);
+    free(prev);
+    free(cur);
+    *out_len = p;
+    return bytes;
+}
+
+/* bytes must be followed by _QOM_PRED_PAD readable bytes, as they are from _qom_predict_encode */
+
+static unsigned int *_qom_predict_decode(const unsigned char *bytes, int size, int *sizex, int *sizey)
+{
+    if(size<8)
+        return 0;
+    int p = 0;
+    *sizex = qom_read_32(bytes, &p);
+    *sizey = qom_read_32(bytes, &p);
+    if((*sizex<=0) || (*sizey<=0) || ((unsigned int)*sizex>QOI_PIXELS_MAX/(unsigned int)*sizey))
+        return 0;
+    int n = 4 * *sizex;
+    unsigned int *pixels = (unsigned int *)qom_alloc(*sizex * *sizey * sizeof(unsigned int));
+    unsigned char *cur = (unsigned char *)malloc(n);
+    unsigned char *prev = (unsigned char *)calloc(n, 1);
+    unsigned char *res = (unsigned char *)malloc(n);
+    qoi_rgba_t index[64];
+    memset(index, 0, sizeof(index));
+    for(int y=0; y<*sizey; y++) {
+        int pred = (p<size) ? bytes[p++] : _QOM_NPRED;
+        if(pred>=_QOM_NPRED)
+            p = -1;
+        else
+            p = _qom_predict_unops(res, *sizex, bytes, p, size, index);
+        if(p<0) {
+            qom_free(pixels);
+            pixels = 0;
+            break;
+        }
+        _qom_unpredict_row(cur, res, prev, n, pred);
+        _qom_rgb_row(pixels+y * *sizex, cur, *sizex);
+        unsigned char *t = prev;
+        prev = cur;
+        cur = t;
+    }
+    free(res);
+    free(prev);
+    free(cur);
+    return pixels;
+}
+
+static int _qom_writeframe_PREDICT(qom *qm, gfx_canvas *c)
+{
+    int size;
+    unsigned char *bytes = _qom_predict_encode(c->data, c->sizex, c->sizey, qm->effort, &size);
+    int bytes_write = _qom_write(qm, bytes, size);
+    if(bytes_write != size) {
+        fprintf(stderr, "qoiwriteframe error\n");
+        exit(1);
+    }
+    free(bytes);
+    return size;
+}
+
+static gfx_canvas *_qom_readframe_PREDICT(qom *qm, int size)
+{
+    unsigned char *data = (unsigned char *)qom_alloc(size+_QOM_PRED_PAD);
+    int bytes_read = _qom_read(qm, data, size);
+    memset(data+bytes_read, 0, _QOM_PRED_PAD);
+    int sizex, sizey;
+    unsigned int *pixels = _qom_predict_decode(data, bytes_read, &sizex, &sizey);
+    qom_free(data);
+    if(!pixels) {
+        fprintf(stderr, "qom_readframe_PREDICT: decode error\n");
+        exit(1);
+    }
+    return _qom_poolcanvas(sizex, sizey, pixels);
+}
+
+/* 
+ * Progressive coding.  The frame is split into the 7 passes of Adam7, as 
+ * in interlaced PNG, and each pass is a QOI image of its own.  The payload 
+ * is
+ *
+ *     sizex sizey npasses passsize[npasses] pass1 pass2 ...
+ *
+ * with 4 byte ints, so the first passes can be read without the rest.  
+ * Pass 1 has one pixel in 64, and each pass halves the blocks the pixels 
+ * so far stand for.  Empty passes of small frames have size 0.
+ */
+#define QOM_NPASSES             (7)
+#define _QOM_PASSHEAD           ((3+QOM_NPASSES)*4)
+
+static const int _qom_adam7[QOM_NPASSES][4] = {         /* x0, y0, dx, dy */
+    { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, 
+    { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+};
+
+static const int _qom_adam7block[QOM_NPASSES][2] = {    /* block each pixel stands for after the pass */
+    { 8, 8 }, { 4, 8 }, { 4, 4 }, { 2, 4 }, { 2, 2 }, { 1, 2 }, { 1, 1 }
+};
+
+static void _qom_adam7_size(int pass, int sizex, int sizey, int *psizex, int *psizey)
+{
+    const int *a = _qom_adam7[pass];
+    *psizex = (sizex>a[0]) ? (sizex-a[0]+a[2]-1)/a[2] : 0;
+    *psizey = (sizey>a[1]) ? (sizey-a[1]+a[3]-1)/a[3] : 0;
+}
+
+static unsigned char *_qom_adam7_encode(const unsigned int *data, int sizex, int sizey, int *out_len)
+{
+    int format = _qom_isopaque(data, sizex*sizey) ? qomFORMAT_RGBX : qomFORMAT_RGBA;
+    unsigned char *passes[QOM_NPASSES];
+    int sizes[QOM_NPASSES];
+    int total = _QOM_PASSHEAD;
+    unsigned int *pixels = (unsigned int *)malloc(((sizex+1)/2)*sizey*sizeof(unsigned int));
+    for(int pass=0; pass<QOM_NPASSES; pass++) {
+        const int *a = _qom_adam7[pass];
+        int psizex, psizey;
+        _qom_adam7_size(pass, sizex, sizey, &psizex, &psizey);
+        passes[pass] = 0;
+        sizes[pass] = 0;
+        if((psizex == 0) || (psizey == 0))
+            continue;
+        unsigned int *dst = pixels;
+        for(int y=a[1]; y<sizey; y+=a[3]) {
+            const unsigned int *src = data+y*sizex;
+            for(int x=a[0]; x<sizex; x+=a[2])
+                *dst++ = src[x];
+        }
+        qom_frameside side;
+        passes[pass] = _qom_qoi_encode(pixels, psizex, psizey, format, qomRESTART_NONE, 1, &side, sizes+pass);
+        total += sizes[pass];
+    }
+    free(pixels);
+    unsigned char *bytes = (unsigned char *)malloc(total);
+    int p = 0;
+    qom_write_32(bytes, &p, sizex);
+    qom_write_32(bytes, &p, sizey);
+    qom_write_32(bytes, &p, QOM_NPASSES);
+    for(int pass=0; pass<QOM_NPASSES; pass++)
+        qom_write_32(bytes, &p, sizes[pass]);
+    for(int pass=0; pass<QOM_NPASSES; pass++) {
+        if(!passes[pass])                /* empty in frames under 8x8 */
+            continue;
+        memcpy(bytes+p, passes[pass], sizes[pass]);
+        p += sizes[pass];
+        free(passes[pass]);
+    }
+    *out_len = p;
+    return bytes;
+}
+
+/* read the head of a progressive payload, returns the bytes needed for the first npasses passes or 0 */
+
+static int _qom_adam7_head(const unsigned char *bytes, int size, int npasses, int *sizex, int *sizey, int *sizes)
+{
+    if(size<_QOM_PASSHEAD)
+        return 0;
+    int p = 0;
+    *sizex = qom_read_32(bytes, &p);
+    *sizey = qom_read_32(bytes, &p);
+    if((*sizex<=0) || (*sizey<=0) || (qom_read_32(bytes, &p) != QOM_NPASSES))
+        return 0;
+    int need = _QOM_PASSHEAD;
+    for(int pass=0; pass<QOM_NPASSES; pass++) {
+        sizes[pass] = qom_read_32(bytes, &p);
+        if(sizes[pass]<0)
+            return 0;
+        if(pass<npasses)
+            need += sizes[pass];
+    }
+    return need;
+}
+
+/* 
+ * Decode the first npasses passes, bytes needs only that much of the 
+ * payload.  Pixels not coded yet are filled from the pixel coded for 
+ * their block, so the frame looks like a blocky version of itself.
+ */
+static unsigned int *_qom_adam7_decode(const unsigned char *bytes, int size, int npasses, int *sizex, int *sizey)
+{
+    int sizes[QOM_NPASSES];
+    if((npasses<1) || (npasses>QOM_NPASSES))
+        npasses = QOM_NPASSES;
+    int need = _qom_adam7_head(bytes, size, npasses, sizex, sizey, sizes);
+    if((need == 0) || (need>size))
+        return 0;
+    int w = *sizex;
+    int h = *sizey;
+    unsigned int *data = (unsigned int *)qom_alloc(w*h*sizeof(unsigned int));
+    int p = _QOM_PASSHEAD;
+    for(int pass=0; pass<npasses; pass++) {
+        const int *a = _qom_adam7[pass];
+        int psizex, psizey, qsizex, qsizey;
+        _qom_adam7_size(pass, w, h, &psizex, &psizey);
+        if(sizes[pass] == 0) {
+            if((psizex == 0) || (psizey == 0))
+                continue;
+            qom_free(data);
+            return 0;
+        }
+        unsigned int *pixels = _qom_qoi_decode(bytes+p, sizes[pass], 0, 1, &qsizex, &qsizey);
+        p += sizes[pass];
+        if(!pixels || (qsizex != psizex) || (qsizey != psizey)) {
+            qom_free(pixels);
+            qom_free(data);
+            return 0;
+        }
+        const unsigned int *src = pixels;
+        for(int y=a[1]; y<h; y+=a[3]) {
+            unsigned int *dst = data+y*w;
+            for(int x=a[0]; x<w; x+=a[2])
+                dst[x] = *src++;
+        }
+        qom_free(pixels);
+    }
+    if(npasses<QOM_NPASSES) {
+        int bx = _qom_adam7block[npasses-1][0];
+        int by = _qom_adam7block[npasses-1][1];
+        for(int y=0; y<h; y+=by) {
+            unsigned int *row = data+y*w;
+            for(int x=0; x<w; x+=bx) {
+                for(int k=1; (k<bx) && (x+k<w); k++)
+                    row[x+k] = row[x];
+            }
+            for(int k=1; (k<by) && (y+k<h); k++)
+                memcpy(row+k*w, row, w*sizeof(unsigned int));
+        }
+    }
+    return data;
+}
+
+static int _qom_writeframe_PROGRESSIVE(qom *qm, gfx_canvas *c)
+{
+    int size;
+    unsigned char *bytes = _qom_adam7_encode(c->data, c->sizex, c->sizey, &size);
+    int bytes_write = _qom_write(qm, bytes, size);
+    if(bytes_write != size) {
+        fprintf(stderr, "qoiwriteframe error\n");
+        exit(1);
+    }
+    free(bytes);
+    return size;
+}
+
+/* reads only the bytes the first npasses passes need */
+
+static gfx_canvas *_qom_readframe_PROGRESSIVE(qom *qm, int size, int npasses)
+{
+    unsigned char head[_QOM_PASSHEAD];
+    int sizex, sizey;
+    int sizes[QOM_NPASSES];
+    int bytes_read = _qom_read(qm, head, _QOM_PASSHEAD);
+    int need = _qom_adam7_head(head, bytes_read, npasses, &sizex, &sizey, sizes);
+    unsigned int *pixels = 0;
+    if((need>0) && (need<=size)) {
+        unsigned char *data = (unsigned char *)qom_alloc(need);
+        memcpy(data, head, _QOM_PASSHEAD);
+        bytes_read = _QOM_PASSHEAD + _qom_read(qm, data+_QOM_PASSHEAD, need-_QOM_PASSHEAD);
+        pixels = _qom_adam7_decode(data, bytes_read, npasses, &sizex, &sizey);
+        qom_free(data);
+    }
+    if(!pixels) {
+        fprintf(stderr, "qom_readframe_PROGRESSIVE: decode error\n");
+        exit(1);
+    }
+    return _qom_poolcanvas(sizex, sizey, pixels);
+}
+
+/* 
+ * 16 bit frames.  Pixels are reduced to RGB565 or RGBA4444 as they are 
+ * coded, dithered if qom_setdither is on, and the 16 bit values are coded 
+ * with ops like QOI's:
+ *
+ *     00iiiiii                 INDEX of a recent pixel
+ *     01rrggbb                 DIFF, each field changes by -2..1
+ *     10-rrrrg ggggbbbb        DELTA, RGB565: r and b by -8..7, g by -16..15
+ *     10--rrrr ggggbbbb        DELTA, RGBA4444: r, g and b by -8..7
+ *     11nnnnnn                 RUN of n+1, to 62
+ *     11111110 hi lo           the pixel
+ *
+ * Fields wrap, and alpha only changes with a whole pixel.  The payload is 
+ * sizex sizey and the ops.  The decoder writes 16 bit pixels, so 
+ * qom_getframe16 can decode straight into a framebuffer.
+ */
+#define _QOM_OP16_DIFF          (0x40)
+#define _QOM_OP16_DELTA         (0x80)
+#define _QOM_OP16_RUN           (0xc0)
+#define _QOM_OP16_PIXEL         (0xfe)
+
+#define _QOM_HASH16(v)          (((v)*2654435761u)>>26)
+
+static const _qom_layout16 *_qom_encodinglayout16(int encoding)
+{
+    switch(encoding) {
+        case qomENCODING_RGB565:
+            return &_qom_rgb565;
+        case qomENCODING_RGBA4444:
+            return &_qom_rgba4444;
+    }
+    return 0;
+}
+
+/* the change of field c from a to b, -2^(bits-1)..2^(bits-1)-1 */
+
+static int _qom_field16_delta(const _qom_layout16 *l, int c, int a, int b)
+{
+    int m = (1<<l->bits[c])-1;
+    int d = ((b>>l->shift[c]) - (a>>l->shift[c])) & m;
+    return (d > m/2) ? d-m-1 : d;
+}
+
+/* r, g and b changes packed in the fields of a pixel, alpha 0 */
+
+static inline int _qom_field16_pack(const _qom_layout16 *l, int r, int g, int b)
+{
+    return (r & ((1<<l->bits[0])-1))<<l->shift[0] | (g & ((1<<l->bits[1])-1))<<l->shift[1] | (b & ((1<<l->bits[2])-1))<<l->shift[2];
+}
+
+static unsigned char *_qom_depth16_encode(const unsigned int *data, int sizex, int sizey, const _qom_layout16 *l, int dither, int *out_len)
+{
+    int amask = ((1<<l->bits[3])-1)<<l->shift[3];
+    int dr = 1<<(l->dbits[0]-1);
+    int dg = 1<<(l->dbits[1]-1);
+    int db = 1<<(l->dbits[2]-1);
+    unsigned char *bytes = (unsigned char *)malloc(8 + 3*sizex*sizey);
+    int p = 0;
+    qom_write_32(bytes, &p, sizex);
+    qom_write_32(bytes, &p, sizey);
+    _qom_quant16 *qt = _qom_quant16_new(l, dither);
+    unsigned short *row = (unsigned short *)malloc(sizex*sizeof(unsigned short));
+    unsigned short index[64];
+    memset(index, 0, sizeof(index));
+    int prev = amask;
+    int run = 0;
+    for(int y=0; y<sizey; y++) {
+        _qom_quant16_row(qt, row, data+y*sizex, sizex, y);
+        for(int x=0; x<sizex; x++) {
+            int v = row[x];
+            if(v == prev) {
+                if(++run == 62) {
+                    bytes[p++] = _QOM_OP16_RUN | (run-1);
+                    run = 0;
+                }
+                continue;
+            }
+            if(run) {
+                bytes[p++] = _QOM_OP16_RUN | (run-1);
+                run = 0;
+            }
+            int h = _QOM_HASH16(v);
+            if(index[h] == v) {
+                bytes[p++] = h;
+            } else {
+                index[h] = v;
+                int r = _qom_field16_delta(l, 0, prev, v);
+                int g = _qom_field16_delta(l, 1, prev, v);
+                int b = _qom_field16_delta(l, 2, prev, v);
+                if((v^prev) & amask) {
+                    bytes[p++] = _QOM_OP16_PIXEL;
+                    bytes[p++] = v>>8;
+                    bytes[p++] = v;
+                } else if((r>=-2) && (r<=1) && (g>=-2) && (g<=1) && (b>=-2) && (b<=1)) {
+                    bytes[p++] = _QOM_OP16_DIFF | (r+2)<<4 | (g+2)<<2 | (b+2);
+                } else if((r>=-dr) && (r<dr) && (g>=-dg) && (g<dg) && (b>=-db) && (b<db)) {
+                    int d = (r+dr)<<(l->dbits[1]+l->dbits[2]) | (g+dg)<<l->dbits[2] | (b+db);
+                    bytes[p++] = _QOM_OP16_DELTA | d>>8;
+                    bytes[p++] = d;
+                } else {
+                    bytes[p++] = _QOM_OP16_PIXEL;
+                    bytes[p++] = v>>8;
+                    bytes[p++] = v;
+                }
+            }
+            prev = v;
+        }
+    }
+    if(run)
+        bytes[p++] = _QOM_OP16_RUN | (run-1);
+    free(row);
+    free(qt);
+    *out_len = p;
+    return bytes;
+}
+
+static int _qom_depth16_header(const unsigned char *bytes, int size, int *sizex, int *sizey)
+{
+    if(size<8)
+        return 0;
+    int p = 0;
+    *sizex = qom_read_32(bytes, &p);
+    *sizey = qom_read_32(bytes, &p);
+    return (*sizex>0) && (*sizey>0);
+}
+
+/* 
+ * Decodes into sizey rows of stride pixels, returns 0 if the payload is 
+ * bad.  This is inlined for each layout so the fields are constants.  
+ * Changes are packed into a pixel and added to all three fields at once, 
+ * with the top bit of each field added apart so nothing carries out.
+ */
+static inline int _qom_depth16_decodelayout(const unsigned char *bytes, int size, const _qom_layout16 *l, unsigned short *pixels, int stride)
+{
+    int sizex, sizey;
+    if(!_qom_depth16_header(bytes, size, &sizex, &sizey))
+        return 0;
+    int top = 0;
+    for(int c=0; c<3; c++)
+        top |= 1<<(l->shift[c]+l->bits[c]-1);
+    int amask = ((1<<l->bits[3])-1)<<l->shift[3];
+    int gb = l->dbits[1]+l->dbits[2];
+    unsigned short diff[64];
+    for(int op=0; op<64; op++)
+        diff[op] = _qom_field16_pack(l, ((op>>4)&3)-2, ((op>>2)&3)-2, (op&3)-2);
+    unsigned short index[64];
+    memset(index, 0, sizeof(index));
+    int px = amask;
+    int run = 0;
+    int p = 8;
+    for(int y=0; y<sizey; y++) {
+        unsigned short *row = pixels+y*stride;
+        int x = 0;
+        while(x<sizex) {
+            if(run>0) {
+                int n = (run<sizex-x) ? run : sizex-x;
+                for(int k=0; k<n; k++)
+                    row[x+k] = px;
+                x += n;
+                run -= n;
+                continue;
+            }
+            if(p>=size)
+                return 0;
+            int op = bytes[p++];
+            int d;
+            if(op<_QOM_OP16_DIFF) {
+                px = index[op];
+                row[x++] = px;
+                continue;
+            } else if(op<_QOM_OP16_DELTA) {
+                d = diff[op-_QOM_OP16_DIFF];
+            } else if(op<_QOM_OP16_RUN) {
+                if(p>=size)
+                    return 0;
+                int v = (op&0x3f)<<8 | bytes[p++];
+                d = _qom_field16_pack(l, (v>>gb) - (1<<(l->dbits[0]-1)), ((v>>l->dbits[2]) & ((1<<l->dbits[1])-1)) - (1<<(l->dbits[1]-1)), 
+                                            (v & ((1<<l->dbits[2])-1)) - (1<<(l->dbits[2]-1)));
+            } else if(op<_QOM_OP16_PIXEL) {
+                run = op-_QOM_OP16_RUN+1;
+                continue;
+            } else if(op == _QOM_OP16_PIXEL) {
+                if(p+2>size)
+                    return 0;
+                px = bytes[p]<<8 | bytes[p+1];
+                p += 2;
+                index[_QOM_HASH16(px)] = px;
+                row[x++] = px;
+                continue;
+            } else {
+                return 0;
+            }
+            px = (((px & ~top) + (d & ~top)) ^ ((px ^ d) & top)) & 0xffff;
+            index[_QOM_HASH16(px)] = px;
+            row[x++] = px;
+        }
+    }
+    return 1;
+}
+
+static int _qom_depth16_decodeinto(const unsigned char *bytes, int size, const _qom_layout16 *l, unsigned short *pixels, int stride)
+{
+    if(l == &_qom_rgb565)
+        return _qom_depth16_decodelayout(bytes, size, &_qom_rgb565, pixels, stride);
+    return _qom_depth16_decodelayout(bytes, size, &_qom_rgba4444, pixels, stride);
+}
+
+static int _qom_writeframe_DEPTH16(qom *qm, gfx_canvas *c, const _qom_layout16 *l)
+{
+    int size;
+    unsigned char *bytes = _qom_depth16_encode(c->data, c->sizex, c->sizey, l, qm->dither, &size);
+    int bytes_write = _qom_write(qm, bytes, size);
+    if(bytes_write != size) {
+        fprintf(stderr, "qoiwriteframe error\n");
+        exit(1);
+    }
+    free(bytes);
+    return size;
+}
+
+static gfx_canvas *_qom_readframe_DEPTH16(qom *qm, int size, const _qom_layout16 *l)
+{
+    unsigned char *data = (unsigned char *)qom_alloc(size);
+    int bytes_read = _qom_read(qm, data, size);
+    int sizex, sizey;
+    unsigned short *pixels16 = 0;
+    if(_qom_depth16_header(data, bytes_read, &sizex, &sizey)) {
+        pixels16 = (unsigned short *)qom_alloc(sizex*sizey*sizeof(unsigned short));
+        if(!_qom_depth16_decodeinto(data, bytes_read, l, pixels16, sizex)) {
+            qom_free(pixels16);
+            pixels16 = 0;
+        }
+    }
+    qom_free(data);
+    if(!pixels16) {
+        fprintf(stderr, "qom_readframe_DEPTH16: decode error\n");
+        exit(1);
+    }
+    gfx_canvas *c = gfx_canvas_new(sizex, sizey);
+    _qom_expand16(l, c->data, pixels16, sizex*sizey);
+    qom_free(pixels16);
+    return c;
+}
+
+/* 
+ * YCbCr 4:2:0 frames, for camera pictures.  Pixels are converted to full 
+ * range BT.601 YCbCr, as in JPEG, and Cb and Cr are averaged over each 
+ * 2x2 block, so the planes hold 1.5 bytes per pixel.  Each plane is 
+ * predicted with the median predictor of LOCO-I and the residuals are 
+ * coded with byte ops:
+ *
+ *     00nnnnnn                 run of n+1 zeros
+ *     01aaabbb                 two residuals of -4..3
+ *     10vvvvvv                 a residual of -32..31
+ *     11kkkkkk                 run of (k+1)*64 zeros, k to 62
+ *     11111111 v               any residual
+ *
+ * The payload is sizex sizey, then the size and ops of the Y, Cb and Cr 
+ * planes.  Alpha is not kept.  qom_getframe_planes gives the planes 
+ * themselves.  The loops have no branches on pixel values, so the 
+ * compiler can vectorize them.
+ */
+#define _QOM_PLANE_RUN          (0x00)
+#define _QOM_PLANE_PAIR         (0x40)
+#define _QOM_PLANE_ONE          (0x80)
+#define _QOM_PLANE_LONGRUN      (0xc0)
+#define _QOM_PLANE_LITERAL      (0xff)
+
+static void _qom_yuv420_planesize(int sizex, int sizey, int *cx, int *cy)
+{
+    *cx = (sizex+1)/2;
+    *cy = (sizey+1)/2;
+}
+
+/* planes holds Y then Cb then Cr, like I420 */
+
+static void _qom_yuv420_fromrgba(const unsigned int *data, int sizex, int sizey, unsigned char *planes)
+{
+    int cx, cy;
+    _qom_yuv420_planesize(sizex, sizey, &cx, &cy);
+    unsigned char *cb = planes+sizex*sizey;
+    unsigned char *cr = cb+cx*cy;
+    for(int y=0; y<sizey; y++) {
+        const unsigned char *s = (const unsigned char *)(data+y*sizex);
+        unsigned char *dst = planes+y*sizex;
+        for(int x=0; x<sizex; x++)
+            dst[x] = (77*s[4*x] + 150*s[4*x+1] + 29*s[4*x+2] + 128)>>8;
+    }
+    for(int y=0; y<cy; y++) {
+        const unsigned char *s0 = (const unsigned char *)(data+2*y*sizex);
+        const unsigned char *s1 = (2*y+1<sizey) ? s0+4*sizex : s0;
+        for(int x=0; x<cx; x++) {
+            int x0 = 8*x;
+            int x1 = (2*x+1<sizex) ? x0+4 : x0;
+            int r = s0[x0] + s0[x1] + s1[x0] + s1[x1];
+            int g = s0[x0+1] + s0[x1+1] + s1[x0+1] + s1[x1+1];
+            int b = s0[x0+2] + s0[x1+2] + s1[x0+2] + s1[x1+2];
+            cb[y*cx+x] = (-43*r - 84*g + 127*b + 512*256 + 512)>>10;
+            cr[y*cx+x] = (127*r - 106*g - 21*b + 512*256 + 512)>>10;
+        }
+    }
+}
+
+static inline int _qom_clampbyte(int v)
+{
+    return (v<0) ? 0 : ((v>255) ? 255 : v);
+}
+
+/* upsamples the chroma and converts back in one pass, row by row */
+
+static void _qom_yuv420_torgba(const unsigned char *planes, int sizex, int sizey, unsigned int *data)
+{
+    int cx, cy;
+    _qom_yuv420_planesize(sizex, sizey, &cx, &cy);
+    const unsigned char *cb = planes+sizex*sizey;
+    const unsigned char *cr = cb+cx*cy;
+    int *off = (int *)malloc(3*cx*sizeof(int));
+    for(int y=0; y<sizey; y++) {
+        if((y&1) == 0) {
+            const unsigned char *b = cb+(y/2)*cx;
+            const unsigned char *r = cr+(y/2)*cx;
+            for(int x=0; x<cx; x++) {
+                off[3*x] = 362*(r[x]-128) + 128;
+                off[3*x+1] = -89*(b[x]-128) - 184*(r[x]-128) + 128;
+                off[3*x+2] = 457*(b[x]-128) + 128;
+            }
+        }
+        const unsigned char *Y = planes+y*sizex;
+        unsigned char *d = (unsigned char *)(data+y*sizex);
+        for(int x=0; x<sizex; x++) {
+            int l = Y[x]<<8;
+            const int *o = off+3*(x>>1);
+            d[4*x] = _qom_clampbyte((l+o[0])>>8);
+            d[4*x+1] = _qom_clampbyte((l+o[1])>>8);
+            d[4*x+2] = _qom_clampbyte((l+o[2])>>8);
+            d[4*x+3] = 255;
+        }
+    }
+    free(off);
+}
+
+static inline int _qom_med(int a, int b, int c)
+{
+    int mn = (a<b) ? a : b;
+    int mx = (a<b) ? b : a;
+    return (c>=mx) ? mn : ((c<=mn) ? mx : a+b-c);
+}
+
+/* residuals of a w by h plane, mod 256 */
+
+static void _qom_plane_predict(unsigned char *res, const unsigned char *plane, int w, int h)
+{
+    res[0] = plane[0];
+    for(int x=1; x<w; x++)
+        res[x] = plane[x]-plane[x-1];
+    for(int y=1; y<h; y++) {
+        const unsigned char *up = plane+(y-1)*w;
+        const unsigned char *cur = plane+y*w;
+        unsigned char *r = res+y*w;
+        r[0] = cur[0]-up[0];
+        for(int x=1; x<w; x++)
+            r[x] = cur[x]-_qom_med(cur[x-1], up[x], up[x-1]);
+    }
+}
+
+static void _qom_plane_unpredict(unsigned char *plane, int w, int h)
+{
+    for(int x=1; x<w; x++)
+        plane[x] += plane[x-1];
+    for(int y=1; y<h; y++) {
+        const unsigned char *up = plane+(y-1)*w;
+        unsigned char *cur = plane+y*w;
+        cur[0] += up[0];
+        for(int x=1; x<w; x++)
+            cur[x] += _qom_med(cur[x-1], up[x], up[x-1]);
+    }
+}
+
+/* codes n residuals into bytes, which needs 2*n bytes at most */
+
+static int _qom_plane_ops(const unsigned char *res, int n, unsigned char *bytes)
+{
+    int p = 0;
+    int i = 0;
+    while(i<n) {
+        if(res[i] == 0) {
+            int run = 1;
+            while((i+run<n) && (res[i+run] == 0))
+                run++;
+            i += run;
+            while(run>=64) {
+                int k = (run/64<63) ? run/64 : 63;
+                bytes[p++] = _QOM_PLANE_LONGRUN | (k-1);
+                run -= 64*k;
+            }
+            if(run)
+                bytes[p++] = _QOM_PLANE_RUN | (run-1);
+            continue;
+        }
+        int a = (signed char)res[i];
+        if(i+1<n) {
+            int b = (signed char)res[i+1];
+            if((a>=-4) && (a<=3) && (b>=-4) && (b<=3)) {
+                bytes[p++] = _QOM_PLANE_PAIR | (a+4)<<3 | (b+4);
+                i += 2;
+                continue;
+            }
+        }
+        if((a>=-32) && (a<=31)) {
+            bytes[p++] = _QOM_PLANE_ONE | (a+32);
+        } else {
+            bytes[p++] = _QOM_PLANE_LITERAL;
+            bytes[p++] = a;
+        }
+        i++;
+    }
+    return p;
+}
+
+/* returns 0 if the ops don't give exactly n residuals */
+
+static int _qom_plane_unops(const unsigned char *bytes, int size, unsigned char *res, int n)
+{
+    int p = 0;
+    int i = 0;
+    while((i<n) && (p<size)) {
+        int op = bytes[p++];
+        if(op<_QOM_PLANE_PAIR) {
+            int run = op-_QOM_PLANE_RUN+1;
+            if(i+run>n)
+                return 0;
+            memset(res+i, 0, run);
+            i += run;
+        } else if(op<_QOM_PLANE_ONE) {
+            if(i+2>n)
+                return 0;
+            res[i++] = ((op>>3)&7)-4;
+            res[i++] = (op&7)-4;
+        } else if(op<_QOM_PLANE_LONGRUN) {
+            res[i++] = (op&0x3f)-32;
+        } else if(op<_QOM_PLANE_LITERAL) {
+            int run = 64*(op-_QOM_PLANE_LONGRUN+1);
+            if(i+run>n)
+                return 0;
+            memset(res+i, 0, run);
+            i += run;
+        } else {
+            if(p>=size)
+                return 0;
+            res[i++] = bytes[p++];
+        }
+    }
+    return (i == n) && (p == size);
+}
+
+static unsigned char *_qom_yuv420_encode(const unsigned int *data, int sizex, int sizey, int *out_len)
+{
+    int cx, cy;
+    _qom_yuv420_planesize(sizex, sizey, &cx, &cy);
+    int n = sizex*sizey + 2*cx*cy;
+    unsigned char *planes = (unsigned char *)malloc(n);
+    unsigned char *res = (unsigned char *)malloc(n);
+    _qom_yuv420_fromrgba(data, sizex, sizey, planes);
+    _qom_plane_predict(res, planes, sizex, sizey);
+    _qom_plane_predict(res+sizex*sizey, planes+sizex*sizey, cx, cy);
+    _qom_plane_predict(res+sizex*sizey+cx*cy, planes+sizex*sizey+cx*cy, cx, cy);
+    unsigned char *bytes = (unsigned char *)malloc(20+2*n);
+    int p = 0;
+    qom_write_32(bytes, &p, sizex);
+    qom_write_32(bytes, &p, sizey);
+    int np[3] = { sizex*sizey, cx*cy, cx*cy };
+    const unsigned char *r = res;
+    for(int k=0; k<3; k++) {
+        int len = _qom_plane_ops(r, np[k], bytes+p+4);
+        qom_write_32(bytes, &p, len);
+        p += len;
+        r += np[k];
+    }
+    free(res);
+    free(planes);
+    *out_len = p;
+    return bytes;
+}
+
+/* returns the Y, Cb and Cr planes, or 0 if the payload is bad */
+
+static unsigned char *_qom_yuv420_decode(const unsigned char *bytes, int size, int *sizex, int *sizey)
+{
+    if(size<8)
+        return 0;
+    int p = 0;
+    *sizex = qom_read_32(bytes, &p);
+    *sizey = qom_read_32(bytes, &p);
+    if((*sizex<=0) || (*sizey<=0))
+        return 0;
+    int cx, cy;
+    _qom_yuv420_planesize(*sizex, *sizey, &cx, &cy);
+    int np[3] = { *sizex * *sizey, cx*cy, cx*cy };
+    int w[3] = { *sizex, cx, cx };
+    int h[3] = { *sizey, cy, cy };
+    unsigned char *planes = (unsigned char *)malloc(np[0]+np[1]+np[2]);
+    unsigned char *plane = planes;
+    for(int k=0; k<3; k++) {
+        int len = (p+4<=size) ? (int)qom_read_32(bytes, &p) : -1;
+        if((len<0) || (len>size-p) || !_qom_plane_unops(bytes+p, len, plane, np[k])) {
+            free(planes);
+            return 0;
+        }
+        _qom_plane_unpredict(plane, w[k], h[k]);
+        p += len;
+        plane += np[k];
+    }
+    return planes;
+}
+
+static int _qom_writeframe_YUV420(qom *qm, gfx_canvas *c)
+{
+    int size;
+    unsigned char *bytes = _qom_yuv420_encode(c->data, c->sizex, c->sizey, &size);
+    int bytes_write = _qom_write(qm, bytes, size);
+    if(bytes_write != size) {
+        fprintf(stderr, "qoiwriteframe error\n");
+        exit(1);
+    }
+    free(bytes);
+    return size;
+}
+
+static unsigned char *_qom_readframe_planes(qom *qm, int size, int *sizex, int *sizey)
+{
+    unsigned char *data = (unsigned char *)qom_alloc(size);
+    int bytes_read = _qom_read(qm, data, size);
+    unsigned char *planes = _qom_yuv420_decode(data, bytes_read, sizex, sizey);
+    qom_free(data);
+    if(!planes) {
+        fprintf(stderr, "qom_readframe_YUV420: decode error\n");
+        exit(1);
+    }
+    return planes;
+}
+
+static gfx_canvas *_qom_readframe_YUV420(qom *qm, int size)
+{
+    int sizex, sizey;
+    unsigned char *planes = _qom_readframe_planes(qm, size, &sizex, &sizey);
+    gfx_canvas *c = gfx_canvas_new(sizex, sizey);
+    _qom_yuv420_torgba(planes, sizex, sizey, c->data);
+    free(planes);
+    return c;
+}
+
+/* 
+ * Incremental QOI decoding.  Encoded bytes are pushed in pieces of any 
+ * size and each row is passed to func as soon as it is complete, so only 
+ * one row of pixels is ever held.
+ */
+qom_rowdecoder *qom_rowdecoder_new(qom_rowfunc func, void *arg)
+{
+    qom_rowdecoder *rd = (qom_rowdecoder *)malloc(sizeof(qom_rowdecoder));
+    qoi_rgba_t px;
+    px.rgba.r = 0;
+    px.rgba.g = 0;
+    px.rgba.b = 0;
+    px.rgba.a = 255;
+    rd->sizex = 0;
+    rd->sizey = 0;
+    rd->x = 0;
+    rd->y = 0;
+    rd->run = 0;
+    rd->px = px.v;
+    memset(rd->index, 0, sizeof(rd->index));
+    rd->ncarry = 0;
+    rd->row = 0;
+    rd->func = func;
+    rd->arg = arg;
+    rd->error = 0;
+    return rd;
+}
+
+static int _qom_rowdecoder_header(qom_rowdecoder *rd, const unsigned char *bytes)
+{
+    int p = 0;
+    unsigned int magic = qom_read_32(bytes, &p);
+    rd->sizex = qom_read_32(bytes, &p);
+    rd->sizey = qom_read_32(bytes, &p);
+    if((magic != QOI_MAGIC) || (rd->sizex<=0) || (rd->sizey<=0) || (rd->sizey >= (int)(QOI_PIXELS_MAX/rd->sizex))) {
+        fprintf(stderr, "qom_rowdecoder: bad QOI header\n");
+        rd->error = 1;
+        return 0;
+    }
+    rd->row = (unsigned int *)malloc(rd->sizex*sizeof(unsigned int));
+    return 1;
+}
+
+static int _qom_oplen(int b1)
+{
+    if(b1 == QOI_OP_RGB)
+        return 4;
+    if(b1 == QOI_OP_RGBA)
+        return 5;
+    if((b1 & QOI_MASK_2) == QOI_OP_LUMA)
+        return 2;
+    return 1;
+}
+
+/* apply one op to the decoder state */
+
+static void _qom_rowdecoder_op(qom_rowdecoder *rd, const unsigned char *bytes)
+{
+    qoi_rgba_t px;
+    px.v = rd->px;
+    int b1 = bytes[0];
+    if(b1 == QOI_OP_RGB) {
+        px.rgba.r = bytes[1];
+        px.rgba.g = bytes[2];
+        px.rgba.b = bytes[3];
+    } else if(b1 == QOI_OP_RGBA) {
+        px.rgba.r = bytes[1];
+        px.rgba.g = bytes[2];
+        px.rgba.b = bytes[3];
+        px.rgba.a = bytes[4];
+    } else if((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+        px.v = rd->index[b1];
+    } else if((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+        px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+        px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+        px.rgba.b += ( b1       & 0x03) - 2;
+    } else if((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+        int b2 = bytes[1];
+        int vg = (b1 & 0x3f) - 32;
+        px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+        px.rgba.g += vg;
+        px.rgba.b += vg - 8 +  (b2       & 0x0f);
+    } else if((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+        rd->run = (b1 & 0x3f);
+    }
+    rd->index[QOI_COLOR_HASH(px) % 64] = px.v;
+    rd->px = px.v;
+}
+
+static void _qom_rowdecoder_emit(qom_rowdecoder *rd)
+{
+    rd->row[rd->x++] = rd->px;
+    if(rd->x == rd->sizex) {
+        rd->func(rd->arg, rd->y, rd->row, rd->sizex);
+        rd->x = 0;
+        rd->y++;
+    }
+}
+
+/* returns 1 once the last row has been passed on, -1 on error and 0 if more data is needed */
+
+int qom_rowdecoder_push(qom_rowdecoder *rd, const void *data, int size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    int p = 0;
+
+    if(rd->error)
+        return -1;
+    if(!rd->row) {
+        while((rd->ncarry<QOI_HEADER_SIZE) && (p<size))
+            rd->carry[rd->ncarry++] = bytes[p++];
+        if(rd->ncarry<QOI_HEADER_SIZE)
+            return 0;
+        if(!_qom_rowdecoder_header(rd, rd->carry))
+            return -1;
+        rd->ncarry = 0;
+    }
+    while(rd->y<rd->sizey) {
+        if(rd->run>0) {
+            rd->run--;
+        } else if(rd->ncarry>0) {
+            int len = _qom_oplen(rd->carry[0]);
+            while((rd->ncarry<len) && (p<size))
+                rd->carry[rd->ncarry++] = bytes[p++];
+            if(rd->ncarry<len)
+                return 0;
+            _qom_rowdecoder_op(rd, rd->carry);
+            rd->ncarry = 0;
+        } else {
+            if(p>=size)
+                return 0;
+            int len = _qom_oplen(bytes[p]);
+            if(p+len>size) {
+                while(p<size)
+                    rd->carry[rd->ncarry++] = bytes[p++];
+                return 0;
+            }
+            _qom_rowdecoder_op(rd, bytes+p);
+            p += len;
+        }
+        _qom_rowdecoder_emit(rd);
+    }
+    return 1;
+}
+
+int qom_rowdecoder_done(qom_rowdecoder *rd)
+{
+    return (rd->row != 0) && (rd->y == rd->sizey);
+}
+
+void qom_rowdecoder_free(qom_rowdecoder *rd)
+{
+    if(!rd)
+        return;
+    free(rd->row);
+    free(rd);
+}
+
+static int _qom_readrows_QOI(qom *qm, int size, qom_rowfunc func, void *arg)
+{
+    qom_rowdecoder *rd = qom_rowdecoder_new(func, arg);
+    unsigned char *chunk = (unsigned char *)malloc(QOM_READ_CHUNK);
+    int ret = 0;
+    while((size>0) && (ret == 0)) {
+        int want = (size<QOM_READ_CHUNK) ? size : QOM_READ_CHUNK;
+        int bytes_read = _qom_read(qm, chunk, want);
+        if(bytes_read <= 0)
+            break;
+        ret = qom_rowdecoder_push(rd, chunk, bytes_read);
+        size -= bytes_read;
+    }
+    free(chunk);
+    if(ret != 1) {
+        fprintf(stderr, "qom_readrows_QOI: decode error\n");
+        qm->error = qomERROR_FORMAT;
+    }
+    qom_rowdecoder_free(rd);
+    return ret == 1;
+}
+
+
+static void _qom_addframeinfo(qom *qm, qom_frameinfo *fi, int pos)
+{
+    if(pos >= qm->framealloc) {
+        if(qm->framealloc == 0) {
+            qm->framealloc = 30;
+            qm->frames = (qom_frameinfo *)malloc(qm->framealloc*sizeof(qom_frameinfo));
+        } else {
+            qm->framealloc = ((3*qm->framealloc)/2) + 1;
+            qm->frames = (qom_frameinfo *)realloc(qm->frames, qm->framealloc*sizeof(qom_frameinfo));
+        }
+        qm->sides = (qom_frameside *)realloc(qm->sides, qm->framealloc*sizeof(qom_frameside));
+    }
+    qm->frames[pos] = *fi;
+}
+
+static void _qom_addframeside(qom *qm, qom_frameside *side, int pos)
+{
+    qm->sides[pos] = *side;
+}
+
+static qom_frameinfo *_qom_getframeinfo(qom *qm, int index)
+{
+    if((index<0) || (index>=qm->header.nframes)) {
+        fprintf(stderr, "_qom_ilistget: index out of range\n");
+        assert(0);
+    }
+    if(qm->segments && (qm->mode == qomMODE_R))
+        qm->segments->want = _qom_segmentof(qm->segments, index);
+    return qm->frames+index;
+}
+
+static void _qom_freesegments(qom_segments *ss)
+{
+    for(int i=0; i<ss->nsegs; i++) {
+        free(ss->segs[i].name);
+        free(ss->segs[i].path);
+        if(ss->segs[i].fd >= 0)
+            close(ss->segs[i].fd);
+    }
+    free(ss->segs);
+    free(ss->manifest);
+    free(ss);
+}
+
+static void _qom_free(qom *qm)
+{
+    if(!qm)
+        return;
+    if(qm->segments)
+        _qom_freesegments(qm->segments);
+    free(qm->batch);
+    free(qm->filename);
+    if(qm->fd >= 0)
+        close(qm->fd);
+    if(qm->frames)
+        free(qm->frames);
+    if(qm->sides) {
+        for(int i=0; i<qm->header.nframes; i++)
+            _qom_freeside(qm->sides+i);
+        free(qm->sides);
+    }
+    free(qm);
+}
+
+static void _qom_readheader(qom *qm) 
+{
+    qm->header.magic = _qom_readint(qm);    
+    qm->header.nframes = _qom_readint(qm);
+    qm->header.duration_lo = _qom_readint(qm);
+    qm->header.duration_hi = _qom_readint(qm);
+    qm->header.sizex = _qom_readint(qm);
+    qm->header.sizey = _qom_readint(qm);
+    qm->header.default_starttime_lo = _qom_readint(qm);    
+    qm->header.default_starttime_hi = _qom_readint(qm);    
+    qm->header.default_startdir = _qom_readint(qm);     
+    qm->header.default_leftbounce = _qom_readint(qm);   
+    qm->header.default_rightbounce = _qom_readint(qm);   
+}
+
+static void _qom_writeheader(qom *qm) 
+{
+    qm->header.magic = QOM_MAGIC;
+    unsigned char bytes[sizeof(qom_header)];
+    int p = 0;
+    qom_write_32(bytes, &p, qm->header.magic);
+    qom_write_32(bytes, &p, qm->header.nframes);
+    qom_write_32(bytes, &p, qm->header.duration_lo);
+    qom_write_32(bytes, &p, qm->header.duration_hi);
+    qom_write_32(bytes, &p, qm->header.sizex);
+    qom_write_32(bytes, &p, qm->header.sizey);
+    qom_write_32(bytes, &p, qm->header.default_starttime_lo);
+    qom_write_32(bytes, &p, qm->header.default_starttime_hi);
+    qom_write_32(bytes, &p, qm->header.default_startdir);
+    qom_write_32(bytes, &p, qm->header.default_leftbounce);
+    qom_write_32(bytes, &p, qm->header.default_rightbounce);
+    if(_qom_write(qm, bytes, p) != p) {
+        fprintf(stderr, "qom: _qom_writeheader error\n");
+        exit(1);
+    }
+}
+
+static void _qom_readframeinfo(qom *qm) 
+{
+    qm->frames = (qom_frameinfo *)malloc(qm->header.nframes*sizeof(qom_frameinfo));
+    qm->framealloc = qm->header.nframes;
+    int size = qm->header.nframes*sizeof(qom_frameinfo);
+    unsigned char *bytes = (unsigned char *)malloc(size);     /* in one read, for movies opened by the thousand */
+    if(_qom_read(qm, bytes, size) != size) {
+        fprintf(stderr, "qom: _qom_readframeinfo error\n");
+        exit(1);
+    }
+    qom_frameinfo *fi = qm->frames;
+    int p = 0;
+    for(int i=0; i<qm->header.nframes; i++) {
+        fi->time_lo = qom_read_32(bytes, &p);
+        fi->time_hi = qom_read_32(bytes, &p);
+        fi->encoding = qom_read_32(bytes, &p);
+        fi->sizex = qom_read_32(bytes, &p);
+        fi->sizey = qom_read_32(bytes, &p);
+        fi->offset = qom_read_32(bytes, &p);
+        fi->size = qom_read_32(bytes, &p);
+        fi->encoding_usec = qom_read_32(bytes, &p);
+        fi++;
+    }
+    free(bytes);
+}
+
+static void _qom_writeframeinfo(qom *qm) 
+{
+    int size = qm->header.nframes*sizeof(qom_frameinfo);
+    unsigned char *bytes = (unsigned char *)malloc(size+1);
+    qom_frameinfo *fi = qm->frames;
+    int p = 0;
+    for(int i=0; i<qm->header.nframes; i++) {
+        qom_write_32(bytes, &p, fi->time_lo);
+        qom_write_32(bytes, &p, fi->time_hi);
+        qom_write_32(bytes, &p, fi->encoding);
+        qom_write_32(bytes, &p, fi->sizex);
+        qom_write_32(bytes, &p, fi->sizey);
+        qom_write_32(bytes, &p, fi->offset);
+        qom_write_32(bytes, &p, fi->size);
+        qom_write_32(bytes, &p, fi->encoding_usec);
+        fi++;
+    }
+    if(_qom_write(qm, bytes, size) != size) {
+        fprintf(stderr, "qom: _qom_writeframeinfo error\n");
+        exit(1);
+    }
+    free(bytes);
+}
+
+static void _qom_readrestarts(qom *qm, qom_frameside *side, int size)
+{
+    int restartrows = _qom_readint(qm);
+    int nrestarts = _qom_readint(qm);
+    if((nrestarts<=0) || (size != (2+nrestarts*67)*4)) {
+        _qom_seek(qm, size-8, SEEK_CUR);
+        return;
+    }
+    _qom_freeside(side);
+    side->restartrows = restartrows;
+    side->nrestarts = nrestarts;
+    side->restarts = (qom_restart *)malloc(nrestarts*sizeof(qom_restart));
+    for(int i=0; i<nrestarts; i++) {
+        qom_restart *rs = side->restarts+i;
+        rs->offset = _qom_readint(qm);
+        rs->run = _qom_readint(qm);
+        rs->px = _qom_inttopx(_qom_readint(qm));
+        for(int j=0; j<64; j++)
+            rs->index[j] = _qom_inttopx(_qom_readint(qm));
+    }
+}
+
+static void _qom_writerestarts(qom *qm, qom_frameside *side)
+{
+    _qom_writeint(qm, side->restartrows);
+    _qom_writeint(qm, side->nrestarts);
+    for(int i=0; i<side->nrestarts; i++) {
+        qom_restart *rs = side->restarts+i;
+        _qom_writeint(qm, rs->offset);
+        _qom_writeint(qm, rs->run);
+        _qom_writeint(qm, _qom_pxtoint(rs->px));
+        for(int j=0; j<64; j++)
+            _qom_writeint(qm, _qom_pxtoint(rs->index[j]));
+    }
+}
+
+/* side records are found through the trailer just before the frameinfo */
+
+static void _qom_readsides(qom *qm, long frameinfo_offset) 
+{
+    qm->sides = (qom_frameside *)calloc(qm->header.nframes+1, sizeof(qom_frameside));
+    if(frameinfo_offset-12 < (long)sizeof(qom_header))
+        return;
+    _qom_seek(qm, frameinfo_offset-12, SEEK_SET);
+    int nside = _qom_readint(qm);
+    int side_offset = _qom_readint(qm);
+    int side_magic = _qom_readint(qm);
+    if(side_magic != QOM_SIDE_MAGIC)
+        return;
+    _qom_seek(qm, side_offset, SEEK_SET);
+    for(int i=0; i<nside; i++) {
+        int tag = _qom_readint(qm);
+        int frameno = _qom_readint(qm);
+        int size = _qom_readint(qm);
+        if((frameno<0) || (frameno>=qm->header.nframes)) {
+            _qom_seek(qm, size, SEEK_CUR);
+            continue;
+        }
+        switch(tag) {
+            case qomSIDE_RESTARTS:
+                _qom_readrestarts(qm, qm->sides+frameno, size);
+                break;
+            case qomSIDE_CHANNELS:
+                qm->sides[frameno].channels = _qom_readint(qm);
+                _qom_seek(qm, size-4, SEEK_CUR);
+                break;
+            case qomSIDE_TOLERANCE:
+                qm->sides[frameno].tolerance = _qom_readint(qm);
+                _qom_seek(qm, size-4, SEEK_CUR);
+                break;
+            case qomSIDE_CROP:
+                qm->sides[frameno].cropx = _qom_readint(qm);
+                qm->sides[frameno].cropy = _qom_readint(qm);
+                qm->sides[frameno].fullsizex = _qom_readint(qm);
+                qm->sides[frameno].fullsizey = _qom_readint(qm);
+                _qom_seek(qm, size-16, SEEK_CUR);
+                break;
+            default:
+                _qom_seek(qm, size, SEEK_CUR);
+                break;
+        }
+    }
+}
+
+static void _qom_writesides(qom *qm) 
+{
+    int nside = 0;
+    int side_offset = (int)_qom_tell(qm);
+    for(int i=0; i<qm->header.nframes; i++) {
+        qom_frameside *side = qm->sides+i;
+        if(side->nrestarts>0) {
+            _qom_writeint(qm, qomSIDE_RESTARTS);
+            _qom_writeint(qm, i);
+            _qom_writeint(qm, (2+side->nrestarts*67)*4);
+            _qom_writerestarts(qm, side);
+            nside++;
+        }
+        if(side->channels == 3) {
+            _qom_writeint(qm, qomSIDE_CHANNELS);
+            _qom_writeint(qm, i);
+            _qom_writeint(qm, 4);
+            _qom_writeint(qm, side->channels);
+            nside++;
+        }
+        if(side->tolerance>0) {
+            _qom_writeint(qm, qomSIDE_TOLERANCE);
+            _qom_writeint(qm, i);
+            _qom_writeint(qm, 4);
+            _qom_writeint(qm, side->tolerance);
+            nside++;
+        }
+        if(side->fullsizex>0) {
+            _qom_writeint(qm, qomSIDE_CROP);
+            _qom_writeint(qm, i);
+            _qom_writeint(qm, 16);
+            _qom_writeint(qm, side->cropx);
+            _qom_writeint(qm, side->cropy);
+            _qom_writeint(qm, side->fullsizex);
+            _qom_writeint(qm, side->fullsizey);
+            nside++;
+        }
+    }
+    if(nside>0) {
+        _qom_writeint(qm, nside);
+        _qom_writeint(qm, side_offset);
+        _qom_writeint(qm, QOM_SIDE_MAGIC);
+    }
+}
+
+/* read the header, frame table and side records of a movie opened for reading */
+
+static int _qom_readindex(qom *qm)
+{
+    _qom_readheader(qm);
+    if(qm->header.magic != QOM_MAGIC) {
+        fprintf(stderr, "qom: good magic: 0x%x  bad magic 0x%x\n", QOM_MAGIC, qm->header.magic);
+        qm->error = qomERROR_MAGIC;
+        return 0;
+    }
+    long frameinfo_offset = -1;
+    if((qm->header.nframes >= 0) && (_qom_seek(qm, -(long)(qm->header.nframes*sizeof(qom_frameinfo)), SEEK_END) == 0))
+        frameinfo_offset = _qom_tell(qm);
+    if(frameinfo_offset < (long)sizeof(qom_header)) {
+        fprintf(stderr, "qom: movie too short for %d frames\n", qm->header.nframes);
+        qm->error = qomERROR_FORMAT;
+        return 0;
+    }
+    _qom_readframeinfo(qm);
+    _qom_readsides(qm, frameinfo_offset);
+    return 1;
+}
+
+static int _qom_readmanifest(qom *qm, const char *filename);
+
+static int _qom_openread(qom *qm, const char *filename, int mode) 
+{
+    qm->f = 0;
+    qm->filename = strdup(filename);
+    switch(mode) { 
+        case qomMODE_R:
+            qm->f = fopen(filename, "rb");
+            break;
+        case qomMODE_RW:
+            qm->f = fopen(filename, "rwb");
+            break;
+    }
+    qm->mode = mode;
+    if(!qm->f) {
+        fprintf(stderr, "qom: can't open input file [%s]\n", filename);
+        qm->error = qomERROR_OPEN_READ;
+        return 0;
+    }
+    if((mode == qomMODE_R) && (_qom_readint(qm) == QOM_SEGMENTS_MAGIC))
+        return _qom_readmanifest(qm, filename);
+    _qom_seek(qm, 0, SEEK_SET);
+    return _qom_readindex(qm);
+}
+
+static int _qom_openwrite(qom *qm, const char *filename, int mode) 
+{
+    qm->f = fopen(filename, "wb");
+    qm->mode = mode;
+    if(!qm->f) {
+        fprintf(stderr, "qom: can't open output file [%s]\n", filename);
+        qm->error = qomERROR_OPEN_WRITE;
+        return 0;
+    }
+    if(qm->writebehind)
+        _qom_writer_begin(qm);
+    else if(qm->preallocate)
+        _qom_preallocate(fileno(qm->f), 0, qm->preallocate);
+    _qom_writeheader(qm);
+    return 1;
+}
+
+static qom *_qom_new(void)
+{
+    qom *qm = (qom *)malloc(sizeof(qom));
+    qm->header.magic = 0;
+    qm->header.nframes = 0;
+    qm->header.duration_lo = 0;
+    qm->header.duration_hi = 0;
+    qm->header.sizex = -1;
+    qm->header.sizey = -1;
+    qm->header.default_starttime_lo = 0;  
+    qm->header.default_starttime_hi = 0;  
+    qm->header.default_startdir = qomSTART_DIR_INC;
+    qm->header.default_leftbounce = qomBOUNCE_REV;
+    qm->header.default_rightbounce = qomBOUNCE_REV;
+    qm->mode = qomMODE_NONE;
+    qm->f = 0;
+    qm->error = qomERROR_NONE;
+    qm->firstframe_usec = 0;
+    qm->frames = 0;
+    qm->sides = 0;
+    qm->framealloc = 0;
+    qm->restartrows = qomRESTART_AUTO;
+    qm->nthreads = _qom_ncpus();
+    qm->input_format = qomFORMAT_RGBA;
+    qm->output_format = qomFORMAT_RGBA;
+    qm->effort = qomEFFORT_FAST;
+    qm->tolerance = 0;
+    qm->crop = 0;
+    qm->dither = 0;
+    qm->rowframe = 0;
+    qm->mem = 0;
+    qm->membase = 0;
+    qm->memsize = 0;
+    qm->mempos = 0;
+    qm->segments = 0;
+    qm->batch = 0;
+    qm->batchalloc = 0;
+    qm->filename = 0;
+    qm->fd = -1;
+    qm->fddirect = 0;
+    qm->writebehind = 0;
+    qm->preallocate = 0;
+    qm->sync = qomSYNC_NONE;
+    qm->writer = 0;
+    qm->output_encoding = qomENCODING_QOI;
+    return qm;
+}
+
+qom *qom_open(const char *filename, const char *mode)
+{
+    qom *qm = _qom_new();
+    if(strcmp(mode, "r") == 0) {
+        if(!_qom_openread(qm, filename, qomMODE_R)) {
+           if(qm->f)
+               fclose(qm->f);
+            _qom_free(qm);
+            return 0;
+        }
+    } else if(strcmp(mode, "rw") == 0) {
+        if(!_qom_openread(qm, filename, qomMODE_RW)) {
+           if(qm->f)
+               fclose(qm->f);
+            _qom_free(qm);
+            return 0;
+        }
+    } else if(strcmp(mode, "w") == 0) {
+        if(!_qom_openwrite(qm, filename, qomMODE_W)) {
+           if(qm->f)
+               fclose(qm->f);
+            _qom_free(qm);
+            return 0;
+        }
+    } else {
+        fprintf(stderr, "qom: strange mode for open [%s]\n", mode);
+        _qom_free(qm);
+        return 0;
+    }
+    return qm;
+}
+
+/*
+ * Read a movie from len bytes at buf, like a .qom file embedded in a 
+ * program with qomutil -toc.  The bytes are read in place, without stdio, 
+ * and must stay put until qom_close.  The qom is read only.
+ */
+qom *qom_open_memory(const void *buf, size_t len)
+{
+    if(len < sizeof(qom_header)) {
+        fprintf(stderr, "qom: movie in memory is too short\n");
+        return 0;
+    }
+    qom *qm = _qom_new();
+    qm->mem = (const unsigned char *)buf;
+    qm->memsize = len;
+    qm->mode = qomMODE_R;
+    if(!_qom_readindex(qm)) {
+        _qom_free(qm);
+        return 0;
+    }
+    return qm;
+}
+
+/* 
+ * Bundles pack many movies into one file, so a program with thousands of 
+ * small animations opens and maps one file at startup.  The file is
+ *
+ *     int magic, nmovies, nslots, 0...    64 byte header
+ *     int slots[nslots]                   entry+1 of each name by hash, 0 if empty
+ *     int entries[nmovies][4]             hash, name offset, movie offset, movie size
+ *     char names[]                        each ends with a 0
+ *     movies                              each starting on a 64 byte boundary
+ *
+ * with ints big endian, like the rest of the format.  nslots is a power 
+ * of 2 at least twice nmovies, and names are found by linear probing.  
+ * qom_bundle_get gives a movie as a qom that reads the mapped bytes, 
+ * which makes no system calls.
+ */
+#define QOM_BUNDLE_MAGIC        (0x514f4d42)    /* QOMB */
+#define QOM_BUNDLE_HEADER       (64)
+#define QOM_BUNDLE_ALIGN        (64)
+
+static unsigned int _qom_namehash(const char *name)
+{
+    unsigned int h = 2166136261u;           /* FNV-1a */
+    for(; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
+
+static int _qom_bundle_int(const unsigned char *bytes, int i)
+{
+    int p = 4*i;
+    return qom_read_32(bytes, &p);
+}
+
+qom_bundle *qom_bundle_open(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd<0) {
+        fprintf(stderr, "qom: can't open bundle [%s]\n", filename);
+        return 0;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if((fstat(fd, &st) == 0) && (st.st_size >= QOM_BUNDLE_HEADER) && (st.st_size < 0x7fffffff))
+        map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "qom: can't map bundle [%s]\n", filename);
+        return 0;
+    }
+    qom_bundle *b = (qom_bundle *)malloc(sizeof(qom_bundle));
+    b->data = (const unsigned char *)map;
+    b->size = st.st_size;
+    b->nmovies = _qom_bundle_int(b->data, 1);
+    b->nslots = _qom_bundle_int(b->data, 2);
+    b->slots = b->data+QOM_BUNDLE_HEADER;
+    b->entries = b->slots+4*(long)b->nslots;
+    b->names = (const char *)(b->entries+16*(long)b->nmovies);
+    long dirsize = QOM_BUNDLE_HEADER + 4*(long)b->nslots + 16*(long)b->nmovies;
+    int ok = (_qom_bundle_int(b->data, 0) == QOM_BUNDLE_MAGIC) && (b->nmovies>=0) && (b->nslots>0) && 
+                            ((b->nslots & (b->nslots-1)) == 0) && (b->nslots >= b->nmovies) && (dirsize <= b->size);
+    for(int i=0; ok && (i<b->nmovies); i++) {
+        int name = _qom_bundle_int(b->entries, 4*i+1);
+        int offset = _qom_bundle_int(b->entries, 4*i+2);
+        int size = _qom_bundle_int(b->entries, 4*i+3);
+        ok = (name>=0) && (dirsize+name < b->size) && memchr(b->names+name, 0, b->size-dirsize-name) && 
+                            (offset>=dirsize) && (size>=0) && (size <= b->size-offset);
+    }
+    if(!ok) {
+        fprintf(stderr, "qom: bad bundle [%s]\n", filename);
+        qom_bundle_close(b);
+        return 0;
+    }
+    return b;
+}
+
+/* movie i of the bundle, from 0 to qom_bundle_getnmovies-1 */
+
+static qom *_qom_bundle_movie(qom_bundle *b, int i)
+{
+    return qom_open_memory(b->data+_qom_bundle_int(b->entries, 4*i+2), _qom_bundle_int(b->entries, 4*i+3));
+}
+
+/* 
+ * The movie called name, or 0 if there is none.  qom_close it when done, 
+ * before the bundle is closed.
+ */
+qom *qom_bundle_get(qom_bundle *b, const char *name)
+{
+    unsigned int h = _qom_namehash(name);
+    unsigned int mask = b->nslots-1;
+    for(unsigned int i=h & mask, probes=0; probes<=mask; i=(i+1) & mask, probes++) {
+        int e = _qom_bundle_int(b->slots, i)-1;
+        if((e<0) || (e>=b->nmovies))
+            return 0;
+        if(((unsigned int)_qom_bundle_int(b->entries, 4*e) == h) && (strcmp(b->names+_qom_bundle_int(b->entries, 4*e+1), name) == 0))
+            return _qom_bundle_movie(b, e);
+    }
+    return 0;
+}
+
+int qom_bundle_getnmovies(qom_bundle *b)
+{
+    return b->nmovies;
+}
+
+const char *qom_bundle_getname(qom_bundle *b, int i)
+{
+    if((i<0) || (i>=b->nmovies))
+        return 0;
+    return b->names+_qom_bundle_int(b->entries, 4*i+1);
+}
+
+void qom_bundle_close(qom_bundle *b)
+{
+    munmap((void *)b->data, b->size);
+    free(b);
+}
+
+static void _qom_fputint(FILE *f, int v)
+{
+    unsigned char bytes[4];
+    int p = 0;
+    qom_write_32(bytes, &p, v);
+    fwrite(bytes, 1, 4, f);
+}
+
+static unsigned char *_qom_readfile(const char *filename, int *size)
+{
+    FILE *f = fopen(filename, "rb");
+    if(!f)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *data = (len>0) && (len<0x7fffffff) ? (unsigned char *)malloc(len) : 0;
+    if(data && (fread(data, 1, len, f) != (size_t)len)) {
+        free(data);
+        data = 0;
+    }
+    fclose(f);
+    *size = len;
+    return data;
+}
+
+/* 
+ * Write a bundle of the movies in files, called names.  Returns 1, or 0 
+ * if a movie can't be read or a name is used twice.
+ */
+int qom_bundle_write(const char *filename, int nmovies, const char **names, const char **files)
+{
+    int nslots = 1;
+    while(nslots < 2*nmovies)
+        nslots *= 2;
+    int *slots = (int *)calloc(nslots, sizeof(int));
+    unsigned int *hashes = (unsigned int *)malloc((nmovies+1)*sizeof(unsigned int));
+    int namesize = 0;
+    for(int i=0; i<nmovies; i++) {
+        hashes[i] = _qom_namehash(names[i]);
+        unsigned int s = hashes[i] & (nslots-1);
+        while(slots[s]) {
+            if(strcmp(names[slots[s]-1], names[i]) == 0) {
+                fprintf(stderr, "qom_bundle_write: name [%s] is used twice\n", names[i]);
+                free(hashes);
+                free(slots);
+                return 0;
+            }
+            s = (s+1) & (nslots-1);
+        }
+        slots[s] = i+1;
+        namesize += strlen(names[i])+1;
+    }
+    FILE *f = fopen(filename, "wb");
+    if(!f) {
+        fprintf(stderr, "qom_bundle_write: can't open output file [%s]\n", filename);
+        free(hashes);
+        free(slots);
+        return 0;
+    }
+    long dirsize = QOM_BUNDLE_HEADER + 4*(long)nslots + 16*(long)nmovies + namesize;
+    long offset = (dirsize+QOM_BUNDLE_ALIGN-1) & ~(long)(QOM_BUNDLE_ALIGN-1);
+    _qom_fputint(f, QOM_BUNDLE_MAGIC);
+    _qom_fputint(f, nmovies);
+    _qom_fputint(f, nslots);
+    for(int i=3; i<QOM_BUNDLE_HEADER/4; i++)
+        _qom_fputint(f, 0);
+    for(int i=0; i<nslots; i++)
+        _qom_fputint(f, slots[i]);
+    int ok = 1;
+    int name = 0;
+    int *sizes = (int *)malloc((nmovies+1)*sizeof(int));
+    for(int i=0; i<nmovies; i++) {
+        FILE *m = fopen(files[i], "rb");
+        sizes[i] = 0;
+        if(m) {
+            fseek(m, 0, SEEK_END);
+            sizes[i] = ftell(m);
+            fclose(m);
+        } else {
+            fprintf(stderr, "qom_bundle_write: can't open input file [%s]\n", files[i]);
+            ok = 0;
+        }
+        _qom_fputint(f, hashes[i]);
+        _qom_fputint(f, name);
+        _qom_fputint(f, offset);
+        _qom_fputint(f, sizes[i]);
+        name += strlen(names[i])+1;
+        offset = (offset+sizes[i]+QOM_BUNDLE_ALIGN-1) & ~(long)(QOM_BUNDLE_ALIGN-1);
+    }
+    for(int i=0; i<nmovies; i++)
+        fwrite(names[i], 1, strlen(names[i])+1, f);
+    static const unsigned char zeros[QOM_BUNDLE_ALIGN] = { 0 };
+    for(int i=0; ok && (i<nmovies); i++) {
+        fwrite(zeros, 1, (QOM_BUNDLE_ALIGN - ftell(f)%QOM_BUNDLE_ALIGN) % QOM_BUNDLE_ALIGN, f);
+        int size;
+        unsigned char *data = _qom_readfile(files[i], &size);
+        if(!data || (size != sizes[i]) || (size<4) || (_qom_bundle_int(data, 0) != QOM_MAGIC)) {
+            fprintf(stderr, "qom_bundle_write: [%s] is not a qom movie\n", files[i]);
+            ok = 0;
+        } else {
+            fwrite(data, 1, size, f);
+        }
+        free(data);
+    }
+    if(ferror(f)) {
+        fprintf(stderr, "qom_bundle_write: write error\n");
+        ok = 0;
+    }
+    fclose(f);
+    if(!ok)
+        remove(filename);
+    free(sizes);
+    free(hashes);
+    free(slots);
+    return ok;
+}
+
+int qom_getnframes(qom *qm) 
+{
+    if(qm->segments && (qm->mode == qomMODE_W))
+        return qm->segments->nframes+qm->header.nframes;
+    return qm->header.nframes;
+}
+
+double gfx_64ToUsec(unsigned int lo, unsigned int hi)
+{
+    double dlo = lo;
+    double dhi = hi;
+    double dscale = 256*256;
+    dscale = dscale*dscale;
+    return ((dhi*dscale) + lo);
+}
+
+void gfx_UsecTo64(double t, unsigned int *lo, unsigned int *hi)
+{
+    double dscale = 256*256;
+    dscale = dscale*dscale;
+    double dhi = floor(t/dscale);
+    double dlo = t-(dhi*dscale);
+    *hi = dhi;
+    *lo = dlo;
+}
+
+/*
+ * Segmented movies.  The manifest is
+ *
+ *     int magic, nsegments
+ *     for each segment
+ *         int firstframe, nframes, start_lo, start_hi, namelen
+ *         char name[namelen], padded with 0s to a multiple of 4
+ *
+ * with ints big endian.  Names without a leading / are relative to the 
+ * directory of the manifest, so a movie and its segments can be moved 
+ * together.  The writer rewrites the manifest each time it finishes a 
+ * segment, through a temporary file and rename, so the manifest always 
+ * lists the segments that are complete.  Each segment is a plain .qom 
+ * file that can be read on its own, by another thread or program.
+ */
+static qom_segments *_qom_segments_new(const char *manifest)
+{
+    qom_segments *ss = (qom_segments *)malloc(sizeof(qom_segments));
+    ss->manifest = strdup(manifest);
+    ss->segs = 0;
+    ss->nsegs = 0;
+    ss->segalloc = 0;
+    ss->current = -1;
+    ss->want = 0;
+    ss->maxframes = 0;
+    ss->maxbytes = 0;
+    ss->nframes = 0;
+    ss->firstframe_usec = 0;
+    return ss;
+}
+
+static qom_segment *_qom_addsegment(qom_segments *ss, const char *name)
+{
+    if(ss->nsegs == ss->segalloc) {
+        ss->segalloc = 2*ss->segalloc+8;
+        ss->segs = (qom_segment *)realloc(ss->segs, ss->segalloc*sizeof(qom_segment));
+    }
+    qom_segment *seg = ss->segs+ss->nsegs++;
+    seg->firstframe = 0;
+    seg->nframes = 0;
+    seg->start_lo = 0;
+    seg->start_hi = 0;
+    seg->name = strdup(name);
+    seg->fd = -1;
+    seg->fddirect = 0;
+    const char *slash = strrchr(ss->manifest, '/');
+    int dirlen = (slash && (name[0] != '/')) ? (slash-ss->manifest)+1 : 0;
+    seg->path = (char *)malloc(dirlen+strlen(name)+1);
+    memcpy(seg->path, ss->manifest, dirlen);
+    strcpy(seg->path+dirlen, name);
+    return seg;
+}
+
+static int _qom_readmanifest(qom *qm, const char *filename)
+{
+    qom_segments *ss = _qom_segments_new(filename);
+    qm->segments = ss;
+    int nsegs = _qom_readint(qm);
+    int nframes = 0;
+    for(int i=0; i<nsegs; i++) {
+        int firstframe = _qom_readint(qm);
+        int n = _qom_readint(qm);
+        unsigned int start_lo = _qom_readint(qm);
+        unsigned int start_hi = _qom_readint(qm);
+        int namelen = _qom_readint(qm);
+        if((firstframe != nframes) || (n<0) || (namelen<=0) || (namelen>4096)) {
+            fprintf(stderr, "qom: strange manifest [%s]\n", filename);
+            qm->error = qomERROR_FORMAT;
+            return 0;
+        }
+        char *name = (char *)calloc((namelen+3)&~3, 1);
+        _qom_read(qm, name, (namelen+3)&~3);
+        name[namelen-1] = 0;
+        qom_segment *seg = _qom_addsegment(ss, name);
+        free(name);
+        seg->firstframe = firstframe;
+        seg->nframes = n;
+        seg->start_lo = start_lo;
+        seg->start_hi = start_hi;
+        nframes += n;
+    }
+    fclose(qm->f);
+    qm->f = 0;
+
+    /* the frame table and side records of every segment, with global times */
+    qm->header.magic = QOM_MAGIC;
+    qm->header.nframes = 0;
+    qm->frames = (qom_frameinfo *)malloc((nframes+1)*sizeof(qom_frameinfo));
+    qm->sides = (qom_frameside *)calloc(nframes+1, sizeof(qom_frameside));
+    qm->framealloc = nframes+1;
+    for(int i=0; i<nsegs; i++) {
+        qom_segment *seg = ss->segs+i;
+        qom *sub = qom_open(seg->path, "r");
+        if(!sub || sub->segments || (qom_getnframes(sub) != seg->nframes)) {
+            fprintf(stderr, "qom: segment [%s] doesn't match the manifest\n", seg->path);
+            if(sub)
+                qom_close(sub);
+            qm->error = qomERROR_FORMAT;
+            return 0;
+        }
+        if(i == 0) {
+            qm->header = sub->header;
+            qm->header.nframes = 0;
+        }
+        double start = gfx_64ToUsec(seg->start_lo, seg->start_hi);
+        for(int j=0; j<seg->nframes; j++) {
+            qom_frameinfo *fi = qm->frames+qm->header.nframes;
+            *fi = sub->frames[j];
+            gfx_UsecTo64(start+gfx_64ToUsec(fi->time_lo, fi->time_hi), &fi->time_lo, &fi->time_hi);
+            qm->sides[qm->header.nframes] = sub->sides[j];
+            memset(sub->sides+j, 0, sizeof(qom_frameside));     /* the restarts are ours now */
+            qm->header.nframes++;
+        }
+        qom_close(sub);
+    }
+    if(qm->header.nframes>0) {
+        qom_frameinfo *last = qm->frames+qm->header.nframes-1;
+        qm->header.duration_lo = last->time_lo;
+        qm->header.duration_hi = last->time_hi;
+    }
+    return 1;
+}
+
+static int _qom_writemanifest(qom *qm)
+{
+    qom_segments *ss = qm->segments;
+    char *tmpname = (char *)malloc(strlen(ss->manifest)+5);
+    sprintf(tmpname, "%s.tmp", ss->manifest);
+    FILE *f = fopen(tmpname, "wb");
+    if(!f) {
+        fprintf(stderr, "qom: can't write manifest [%s]\n", tmpname);
+        free(tmpname);
+        qm->error = qomERROR_OPEN_WRITE;
+        return 0;
+    }
+    _qom_fputint(f, QOM_SEGMENTS_MAGIC);
+    _qom_fputint(f, ss->nsegs);
+    for(int i=0; i<ss->nsegs; i++) {
+        qom_segment *seg = ss->segs+i;
+        int namelen = strlen(seg->name)+1;
+        _qom_fputint(f, seg->firstframe);
+        _qom_fputint(f, seg->nframes);
+        _qom_fputint(f, seg->start_lo);
+        _qom_fputint(f, seg->start_hi);
+        _qom_fputint(f, namelen);
+        static const char zeros[4] = {0, 0, 0, 0};
+        fwrite(seg->name, 1, namelen, f);
+        fwrite(zeros, 1, ((namelen+3)&~3)-namelen, f);
+    }
+    int ok = (fclose(f) == 0) && (rename(tmpname, ss->manifest) == 0);
+    if(!ok) {
+        fprintf(stderr, "qom: can't write manifest [%s]\n", ss->manifest);
+        qm->error = qomERROR_WRITE;
+    }
+    free(tmpname);
+    return ok;
+}
+
+/* segment n of out.qoms is out.000n.qom */
+
+static int _qom_beginsegment(qom *qm)
+{
+    qom_segments *ss = qm->segments;
+    const char *base = strrchr(ss->manifest, '/');
+    base = base ? base+1 : ss->manifest;
+    int len = strlen(base);
+    if((len>5) && (strcmp(base+len-5, ".qoms") == 0))
+        len -= 5;
+    char *name = (char *)malloc(len+32);
+    sprintf(name, "%.*s.%04d.qom", len, base, ss->nsegs);
+    qom_segment *seg = _qom_addsegment(ss, name);
+    free(name);
+    seg->firstframe = ss->nframes;
+    qm->f = fopen(seg->path, "wb");
+    if(!qm->f) {
+        fprintf(stderr, "qom: can't open output file [%s]\n", seg->path);
+        qm->error = qomERROR_OPEN_WRITE;
+        ss->nsegs--;
+        free(seg->name);
+        free(seg->path);
+        return 0;
+    }
+    qm->header.nframes = 0;
+    qm->header.duration_lo = 0;
+    qm->header.duration_hi = 0;
+    if(qm->writebehind)
+        _qom_writer_begin(qm);
+    else if(qm->preallocate)
+        _qom_preallocate(fileno(qm->f), 0, qm->preallocate);
+    _qom_writeheader(qm);
+    return 1;
+}
+
+static int _qom_endsegment(qom *qm)
+{
+    qom_segments *ss = qm->segments;
+    qom_segment *seg = ss->segs+ss->nsegs-1;
+    _qom_writesides(qm);
+    _qom_writeframeinfo(qm);
+    _qom_seek(qm, 0, SEEK_SET);
+    _qom_writeheader(qm);
+    _qom_finishfile(qm);
+    if(fclose(qm->f) != 0) {
+        fprintf(stderr, "qom: can't write segment [%s]\n", seg->path);
+        qm->error = qomERROR_WRITE;
+    }
+    qm->f = 0;
+    if(ss->nsegs == 1)
+        ss->firstframe_usec = qm->firstframe_usec;
+    seg->nframes = qm->header.nframes;
+    gfx_UsecTo64(qm->firstframe_usec-ss->firstframe_usec, &seg->start_lo, &seg->start_hi);
+    ss->nframes += qm->header.nframes;
+    for(int i=0; i<qm->header.nframes; i++)
+        _qom_freeside(qm->sides+i);
+    qm->header.nframes = 0;
+    return _qom_writemanifest(qm);
+}
+
+/* called before each frame is written, to start a new segment when this one is full */
+
+static int _qom_nextsegment(qom *qm)
+{
+    qom_segments *ss = qm->segments;
+    if(qm->f) {
+        int full = ((ss->maxframes>0) && (qm->header.nframes >= ss->maxframes)) || 
+                   ((ss->maxbytes>0) && (qm->offset >= ss->maxbytes));
+        if(!full)
+            return 1;
+        if(!_qom_endsegment(qm))
+            return 0;
+    }
+    return _qom_beginsegment(qm);
+}
+
+/*
+ * Write a movie as segments of at most maxframes frames or about maxbytes 
+ * bytes, whichever comes first, with 0 for no limit.  The segments go 
+ * next to the manifest, out.qoms has out.0000.qom, out.0001.qom ...  
+ * qom_open reads the manifest as one movie.
+ */
+qom *qom_open_segmented(const char *manifest, int maxframes, long maxbytes)
+{
+    qom *qm = _qom_new();
+    qm->mode = qomMODE_W;
+    qm->segments = _qom_segments_new(manifest);
+    qm->segments->maxframes = maxframes;
+    qm->segments->maxbytes = maxbytes;
+    if(!_qom_writemanifest(qm)) {
+        _qom_free(qm);
+        return 0;
+    }
+    return qm;
+}
+
+int qom_getnsegments(qom *qm)
+{
+    return qm->segments ? qm->segments->nsegs : 0;
+}
+
+/* the file of segment i and its frames, or 0 */
+
+const char *qom_getsegment(qom *qm, int i, int *firstframe, int *nframes)
+{
+    if(!qm->segments || (i<0) || (i>=qm->segments->nsegs))
+        return 0;
+    qom_segment *seg = qm->segments->segs+i;
+    *firstframe = seg->firstframe;
+    *nframes = seg->nframes;
+    return seg->path;
+}
+
+/* n is a frame of the movie, with a side record */
+
+static int _qom_hasframe(qom *qm, int n)
+{
+    return qm->sides && (n>=0) && (n<qm->header.nframes);
+}
+
+static int _qom_checkframe(qom *qm, int n)
+{
+    if(_qom_hasframe(qm, n))
+        return 1;
+    fprintf(stderr, "qom: frame %d out of range\n", n);
+    qm->error = qomERROR_RANGE;
+    return 0;
+}
+
+static gfx_canvas *_qom_getframe_rgba(qom *qm, int n, double *usec) 
+{
+    if((qm->mode == qomMODE_R) || (qm->mode == qomMODE_RW)) {
+        if(!_qom_checkframe(qm, n))
+            return 0;
+        qom_frameinfo *info = _qom_getframeinfo(qm, n);
+
+        _qom_seek(qm, info->offset, SEEK_SET);
+        int input_encoding = _qom_readint(qm);
+        int imgdatasize = info->size-4;
+        *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
+        switch(input_encoding) {
+            case qomENCODING_LITERAL:
+                return _qom_readframe_LITERAL(qm, imgdatasize, info);
+            case qomENCODING_QOI:
+                return _qom_readframe_QOI(qm, imgdatasize, qm->sides+n);
+            case qomENCODING_PNG:
+                return _qom_readframe_PNG(qm, imgdatasize);
+            case qomENCODING_JPG:
+                return _qom_readframe_JPG(qm, imgdatasize);
+            case qomENCODING_PALETTE:
+                return _qom_readframe_PALETTE(qm, imgdatasize);
+            case qomENCODING_PREDICT:
+                return _qom_readframe_PREDICT(qm, imgdatasize);
+            case qomENCODING_PROGRESSIVE:
+                return _qom_readframe_PROGRESSIVE(qm, imgdatasize, QOM_NPASSES);
+            case qomENCODING_RGB565:
+            case qomENCODING_RGBA4444:
+                return _qom_readframe_DEPTH16(qm, imgdatasize, _qom_encodinglayout16(input_encoding));
+            case qomENCODING_YUV420:
+                return _qom_readframe_YUV420(qm, imgdatasize);
+            default:
+                fprintf(stderr, "qom: strange frame encoding %d\n", input_encoding);
+                qm->error = qomERROR_FORMAT;
+                return 0;
+        }
+    } else {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+}
+
+/* frame n was stored cropped to its visible pixels */
+
+static int _qom_iscropped(qom *qm, int n)
+{
+    return _qom_hasframe(qm, n) && (qm->sides[n].fullsizex>0);
+}
+
+/* the size frame n was put with */
+
+static void _qom_framesize(qom *qm, int n, int *sizex, int *sizey)
+{
+    if(_qom_iscropped(qm, n)) {
+        *sizex = qm->sides[n].fullsizex;
+        *sizey = qm->sides[n].fullsizey;
+    } else {
+        *sizex = qm->frames[n].sizex;
+        *sizey = qm->frames[n].sizey;
+    }
+}
+
+/* put a cropped frame c back in a transparent frame of the size it was cut from, frees c */
+
+static gfx_canvas *_qom_uncrop(qom *qm, int n, gfx_canvas *c)
+{
+    if(!c || !_qom_iscropped(qm, n))
+        return c;
+    qom_frameside *side = qm->sides+n;
+    if((side->cropx<0) || (side->cropy<0) || (side->cropx+c->sizex>side->fullsizex) || (side->cropy+c->sizey>side->fullsizey)) {
+        fprintf(stderr, "qom: frame %d: strange crop\n", n);
+        qm->error = qomERROR_FORMAT;
+        return c;
+    }
+    gfx_canvas *full = gfx_canvas_new(side->fullsizex, side->fullsizey);
+    memset(full->data, 0, full->sizex*full->sizey*sizeof(unsigned int));
+    for(int y=0; y<c->sizey; y++)
+        memcpy(full->data+(side->cropy+y)*full->sizex+side->cropx, c->data+y*c->sizex, c->sizex*sizeof(unsigned int));
+    gfx_canvas_free(c);
+    return full;
+}
+
+/*
+ * Decode frame n into pixels, sizex*sizey pixels in format.  QOI frames 
+ * are decoded straight into pixels, other encodings are converted.
+ */
+int qom_getframe_format(qom *qm, int n, double *usec, void *pixels, int format)
+{
+    if((qm->mode == qomMODE_R) || (qm->mode == qomMODE_RW)) {
+        if(!_qom_checkframe(qm, n))
+            return 0;
+        if(_qom_formatlayout16(format)) {
+            int sizex, sizey;
+            _qom_framesize(qm, n, &sizex, &sizey);
+            return qom_getframe16(qm, n, usec, (unsigned short *)pixels, sizex, format);
+        }
+        qom_frameinfo *info = _qom_getframeinfo(qm, n);
+
+        _qom_seek(qm, info->offset, SEEK_SET);
+        int input_encoding = _qom_readint(qm);
+        if((input_encoding == qomENCODING_QOI) && !_qom_iscropped(qm, n)) {
+            int size = info->size-4;
+            unsigned char *data = (unsigned char *)malloc(size);
+            int bytes_read = _qom_read(qm, data, size);
+            int sizex, sizey;
+            if(!_qom_qoi_header(data, bytes_read, &sizex, &sizey) || (sizex != info->sizex) || (sizey != info->sizey)) {
+                fprintf(stderr, "qom_getframe_format: decode error\n");
+                qm->error = qomERROR_FORMAT;
+                free(data);
+                return 0;
+            }
+            _qom_qoi_decodeinto(data, bytes_read, qm->sides+n, qm->nthreads, format, pixels, sizex, sizey);
+            free(data);
+            *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
+            return 1;
+        }
+        gfx_canvas *c = _qom_uncrop(qm, n, _qom_getframe_rgba(qm, n, usec));
+        if(!c)
+            return 0;
+        _qom_fromrgba(pixels, c->data, c->sizex*c->sizey, format);
+        gfx_canvas_free(c);
+        return 1;
+    } else {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+}
+
+/*
+ * Decode frame n into rows of stride 16 bit pixels in qomFORMAT_RGB565 or 
+ * RGBA4444, like a framebuffer.  Frames stored in that format are decoded 
+ * straight into pixels, others are decoded and rounded.
+ */
+int qom_getframe16(qom *qm, int n, double *usec, unsigned short *pixels, int stride, int format)
+{
+    const _qom_layout16 *l = _qom_formatlayout16(format);
+    if(!l) {
+        fprintf(stderr, "qom: strange 16 bit format %d\n", format);
+        qm->error = qomERROR_FORMAT;
+        return 0;
+    }
+    if((qm->mode == qomMODE_R) || (qm->mode == qomMODE_RW)) {
+        if(!_qom_checkframe(qm, n))
+            return 0;
+        qom_frameinfo *info = _qom_getframeinfo(qm, n);
+
+        _qom_seek(qm, info->offset, SEEK_SET);
+        int input_encoding = _qom_readint(qm);
+        if((_qom_encodinglayout16(input_encoding) == l) && !_qom_iscropped(qm, n)) {
+            int size = info->size-4;
+            unsigned char *data = (unsigned char *)malloc(size);
+            int bytes_read = _qom_read(qm, data, size);
+            int sizex, sizey;
+            if(!_qom_depth16_header(data, bytes_read, &sizex, &sizey) || (sizex != info->sizex) || (sizey != info->sizey) || 
+                                            !_qom_depth16_decodeinto(data, bytes_read, l, pixels, stride)) {
+                fprintf(stderr, "qom_getframe16: decode error\n");
+                qm->error = qomERROR_FORMAT;
+                free(data);
+                return 0;
+            }
+            free(data);
+            *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
+            return 1;
+        }
+        gfx_canvas *c = _qom_uncrop(qm, n, _qom_getframe_rgba(qm, n, usec));
+        if(!c)
+            return 0;
+        int sizex, sizey;
+        _qom_framesize(qm, n, &sizex, &sizey);
+        if((c->sizex != sizex) || (c->sizey != sizey)) {
+            fprintf(stderr, "qom_getframe16: decode error\n");
+            qm->error = qomERROR_FORMAT;
+            gfx_canvas_free(c);
+            return 0;
+        }
+        _qom_quant16 *qt = _qom_quant16_new(l, 0);
+        for(int y=0; y<c->sizey; y++)
+            _qom_quant16_row(qt, pixels+y*stride, c->data+y*c->sizex, c->sizex, 0);
+        free(qt);
+        gfx_canvas_free(c);
+        return 1;
+    } else {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+}
+
+/*
+ * Frame n as YCbCr 4:2:0 planes: sizex*sizey bytes of Y, then Cb and Cr 
+ * at half the width and height, rounded up.  YUV420 frames give their 
+ * planes without converting, others are converted.  Free the planes.
+ */
+unsigned char *qom_getframe_planes(qom *qm, int n, double *usec, int *sizex, int *sizey)
+{
+    if((qm->mode == qomMODE_R) || (qm->mode == qomMODE_RW)) {
+        if(!_qom_checkframe(qm, n))
+            return 0;
+        qom_frameinfo *info = _qom_getframeinfo(qm, n);
+
+        _qom_seek(qm, info->offset, SEEK_SET);
+        int input_encoding = _qom_readint(qm);
+        if((input_encoding == qomENCODING_YUV420) && !_qom_iscropped(qm, n)) {
+            *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
+            return _qom_readframe_planes(qm, info->size-4, sizex, sizey);
+        }
+        gfx_canvas *c = _qom_uncrop(qm, n, _qom_getframe_rgba(qm, n, usec));
+        if(!c)
+            return 0;
+        int cx, cy;
+        _qom_yuv420_planesize(c->sizex, c->sizey, &cx, &cy);
+        unsigned char *planes = (unsigned char *)malloc(c->sizex*c->sizey + 2*cx*cy);
+        _qom_yuv420_fromrgba(c->data, c->sizex, c->sizey, planes);
+        *sizex = c->sizex;
+        *sizey = c->sizey;
+        gfx_canvas_free(c);
+        return planes;
+    } else {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+}
+
+/*
+ * Frame n as a canvas in qom_getoutputformat.  3 channel canvases hold 
+ * packed RGB bytes, so they take a quarter less memory.  QOI frames are 
+ * decoded straight into the format, so BGRA or premultiplied canvases 
+ * cost no extra pass.
+ */
+gfx_canvas *qom_getframe(qom *qm, int n, double *usec) 
+{
+    if(qm->output_format == qomFORMAT_RGBA)
+        return _qom_uncrop(qm, n, _qom_getframe_rgba(qm, n, usec));
+    if((qm->mode != qomMODE_R) && (qm->mode != qomMODE_RW))
+        return _qom_getframe_rgba(qm, n, usec);
+    if(!_qom_checkframe(qm, n))
+        return 0;
+    int sizex, sizey;
+    _qom_framesize(qm, n, &sizex, &sizey);
+    int bpp = _qom_formatbytes(qm->output_format);
+    unsigned char *pixels = (unsigned char *)qom_alloc(sizex*sizey*bpp);
+    if(!qom_getframe_format(qm, n, usec, pixels, qm->output_format)) {
+        qom_free(pixels);
+        return 0;
+    }
+    gfx_canvas *c = _qom_poolcanvas(sizex, sizey, pixels);
+    c->channels = bpp;
+    return c;
+}
+
+/*
+ * qom_getframes reads the bytes of a run of frames with one read, up to 
+ * QOM_BATCH_BYTES at a time into a buffer kept with the qom, and decodes 
+ * the frames from memory on qm->nthreads threads.  Each thread decodes through its own copy of 
+ * the qom that reads the batch, so the frame readers need no changes.
+ */
+#define QOM_BATCH_BYTES         (16*1024*1024)
+
+typedef struct _qom_batch {
+    qom *qm;
+    const unsigned char *data;
+    long start, end;                    /* file offsets of the bytes in data */
+    int first;
+    gfx_canvas **frames;
+    double *usecs;
+    int nthreads;                       /* for each frame */
+    int error;
+} _qom_batch;
+
+static void _qom_batchframe(void *arg, int job)
+{
+    _qom_batch *b = (_qom_batch *)arg;
+    qom view = *b->qm;
+    view.f = 0;
+    view.segments = 0;
+    view.mem = b->data;
+    view.membase = b->start;
+    view.memsize = b->end;
+    view.mempos = b->start;
+    view.nthreads = b->nthreads;
+    double usec = 0;
+    b->frames[job] = qom_getframe(&view, b->first+job, &usec);
+    if(b->usecs)
+        b->usecs[job] = usec;
+    if(view.error != qomERROR_NONE)
+        b->error = view.error;
+}
+
+/*
+ * Read count frames starting at first into frames, and their times into 
+ * usecs if it isn't 0.  Returns the number of frames decoded; frames that 
+ * could not be read or decoded are left 0, so less than count is an error.
+ */
+int qom_getframes(qom *qm, int first, int count, gfx_canvas **frames, double *usecs)
+{
+    if((qm->mode != qomMODE_R) && (qm->mode != qomMODE_RW)) {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+    if((first<0) || (count<0) || (first+count > qom_getnframes(qm))) {
+        fprintf(stderr, "qom_getframes: frames %d to %d out of range\n", first, first+count-1);
+        qm->error = qomERROR_RANGE;
+        return 0;
+    }
+    for(int k=0; k<count; k++)
+        frames[k] = 0;
+    int i = 0;
+    while(i<count) {
+        /* the frames after i that are further on in the same file */
+        qom_frameinfo *info = _qom_getframeinfo(qm, first+i);
+        int seg = qm->segments ? qm->segments->want : 0;
+        long start = info->offset;
+        long end = start+info->size;
+        int j = i+1;
+        for(; j<count; j++) {
+            qom_frameinfo *next = qm->frames+first+j;
+            if(qm->segments && (_qom_segmentof(qm->segments, first+j) != seg))
+                break;
+            if((next->offset < end) || (next->offset+next->size-start > QOM_BATCH_BYTES))
+                break;
+            end = next->offset+next->size;
+        }
+
+        _qom_batch b;
+        b.qm = qm;
+        b.start = start;
+        b.end = end;
+        if(qm->mem) {
+            b.data = qm->mem+(start-qm->membase);
+        } else {
+            if(end-start > qm->batchalloc) {
+                free(qm->batch);
+                qm->batchalloc = end-start;
+                qm->batch = (unsigned char *)malloc(qm->batchalloc);
+            }
+            _qom_seek(qm, start, SEEK_SET);
+            if(_qom_read(qm, qm->batch, end-start) != end-start) {
+                fprintf(stderr, "qom_getframes: read error\n");
+                qm->error = qomERROR_READ;
+                break;
+            }
+            b.data = qm->batch;
+        }
+        b.first = first+i;
+        b.frames = frames+i;
+        b.usecs = usecs ? usecs+i : 0;
+        int nthreads = (qm->nthreads < j-i) ? qm->nthreads : j-i;
+        b.nthreads = (nthreads>1) ? qm->nthreads/nthreads : qm->nthreads;
+        b.error = qomERROR_NONE;
+        _qom_parallel(j-i, nthreads, _qom_batchframe, &b);
+        if(b.error != qomERROR_NONE)
+            qm->error = b.error;
+        i = j;
+    }
+    int ndecoded = 0;
+    for(int k=0; k<count; k++)
+        ndecoded += (frames[k] != 0);
+    return ndecoded;
+}
+
+/*
+ * A qom_reader reads frames of many movies at once.  niothreads threads 
+ * each wait on a pread of one frame, so that many reads are in flight 
+ * and the disk's queue stays full, and hand the bytes to ndecoders 
+ * threads that decode the frames and pass them to func.  io_uring would 
+ * need liburing or raw system calls; blocking preads on a pool of 
+ * threads get most of the queue depth and work on any POSIX system.  
+ * With qomREADER_DIRECT files are opened with O_DIRECT, and reads are 
+ * of whole 4K blocks into aligned buffers, so big movies streamed once 
+ * don't push everything else out of the page cache.  File systems 
+ * without O_DIRECT are read the usual way.  Each qom gets its own 
+ * descriptor for these reads, so preads don't disturb its FILE.  At most 
+ * QOM_READER_QUEUE frames a thread are in flight; qom_reader_getframe 
+ * waits for one to finish before it takes on more, so a caller asking 
+ * for a whole movie doesn't hold a buffer for every frame.
+ */
+#define QOM_DIRECT_ALIGN        (4096)
+#define QOM_READER_QUEUE        (4)
+
+typedef struct _qom_readjob {
+    struct _qom_readjob *next;
+    qom *qm;
+    int n;
+    int fd;
+    long start;                         /* file offset of buf */
+    long len;
+    long got;
+    unsigned char *buf;
+    qom_framefunc func;
+    void *arg;
+} _qom_readjob;
+
+struct qom_reader {
+    int niothreads;
+    int ndecoders;
+    int direct;
+    _qom_readjob *iohead, *iotail;      /* waiting to be read */
+    _qom_readjob *dechead, *dectail;    /* read, waiting to be decoded */
+    int pending;                        /* submitted and not yet passed to func */
+    int maxpending;
+    int quit;
+#ifndef QOM_NO_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t ioready;
+    pthread_cond_t decodeready;
+    pthread_cond_t room;                /* pending went down */
+    pthread_cond_t idle;
+    pthread_t *threads;
+    int nthreads;
+#endif
+};
+
+static int _qom_openfd(const char *path, int direct, int *isdirect)
+{
+    *isdirect = 0;
+#ifdef _qom_O_DIRECT
+    if(direct) {
+        int fd = open(path, O_RDONLY | _qom_O_DIRECT);
+        if(fd >= 0) {
+            *isdirect = 1;
+            return fd;
+        }
+        if(errno != EINVAL)             /* EINVAL is a file system without O_DIRECT */
+            return -1;
+    }
+#else
+    (void)direct;
+#endif
+    return open(path, O_RDONLY);
+}
+
+/* the descriptor for preads of frame n */
+
+static int _qom_framefd(qom *qm, int n, int direct, int *isdirect)
+{
+    if(qm->segments) {
+        qom_segment *seg = qm->segments->segs+_qom_segmentof(qm->segments, n);
+        if(seg->fd < 0)
+            seg->fd = _qom_openfd(seg->path, direct, &seg->fddirect);
+        *isdirect = seg->fddirect;
+        return seg->fd;
+    }
+    if((qm->fd < 0) && qm->filename)
+        qm->fd = _qom_openfd(qm->filename, direct, &qm->fddirect);
+    *isdirect = qm->fddirect;
+    return qm->fd;
+}
+
+static void _qom_readjob_read(_qom_readjob *job)
+{
+    job->got = 0;
+    while(job->got < job->len) {
+        ssize_t got = pread(job->fd, job->buf+job->got, job->len-job->got, job->start+job->got);
+        if(got <= 0) {
+            if((got<0) && (errno == EINTR))
+                continue;
+            break;
+        }
+        job->got += got;
+    }
+}
+
+static void _qom_readjob_decode(_qom_readjob *job)
+{
+    qom *qm = job->qm;
+    qom_frameinfo *info = qm->frames+job->n;
+    gfx_canvas *c = 0;
+    double usec = 0;
+    if(job->buf && (job->got < info->offset+info->size-job->start)) {
+        fprintf(stderr, "qom_reader: read error on frame %d\n", job->n);
+    } else {
+        qom view = *qm;
+        view.f = 0;
+        view.segments = 0;
+        view.batch = 0;
+        view.batchalloc = 0;
+        if(job->buf) {
+            view.mem = job->buf;
+            view.membase = job->start;
+            view.memsize = job->start+job->got;
+        }
+        view.mempos = view.membase;
+        view.nthreads = 1;
+        c = qom_getframe(&view, job->n, &usec);
+    }
+    job->func(job->arg, job->n, c, usec);
+    free(job->buf);
+    free(job);
+}
+
+#ifndef QOM_NO_THREADS
+static void *_qom_iothread(void *arg)
+{
+    qom_reader *r = (qom_reader *)arg;
+    pthread_mutex_lock(&r->lock);
+    while(1) {
+        while(!r->iohead && !r->quit)
+            pthread_cond_wait(&r->ioready, &r->lock);
+        if(!r->iohead)
+            break;
+        _qom_readjob *job = r->iohead;
+        r->iohead = job->next;
+        if(!r->iohead)
+            r->iotail = 0;
+        pthread_mutex_unlock(&r->lock);
+        _qom_readjob_read(job);
+        pthread_mutex_lock(&r->lock);
+        job->next = 0;
+        if(r->dectail)
+            r->dectail->next = job;
+        else
+            r->dechead = job;
+        r->dectail = job;
+        pthread_cond_signal(&r->decodeready);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+static void *_qom_decodethread(void *arg)
+{
+    qom_reader *r = (qom_reader *)arg;
+    pthread_mutex_lock(&r->lock);
+    while(1) {
+        while(!r->dechead && !r->quit)
+            pthread_cond_wait(&r->decodeready, &r->lock);
+        if(!r->dechead)
+            break;
+        _qom_readjob *job = r->dechead;
+        r->dechead = job->next;
+        if(!r->dechead)
+            r->dectail = 0;
+        pthread_mutex_unlock(&r->lock);
+        _qom_readjob_decode(job);
+        pthread_mutex_lock(&r->lock);
+        r->pending--;
+        pthread_cond_signal(&r->room);
+        if(r->pending == 0)
+            pthread_cond_broadcast(&r->idle);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+#endif
+
+/*
+ * A reader with niothreads threads waiting on reads and ndecoders threads 
+ * decoding, or ncpus decoders if ndecoders is 0.  With no threads, or 
+ * QOM_NO_THREADS, qom_reader_getframe reads and decodes on the spot.
+ */
+qom_reader *qom_reader_new(int niothreads, int ndecoders, int flags)
+{
+    qom_reader *r = (qom_reader *)malloc(sizeof(qom_reader));
+    if(ndecoders <= 0)
+        ndecoders = _qom_ncpus();
+    r->niothreads = (niothreads>0) ? niothreads : 0;
+    r->ndecoders = r->niothreads ? ndecoders : 0;
+    r->direct = (flags & qomREADER_DIRECT) != 0;
+    r->iohead = r->iotail = 0;
+    r->dechead = r->dectail = 0;
+    r->pending = 0;
+    r->maxpending = QOM_READER_QUEUE*(r->niothreads+r->ndecoders);
+    r->quit = 0;
+#ifndef QOM_NO_THREADS
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->ioready, 0);
+    pthread_cond_init(&r->decodeready, 0);
+    pthread_cond_init(&r->room, 0);
+    pthread_cond_init(&r->idle, 0);
+    r->threads = (pthread_t *)malloc((r->niothreads+r->ndecoders+1)*sizeof(pthread_t));
+    r->nthreads = 0;
+    for(int i=0; i<r->niothreads+r->ndecoders; i++) {
+        void *(*func)(void *) = (i<r->niothreads) ? _qom_iothread : _qom_decodethread;
+        if(pthread_create(r->threads+r->nthreads, 0, func, r) == 0)
+            r->nthreads++;
+    }
+    if(r->nthreads < r->niothreads+r->ndecoders) {
+        fprintf(stderr, "qom_reader: started %d of %d threads\n", r->nthreads, r->niothreads+r->ndecoders);
+        qom_reader_free(r);
+        return 0;
+    }
+#else
+    r->niothreads = 0;
+    r->ndecoders = 0;
+#endif
+    return r;
+}
+
+/*
+ * Read and decode frame n of qm and pass it to func(arg, n, c, usec) on 
+ * a decoder thread, which frees c.  c is 0 if the frame can't be read.  
+ * qm is only read, it can be used for other things meanwhile but must 
+ * stay open until qom_reader_wait.  Waits while the reader has as many 
+ * frames in flight as it takes, so func must not call it.
+ */
+void qom_reader_getframe(qom_reader *r, qom *qm, int n, qom_framefunc func, void *arg)
+{
+    if((qm->mode != qomMODE_R) && (qm->mode != qomMODE_RW)) {
+        fprintf(stderr, "qom_reader: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        func(arg, n, 0, 0);
+        return;
+    }
+    if((n<0) || (n>=qom_getnframes(qm))) {
+        fprintf(stderr, "qom_reader: frame %d out of range\n", n);
+        qm->error = qomERROR_RANGE;
+        func(arg, n, 0, 0);
+        return;
+    }
+#ifndef QOM_NO_THREADS
+    if(r->niothreads) {
+        pthread_mutex_lock(&r->lock);
+        while(r->pending >= r->maxpending)
+            pthread_cond_wait(&r->room, &r->lock);
+        r->pending++;                   /* holds the place while the buffer is made */
+        pthread_mutex_unlock(&r->lock);
+    }
+#endif
+    qom_frameinfo *info = qm->frames+n;
+    _qom_readjob *job = (_qom_readjob *)malloc(sizeof(_qom_readjob));
+    job->next = 0;
+    job->qm = qm;
+    job->n = n;
+    job->func = func;
+    job->arg = arg;
+    job->buf = 0;
+    job->fd = -1;
+    job->start = 0;
+    job->len = 0;
+    job->got = 0;
+    if(!qm->mem) {
+        int isdirect;
+        job->fd = _qom_framefd(qm, n, r->direct, &isdirect);
+        long align = isdirect ? QOM_DIRECT_ALIGN : 1;
+        job->start = (info->offset/align)*align;
+        job->len = ((info->offset+info->size-job->start+align-1)/align)*align;
+        if(posix_memalign((void **)&job->buf, QOM_DIRECT_ALIGN, job->len) != 0)
+            job->buf = 0;
+        if((job->fd<0) || !job->buf) {
+            fprintf(stderr, "qom_reader: can't read frame %d\n", n);
+            free(job->buf);
+            free(job);
+            func(arg, n, 0, 0);
+#ifndef QOM_NO_THREADS
+            if(r->niothreads) {
+                pthread_mutex_lock(&r->lock);
+                r->pending--;
+                pthread_cond_signal(&r->room);
+                if(r->pending == 0)
+                    pthread_cond_broadcast(&r->idle);
+                pthread_mutex_unlock(&r->lock);
+            }
+#endif
+            return;
+        }
+    }
+#ifndef QOM_NO_THREADS
+    if(r->niothreads) {
+        pthread_mutex_lock(&r->lock);
+        if(job->buf) {
+            if(r->iotail)
+                r->iotail->next = job;
+            else
+                r->iohead = job;
+            r->iotail = job;
+            pthread_cond_signal(&r->ioready);
+        } else {
+            if(r->dectail)
+                r->dectail->next = job;
+            else
+                r->dechead = job;
+            r->dectail = job;
+            pthread_cond_signal(&r->decodeready);
+        }
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+#endif
+    if(job->buf)
+        _qom_readjob_read(job);
+    _qom_readjob_decode(job);
+}
+
+/* wait until every frame asked for has been passed to its func */
+
+void qom_reader_wait(qom_reader *r)
+{
+#ifndef QOM_NO_THREADS
+    pthread_mutex_lock(&r->lock);
+    while(r->pending>0)
+        pthread_cond_wait(&r->idle, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+#endif
+}
+
+void qom_reader_free(qom_reader *r)
+{
+    if(!r)
+        return;
+    qom_reader_wait(r);
+#ifndef QOM_NO_THREADS
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_broadcast(&r->ioready);
+    pthread_cond_broadcast(&r->decodeready);
+    pthread_mutex_unlock(&r->lock);
+    for(int i=0; i<r->nthreads; i++)
+        pthread_join(r->threads[i], 0);
+    free(r->threads);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->ioready);
+    pthread_cond_destroy(&r->decodeready);
+    pthread_cond_destroy(&r->room);
+    pthread_cond_destroy(&r->idle);
+#endif
+    free(r);
+}
+
+/* frame n is known to be opaque, 0 if not or out of range */
+
+int qom_getframe_opaque(qom *qm, int n)
+{
+    if(!_qom_checkframe(qm, n))
+        return 0;
+    return (qm->sides[n].channels == 3) && !_qom_iscropped(qm, n);
+}
+
+/*
+ * Frame n as it was stored: cropped to its visible pixels, at x, y in the 
+ * frame, if it was put with qom_setcrop.  Compositors can blit this and 
+ * skip the transparent margin.  Uncropped frames come back whole at 0, 0.
+ */
+gfx_canvas *qom_getframe_cropped(qom *qm, int n, double *usec, int *x, int *y)
+{
+    gfx_canvas *c = _qom_getframe_rgba(qm, n, usec);
+    if(!c)
+        return 0;
+    *x = _qom_iscropped(qm, n) ? qm->sides[n].cropx : 0;
+    *y = _qom_iscropped(qm, n) ? qm->sides[n].cropy : 0;
+    return c;
+}
+
+/*
+ * The alpha of frame n as sizex*sizey malloc'ed bytes in *alpha, to go 
+ * with a 3 channel canvas.  *alpha is 0 for opaque frames, which store no 
+ * alpha.  Returns 0 on error.
+ */
+int qom_getframe_alpha(qom *qm, int n, unsigned char **alpha)
+{
+    *alpha = 0;
+    if(!_qom_checkframe(qm, n))
+        return 0;
+    if(qom_getframe_opaque(qm, n))
+        return 1;
+    int sizex, sizey;
+    _qom_framesize(qm, n, &sizex, &sizey);
+    unsigned char *a = (unsigned char *)malloc(sizex*sizey);
+    double usec;
+    if(!qom_getframe_format(qm, n, &usec, a, qomFORMAT_ALPHA)) {
+        free(a);
+        return 0;
+    }
+    *alpha = a;
+    return 1;
+}
+
+/*
+ * The palette and per-pixel indices of frame n, for PALETTE frames.
+ * palette has room for 256 colors, *indices is malloc'ed and holds
+ * sizex*sizey bytes.  Returns 0 for frames stored another way, or 
+ * cropped.
+ */
+int qom_getframe_indexed(qom *qm, int n, double *usec, unsigned char **indices, unsigned int *palette, int *ncolors)
+{
+    if((qm->mode != qomMODE_R) && (qm->mode != qomMODE_RW)) {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+    if(!_qom_checkframe(qm, n))
+        return 0;
+    qom_frameinfo *info = _qom_getframeinfo(qm, n);
+    if((info->encoding != qomENCODING_PALETTE) || _qom_iscropped(qm, n))
+        return 0;
+    _qom_seek(qm, info->offset, SEEK_SET);
+    if(_qom_readint(qm) != qomENCODING_PALETTE)
+        return 0;
+    int sizex, sizey;
+    *indices = _qom_readframe_indices(qm, info->size-4, &sizex, &sizey, palette, ncolors);
+    if(!*indices) {
+        fprintf(stderr, "qom_getframe_indexed: decode error\n");
+        qm->error = qomERROR_FORMAT;
+        return 0;
+    }
+    *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
+    return 1;
+}
+
+/*
+ * A preview of frame n from its first maxpass passes, 1 to 7, at full 
+ * size.  Only PROGRESSIVE frames are read in part, pass 1 is a 64th of 
+ * the pixels.  Other frames come back whole.
+ */
+gfx_canvas *qom_getframe_progressive(qom *qm, int n, double *usec, int maxpass)
+{
+    if((qm->mode != qomMODE_R) && (qm->mode != qomMODE_RW)) {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+    if(!_qom_checkframe(qm, n))
+        return 0;
+    qom_frameinfo *info = _qom_getframeinfo(qm, n);
+    if(info->encoding != qomENCODING_PROGRESSIVE)
+        return _qom_uncrop(qm, n, _qom_getframe_rgba(qm, n, usec));
+    _qom_seek(qm, info->offset, SEEK_SET);
+    if(_qom_readint(qm) != qomENCODING_PROGRESSIVE) {
+        qm->error = qomERROR_FORMAT;
+        return 0;
+    }
+    if((maxpass<1) || (maxpass>QOM_NPASSES))
+        maxpass = QOM_NPASSES;
+    *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
+    return _qom_uncrop(qm, n, _qom_readframe_PROGRESSIVE(qm, info->size-4, maxpass));
+}
+
+/*
+ * Pass the rows of frame n to func one at a time.  QOI frames are read 
+ * and decoded a chunk at a time, other encodings are decoded whole first.
+ */
+int qom_getframe_rows(qom *qm, int n, double *usec, qom_rowfunc func, void *arg)
+{
+    if((qm->mode == qomMODE_R) || (qm->mode == qomMODE_RW)) {
+        if(!_qom_checkframe(qm, n))
+            return 0;
+        qom_frameinfo *info = _qom_getframeinfo(qm, n);
+
+        _qom_seek(qm, info->offset, SEEK_SET);
+        int input_encoding = _qom_readint(qm);
+        if((input_encoding == qomENCODING_QOI) && !_qom_iscropped(qm, n)) {
+            *usec = gfx_64ToUsec(info->time_lo, info->time_hi);
+            return _qom_readrows_QOI(qm, info->size-4, func, arg);
+        }
+        gfx_canvas *c = qom_getframe(qm, n, usec);
+        if(!c)
+            return 0;
+        for(int y=0; y<c->sizey; y++)
+            func(arg, y, c->data+y*c->sizex, c->sizex);
+        gfx_canvas_free(c);
+        return 1;
+    } else {
+        fprintf(stderr, "qom: can't getframe from movie being written\n");
+        qm->error = qomERROR_GETFRAME_WHILE_WRITE;
+        return 0;
+    }
+}
+
+double qom_getduration(qom *qm) 
+{
+    return gfx_64ToUsec(qm->header.duration_lo, qm->header.duration_hi);
+}
+
+static int _qom_beginframe(qom *qm, int sizex, int sizey, double usec)
+{
+    if((qm->mode != qomMODE_W) && (qm->mode != qomMODE_RW)) {
+        fprintf(stderr, "qom: can't put a frame while reading a movie\n");
+        qm->error = qomERROR_PUTFRAME_WHILE_READ;
+        return 0;
+    }
+    if(qm->rowframe) {
+        fprintf(stderr, "qom: can't put a frame while writing rows\n");
+        qm->error = qomERROR_FORMAT;
+        return 0;
+    }
+    if(qm->segments && !_qom_nextsegment(qm))
+        return 0;
+    if(qm->header.nframes == 0) {
+        qm->header.sizex = sizex;
+        qm->header.sizey = sizey;
+        qm->offset = sizeof(qom_header);
+        qm->firstframe_usec = usec;
+    }
+    return 1;
+}
+
+static int _qom_writeframe(qom *qm, gfx_canvas *c, qom_frameside *side, int *encoding)
+{
+    int size;
+    *encoding = qm->output_encoding;
+    switch(qm->output_encoding) {
+        case qomENCODING_LITERAL:
+            _qom_writeint(qm, qomENCODING_LITERAL);
+            return 4 + _qom_writeframe_LITERAL(qm, c);
+        case qomENCODING_QOI:
+            _qom_writeint(qm, qomENCODING_QOI);
+            return 4 + _qom_writeframe_QOI(qm, c, side);
+        case qomENCODING_PNG:
+            _qom_writeint(qm, qomENCODING_PNG);
+            return 4 + _qom_writeframe_PNG(qm, c);
+        case qomENCODING_JPG:
+            _qom_writeint(qm, qomENCODING_JPG);
+            return 4 + _qom_writeframe_JPG(qm, c);
+        case qomENCODING_PALETTE:
+            size = _qom_writeframe_PALETTE(qm, c);
+            if(size>0)
+                return size;
+            *encoding = qomENCODING_QOI;
+            _qom_writeint(qm, qomENCODING_QOI);
+            return 4 + _qom_writeframe_QOI(qm, c, side);
+        case qomENCODING_PREDICT:
+            _qom_writeint(qm, qomENCODING_PREDICT);
+            return 4 + _qom_writeframe_PREDICT(qm, c);
+        case qomENCODING_PROGRESSIVE:
+            _qom_writeint(qm, qomENCODING_PROGRESSIVE);
+            return 4 + _qom_writeframe_PROGRESSIVE(qm, c);
+        case qomENCODING_RGB565:
+        case qomENCODING_RGBA4444:
+            _qom_writeint(qm, qm->output_encoding);
+            return 4 + _qom_writeframe_DEPTH16(qm, c, _qom_encodinglayout16(qm->output_encoding));
+        case qomENCODING_YUV420:
+            _qom_writeint(qm, qomENCODING_YUV420);
+            return 4 + _qom_writeframe_YUV420(qm, c);
+    }
+    fprintf(stderr, "qom: strange frame encoding %d\n", qm->output_encoding);
+    qm->error = qomERROR_FORMAT;
+    return 0;
+}
+
+static void _qom_endframe(qom *qm, int encoding, int sizex, int sizey, int size, double usec, double startput_usec, qom_frameside *side)
+{
+    double curframe_usec = usec-qm->firstframe_usec;
+    qom_frameinfo fi;
+    gfx_UsecTo64(curframe_usec, &fi.time_lo, &fi.time_hi);
+    fi.encoding = encoding;
+    fi.sizex = sizex;
+    fi.sizey = sizey;
+    fi.offset = qm->offset;
+    fi.size = size;
+    fi.encoding_usec = _qom_getusec()-startput_usec;
+    _qom_addframeinfo(qm, &fi, qm->header.nframes);
+    _qom_addframeside(qm, side, qm->header.nframes);
+
+    gfx_UsecTo64(curframe_usec, &qm->header.duration_lo, &qm->header.duration_hi);
+    qm->header.nframes++;
+    qm->offset += size;
+    _qom_syncframe(qm);
+}
+
+/* the part of c with alpha, or c itself if that is all of it */
+
+static gfx_canvas *_qom_cropframe(gfx_canvas *c, qom_frameside *side)
+{
+    int x0, y0, x1, y1;
+    if(!_qom_bbox(c->data, c->sizex, c->sizey, &x0, &y0, &x1, &y1)) {
+        x0 = 0;                         /* nothing to see, keep one transparent pixel */
+        y0 = 0;
+        x1 = 1;
+        y1 = 1;
+    }
+    if((x1-x0 == c->sizex) && (y1-y0 == c->sizey))
+        return c;
+    gfx_canvas *cc = gfx_canvas_new(x1-x0, y1-y0);
+    for(int y=y0; y<y1; y++)
+        memcpy(cc->data+(y-y0)*cc->sizex, c->data+y*c->sizex+x0, cc->sizex*sizeof(unsigned int));
+    side->cropx = x0;
+    side->cropy = y0;
+    side->fullsizex = c->sizex;
+    side->fullsizey = c->sizey;
+    return cc;
+}
+
+static void _qom_putcanvas(qom *qm, gfx_canvas *c, double usec, double startput_usec, qom_frameside *side)
+{
+    gfx_canvas *cc = qm->crop ? _qom_cropframe(c, side) : c;
+    int encoding;
+    int size = _qom_writeframe(qm, cc, side, &encoding);
+    if(size>0)
+        _qom_endframe(qm, encoding, cc->sizex, cc->sizey, size, usec, startput_usec, side);
+    if(cc != c)
+        gfx_canvas_free(cc);
+}
+
+void qom_putframe(qom *qm, gfx_canvas *c, double usec) 
+{
+    if(c->channels != 4) {
+        fprintf(stderr, "qom: can't put a %d channel canvas\n", c->channels);
+        qm->error = qomERROR_FORMAT;
+        return;
+    }
+    if(!_qom_beginframe(qm, c->sizex, c->sizey, usec))
+        return;
+    double startput_usec = _qom_getusec();
+    qom_frameside side;
+    side.restartrows = 0;
+    side.nrestarts = 0;
+    side.restarts = 0;
+    side.channels = 0;
+    side.tolerance = 0;
+    side.fullsizex = 0;
+    side.fullsizey = 0;
+    _qom_putcanvas(qm, c, usec, startput_usec, &side);
+}
+
+/*
+ * Write a frame a few rows at a time.  QOI frames are encoded as the rows 
+ * come in and written out 64K bytes at a time, so neither the frame nor 
+ * its encoding has to fit in memory.  Other encodings collect the rows in 
+ * a canvas and encode it at the end.
+ */
+typedef struct qom_rowframe {
+    _qom_rowencoder *re;
+    gfx_canvas *c;
+    qom_frameside side;
+    int format;
+    int sizex, sizey;
+    int y;
+    double usec;
+    double startput_usec;
+} qom_rowframe;
+
+void qom_putframe_begin(qom *qm, int sizex, int sizey, double usec)
+{
+    if(!_qom_beginframe(qm, sizex, sizey, usec))
+        return;
+    qom_rowframe *rf = (qom_rowframe *)malloc(sizeof(qom_rowframe));
+    rf->re = 0;
+    rf->c = 0;
+    rf->side.restartrows = 0;
+    rf->side.nrestarts = 0;
+    rf->side.restarts = 0;
+    rf->side.channels = 0;
+    rf->side.tolerance = 0;
+    rf->side.fullsizex = 0;
+    rf->side.fullsizey = 0;
+    rf->format = qm->input_format;
+    rf->sizex = sizex;
+    rf->sizey = sizey;
+    rf->y = 0;
+    rf->usec = usec;
+    rf->startput_usec = _qom_getusec();
+    if((qm->output_encoding == qomENCODING_QOI) && (qm->tolerance == 0) && !qm->crop) {
+        _qom_writeint(qm, qomENCODING_QOI);
+        int restartrows = _qom_restartrows(qm->restartrows, sizex);
+        rf->re = _qom_rowencoder_new(sizex, sizey, qm->input_format, restartrows, &rf->side, _qom_filesink(qm));
+    } else {
+        rf->c = gfx_canvas_new(sizex, sizey);
+    }
+    qm->rowframe = rf;
+}
+
+void qom_putframe_rows(qom *qm, const void *rows, int nrows)
+{
+    qom_rowframe *rf = qm->rowframe;
+    if(!rf) {
+        fprintf(stderr, "qom: putframe_rows without putframe_begin\n");
+        qm->error = qomERROR_FORMAT;
+        return;
+    }
+    if(rf->y+nrows > rf->sizey)
+        nrows = rf->sizey-rf->y;
+    if(rf->re)
+        _qom_rowencoder_rows(rf->re, rows, nrows);
+    else
+        _qom_torgba(rf->c->data+rf->y*rf->sizex, rows, nrows*rf->sizex, rf->format);
+    rf->y += nrows;
+}
+
+void qom_putframe_end(qom *qm)
+{
+    qom_rowframe *rf = qm->rowframe;
+    if(!rf) {
+        fprintf(stderr, "qom: putframe_end without putframe_begin\n");
+        qm->error = qomERROR_FORMAT;
+        return;
+    }
+    qm->rowframe = 0;
+    if(rf->re) {
+        if(rf->y < rf->sizey) {
+            fprintf(stderr, "qom: putframe_end after %d of %d rows\n", rf->y, rf->sizey);
+            unsigned int *row = (unsigned int *)calloc(rf->sizex, sizeof(unsigned int));   /* big enough for any format */
+            for(; rf->y<rf->sizey; rf->y++)
+                _qom_rowencoder_rows(rf->re, row, 1);
+            free(row);
+        }
+        int size = _qom_rowencoder_end(rf->re);
+        if(size == 0) {
+            fprintf(stderr, "qoiwriteframe error\n");
+            exit(1);
+        }
+        _qom_endframe(qm, qomENCODING_QOI, rf->sizex, rf->sizey, size+4, rf->usec, rf->startput_usec, &rf->side);
+    } else {
+        if(rf->y < rf->sizey)
+            memset(rf->c->data+rf->y*rf->sizex, 0, (rf->sizey-rf->y)*rf->sizex*sizeof(unsigned int));
+        _qom_putcanvas(qm, rf->c, rf->usec, rf->startput_usec, &rf->side);
+        gfx_canvas_free(rf->c);
+    }
+    free(rf);
+}
+
+void qom_putframenow(qom *qm, gfx_canvas *c) 
+{
+    qom_putframe(qm, c, _qom_getusec()); 
+}
+
+static const char *qom_encodingname(int encoding) 
+{
+    switch(encoding) {
+        case qomENCODING_LITERAL:
+            return "LIT";
+        case qomENCODING_QOI:
+            return "QOI";
+        case qomENCODING_PNG:
+            return "PNG";
+        case qomENCODING_JPG:
+            return "JPG";
+        case qomENCODING_PALETTE:
+            return "PAL";
+        case qomENCODING_PREDICT:
+            return "PRD";
+        case qomENCODING_PROGRESSIVE:
+            return "PRG";
+        case qomENCODING_RGB565:
+            return "565";
+        case qomENCODING_RGBA4444:
+            return "4444";
+        case qomENCODING_YUV420:
+            return "420";
+    }
+    return "strange....";
+}
+
+static const char *qom_startdirname(int startdir) 
+{
+    switch(startdir) {
+        case qomSTART_DIR_STILL:
+            return "STILL";
+        case qomSTART_DIR_INC:
+            return "FORWARD";
+        case qomSTART_DIR_DEC:
+            return "BACKWARD";
+    }
+    return "strange....";
+}
+
+static const char *qom_bouncename(int bounce) 
+{
+    switch(bounce) {
+        case qomBOUNCE_STOP:
+            return "STOP";
+        case qomBOUNCE_REV:
+            return "REVERSE";
+        case qomBOUNCE_CYCLE:
+            return "CYCLE";
+    }
+    return "strange....";
+}
+
+int qom_close(qom *qm) 
+{
+    if(qm->segments && (qm->mode == qomMODE_W)) {
+        if(qm->rowframe)
+            qom_putframe_end(qm);
+        if(qm->f)
+            _qom_endsegment(qm);
+    }
+    if(qm->f) {
+        if((qm->mode == qomMODE_W) || (qm->mode == qomMODE_RW)) {
+            if(qm->rowframe)
+                qom_putframe_end(qm);
+            _qom_writesides(qm);
+            _qom_writeframeinfo(qm);
+            _qom_seek(qm, 0, SEEK_SET);
+            _qom_writeheader(qm);
+            _qom_finishfile(qm);
+        }
+        fclose(qm->f);
+        qm->f = 0;
+    }
+    int error = qm->error;
+    _qom_free(qm);
+    return error;
+}
+
+int qom_geterror(qom *qm)
+{
+    return qm->error;
+}
+
+
+void qom_setoutputencoding(qom *qm, int encoding)
+{
+    qm->output_encoding = encoding;
+}
+
+int qom_getoutputencoding(qom *qm)
+{
+    return qm->output_encoding;
+}
+
+void qom_setrestartrows(qom *qm, int rows)
+{
+    qm->restartrows = rows;
+}
+
+int qom_getrestartrows(qom *qm)
+{
+    return qm->restartrows;
+}
+
+void qom_setthreads(qom *qm, int nthreads)
+{
+    if(nthreads<1)
+        nthreads = _qom_ncpus();
+    qm->nthreads = nthreads;
+}
+
+int qom_getthreads(qom *qm)
+{
+    return qm->nthreads;
+}
+
+void qom_setinputformat(qom *qm, int format)
+{
+    if((format<qomFORMAT_RGBA) || (format>qomFORMAT_BGRX)) {
+        fprintf(stderr, "qom: strange input format %d\n", format);
+        return;
+    }
+    qm->input_format = format;
+}
+
+int qom_getinputformat(qom *qm)
+{
+    return qm->input_format;
+}
+
+void qom_setoutputchannels(qom *qm, int channels)
+{
+    if((channels != 3) && (channels != 4)) {
+        fprintf(stderr, "qom: strange output channels %d\n", channels);
+        return;
+    }
+    qm->output_format = (channels == 3) ? qomFORMAT_RGB : qomFORMAT_RGBA;
+}
+
+int qom_getoutputchannels(qom *qm)
+{
+    return _qom_formatbytes(qm->output_format);
+}
+
+/* 
+ * The pixel format of the canvases from qom_getframe, one of the 3 or 4 
+ * byte formats.  qomFORMAT_RGB is the same as qom_setoutputchannels(qm, 3).
+ */
+void qom_setoutputformat(qom *qm, int format)
+{
+    if((format<qomFORMAT_RGBA) || (format>qomFORMAT_BGRA_PREMUL) || (format == qomFORMAT_ALPHA) || _qom_formatlayout16(format)) {
+        fprintf(stderr, "qom: strange output format %d\n", format);
+        return;
+    }
+    qm->output_format = format;
+}
+
+int qom_getoutputformat(qom *qm)
+{
+    return qm->output_format;
+}
+
+void qom_seteffort(qom *qm, int effort)
+{
+    if((effort != qomEFFORT_FAST) && (effort != qomEFFORT_HIGH)) {
+        fprintf(stderr, "qom: strange effort %d\n", effort);
+        return;
+    }
+    qm->effort = effort;
+}
+
+int qom_geteffort(qom *qm)
+{
+    return qm->effort;
+}
+
+/* QOI frames may be off by up to tolerance in R, G and B, 0 keeps them exact */
+
+void qom_settolerance(qom *qm, int tolerance)
+{
+    if((tolerance<0) || (tolerance>255)) {
+        fprintf(stderr, "qom: strange tolerance %d\n", tolerance);
+        return;
+    }
+    qm->tolerance = tolerance;
+}
+
+int qom_gettolerance(qom *qm)
+{
+    return qm->tolerance;
+}
+
+/* 
+ * Store frames cropped to the box around their pixels with alpha.  The 
+ * rest of the frame comes back as transparent black.
+ */
+void qom_setcrop(qom *qm, int crop)
+{
+    qm->crop = crop;
+}
+
+int qom_getcrop(qom *qm)
+{
+    return qm->crop;
+}
+
+/* ordered dithering for qomENCODING_RGB565 and RGBA4444, off by default */
+
+void qom_setdither(qom *qm, int dither)
+{
+    qm->dither = dither;
 }
 
-static const char *qom_startdirname(int startdir) 
+int qom_getdither(qom *qm)
 {
-    switch(startdir) {
-        case qomSTART_DIR_STILL:
-            return "STILL";
-        case qomSTART_DIR_INC:
-            return "FORWARD";
-        case qomSTART_DIR_DEC:
-            return "BACKWARD";
-    }
-    return "strange....";
+    return qm->dither;
 }
 
-static const char *qom_bouncename(int bounce) 
+/*
+ * Write through buffers of buffersize bytes that a thread writes out, or 
+ * through stdio if buffersize is 0.  Takes effect at once on a movie 
+ * being written.
+ */
+void qom_setwritebehind(qom *qm, int buffersize)
 {
-    switch(bounce) {
-        case qomBOUNCE_STOP:
-            return "STOP";
-        case qomBOUNCE_REV:
-            return "REVERSE";
-        case qomBOUNCE_CYCLE:
-            return "CYCLE";
-    }
-    return "strange....";
+    if(buffersize<0)
+        buffersize = 0;
+    if(qm->writer && (buffersize == 0))
+        _qom_writer_end(qm);
+    qm->writebehind = buffersize;
+    if(buffersize && !qm->writer && qm->f && (qm->mode == qomMODE_W))
+        _qom_writer_begin(qm);
 }
 
-int qom_close(qom *qm) 
+int qom_getwritebehind(qom *qm)
 {
-    if(qm->f) {
-        if((qm->mode == qomMODE_W) || (qm->mode == qomMODE_RW)) {
-            _qom_writeframeinfo(qm);
-            fseek(qm->f, 0, SEEK_SET);
-            _qom_writeheader(qm);
-        }
-        fclose(qm->f);
-        qm->f = 0;
-    }
-    int error = qm->error;
-    _qom_free(qm);
-    return error;
+    return qm->writebehind;
 }
 
-int qom_geterror(qom *qm)
+/* reserve bytes on disk for each file written, for the estimated size of the movie */
+
+void qom_setpreallocate(qom *qm, long bytes)
 {
-    return qm->error;
+    qm->preallocate = (bytes>0) ? bytes : 0;
+    if(qm->writer)
+        qm->writer->step = qm->preallocate;
+    else if(qm->preallocate && qm->f && (qm->mode == qomMODE_W))
+        _qom_preallocate(fileno(qm->f), 0, qm->preallocate);
 }
 
+long qom_getpreallocate(qom *qm)
+{
+    return qm->preallocate;
+}
 
-void qom_setoutputencoding(qom *qm, int encoding)
+void qom_setsync(qom *qm, int sync)
 {
-    qm->output_encoding = encoding;
+    qm->sync = (sync<qomSYNC_CLOSE) ? qomSYNC_CLOSE : sync;
 }
 
-int qom_getoutputencoding(qom *qm)
+int qom_getsync(qom *qm)
 {
-    return qm->output_encoding;
+    return qm->sync;
 }
 
 
@@ -862,12 +6393,84 @@ int qom_getrightbounce(qom *qm)
     return qm->header.default_rightbounce;
 }
 
+/*
+ * Code a few frames of the movie as QOI, PREDICT, PNG and YUV420, to see 
+ * which suits it.  YUV420 is lossy, the others are exact.  Times are for 
+ * one thread.
+ */
+#define _QOM_COMPARE_FRAMES     (4)
+
+static void _qom_printencodings(qom *qm)
+{
+    const char *names[] = { "QOI", "PREDICT fast", "PREDICT high", "PNG", "YUV420" };
+    double bytes[5] = { 0 };
+    double enc_usec[5] = { 0 };
+    double dec_usec[5] = { 0 };
+    int nframes = qom_getnframes(qm);
+    int step = (nframes+_QOM_COMPARE_FRAMES-1)/_QOM_COMPARE_FRAMES;
+    int nsampled = 0;
+    double totpixels = 0;
+    for(int i=0; i<nframes; i+=step) {
+        double usec;
+        gfx_canvas *c = _qom_getframe_rgba(qm, i, &usec);
+        if(!c)
+            return;
+        int sizex = c->sizex;
+        int sizey = c->sizey;
+        for(int e=0; e<5; e++) {
+            int len, dsizex, dsizey, n;
+            unsigned char *encoded;
+            qom_frameside side;
+            double t0 = _qom_getusec();
+            if(e == 0)
+                encoded = _qom_qoi_encode(c->data, sizex, sizey, qomFORMAT_RGBA, qomRESTART_NONE, 1, &side, &len);
+            else if(e == 3)
+                encoded = stbi_write_png_to_mem((unsigned char *)c->data, 4*sizex, sizex, sizey, 4, &len);
+            else if(e == 4)
+                encoded = _qom_yuv420_encode(c->data, sizex, sizey, &len);
+            else
+                encoded = _qom_predict_encode(c->data, sizex, sizey, (e == 1) ? qomEFFORT_FAST : qomEFFORT_HIGH, &len);
+            double t1 = _qom_getusec();
+            if(e == 0)
+                qom_free(_qom_qoi_decode(encoded, len, 0, 1, &dsizex, &dsizey));
+            else if(e == 3)
+                stbi_image_free(stbi_load_from_memory(encoded, len, &dsizex, &dsizey, &n, 4));
+            else if(e == 4) {
+                unsigned char *planes = _qom_yuv420_decode(encoded, len, &dsizex, &dsizey);
+                unsigned int *pixels = (unsigned int *)malloc(sizex*sizey*sizeof(unsigned int));
+                if(planes)
+                    _qom_yuv420_torgba(planes, dsizex, dsizey, pixels);
+                free(pixels);
+                free(planes);
+            } else
+                qom_free(_qom_predict_decode(encoded, len, &dsizex, &dsizey));
+            double t2 = _qom_getusec();
+            free(encoded);
+            bytes[e] += len;
+            enc_usec[e] += t1-t0;
+            dec_usec[e] += t2-t1;
+        }
+        totpixels += sizex*sizey;
+        gfx_canvas_free(c);
+        nsampled++;
+    }
+    if(nsampled == 0)
+        return;
+    double Mpix = totpixels/(1024.0*1024.0);
+    fprintf(stderr, "    Encodings compared on %d of %d frames (ratio, encode and decode Mpix per sec)\n", nsampled, nframes);
+    for(int e=0; e<5; e++)
+        fprintf(stderr, "        %-14s %8.4f %8.2f %8.2f\n", names[e], bytes[e]/(totpixels*4.0), 1000.0*1000.0*Mpix/enc_usec[e], 1000.0*1000.0*Mpix/dec_usec[e]);
+    fprintf(stderr, "\n");
+}
+
 void qom_print(qom *qm, const char *label) {
     fprintf(stderr, "\n");
     fprintf(stderr, "qom %s:\n", label);
     fprintf(stderr, "\n");
     fprintf(stderr, "    Size: %d x %d (of first frame)\n", qm->header.sizex, qm->header.sizey);
     fprintf(stderr, "    N frames: %d\n", qom_getnframes(qm));
+    if(qm->segments)
+        fprintf(stderr, "    N segments: %d\n", qm->segments->nsegs);
     fprintf(stderr, "    Duration: %f sec\n", gfx_64ToUsec(qm->header.duration_lo, qm->header.duration_hi)/(1000.0*1000.0));
     fprintf(stderr, "    Default\n");
     fprintf(stderr, "        Start time: %f sec\n", gfx_64ToUsec(qm->header.default_starttime_lo, qm->header.default_starttime_hi)/(1000.0*1000.0));
@@ -883,12 +6486,25 @@ void qom_print(qom *qm, const char *label) {
     int tot_CPU_usec = 0;
     int totpixels = 0;
     int totdata = 0;
+    int totrestarts = 0;
+    int totopaque = 0;
+    int totnear = 0;
+    int maxtolerance = 0;
+    int totcropped = 0;
+    double totfullpixels = 0;
     int nframes = qom_getnframes(qm);
     for(int i=0; i<nframes; i++) {
         qom_frameinfo *fi = _qom_getframeinfo(qm, i);
         totpixels += fi->sizex*fi->sizey;
         totdata += fi->size;
         tot_CPU_usec += fi->encoding_usec;
+        totrestarts += qm->sides[i].nrestarts;
+        totopaque += (qm->sides[i].channels == 3);
+        totnear += (qm->sides[i].tolerance>0);
+        totcropped += (qm->sides[i].fullsizex>0);
+        totfullpixels += (qm->sides[i].fullsizex>0) ? (double)qm->sides[i].fullsizex*qm->sides[i].fullsizey : fi->sizex*fi->sizey;
+        if(qm->sides[i].tolerance>maxtolerance)
+            maxtolerance = qm->sides[i].tolerance;
     }
     float totMpix = totpixels/(1024.0*1024.0);
     fprintf(stderr, "Summary\n");
@@ -897,9 +6513,113 @@ void qom_print(qom *qm, const char *label) {
     fprintf(stderr, "\n");
     fprintf(stderr, "    Compressed bytes: %d  Expanded bytes: %d\n", totdata, totpixels*4);
     fprintf(stderr, "    Compression ratio: %f\n", totdata/(totpixels*4.0));
+    fprintf(stderr, "    Restart points: %d\n", totrestarts);
+    fprintf(stderr, "    Opaque frames: %d\n", totopaque);
+    fprintf(stderr, "    Near-lossless frames: %d  tolerance: %d\n", totnear, maxtolerance);
+    fprintf(stderr, "    Cropped frames: %d  pixels stored: %f\n", totcropped, totpixels/totfullpixels);
+    fprintf(stderr, "\n");
+    if((qm->mode == qomMODE_R) || (qm->mode == qomMODE_RW))
+        _qom_printencodings(qm);
+}
+
+/*
+ * Time the generic qoi_decode and qoi_encode, plus a conversion pass for 
+ * formats other than RGBA and RGB, or the coders specialized for format.  
+ * pixels holds the frame in format.
+ */
+static double _qom_benchdecode(int specialized, const unsigned char *encoded, int len, int format, void *pixels, int sizex, int sizey)
+{
+    double t0 = _qom_getusec();
+    if(specialized) {
+        _qom_qoi_decodeinto(encoded, len, 0, 1, format, pixels, sizex, sizey);
+    } else {
+        qoi_desc desc;
+        void *decoded = qoi_decode(encoded, len, &desc, _qom_formatbytes(format));
+        if(format != qomFORMAT_RGB)
+            _qom_fromrgba(pixels, (unsigned int *)decoded, sizex*sizey, format);
+        QOI_FREE(decoded);
+    }
+    return _qom_getusec()-t0;
+}
+
+static double _qom_benchencode(int specialized, const void *pixels, int format, int sizex, int sizey)
+{
+    double t0 = _qom_getusec();
+    int len;
+    if(specialized) {
+        qom_frameside side;
+        free(_qom_qoi_encode(pixels, sizex, sizey, format, qomRESTART_NONE, 1, &side, &len));
+    } else {
+        qoi_desc desc;
+        desc.width = sizex;
+        desc.height = sizey;
+        desc.channels = _qom_formatbytes(format);
+        desc.colorspace = QOI_SRGB;
+        if(format != qomFORMAT_RGB) {
+            unsigned int *rgba = (unsigned int *)malloc(sizex*sizey*sizeof(unsigned int));
+            _qom_torgba(rgba, pixels, sizex*sizey, format);
+            QOI_FREE(qoi_encode(rgba, &desc, &len));
+            free(rgba);
+        } else {
+            QOI_FREE(qoi_encode(pixels, &desc, &len));
+        }
+    }
+    return _qom_getusec()-t0;
+}
+
+/* compare the generic and specialized coders, taking turns going first */
+
+static void _qom_codecbenchmark(qom *qm)
+{
+    int formats[] = { qomFORMAT_RGBA, qomFORMAT_BGRA, qomFORMAT_RGB, qomFORMAT_RGBX };
+    const char *names[] = { "RGBA", "BGRA", "RGB ", "RGBX" };
+    double usec[4][2][2];   /* format, decode or encode, generic or specialized */
+    memset(usec, 0, sizeof(usec));
+    double totpixels = 0;
+    int nframes = qom_getnframes(qm);
+    for(int i=0; i<nframes; i++) {
+        double frameusec;
+        gfx_canvas *c = qom_getframe(qm, i, &frameusec);
+        int npixels = c->sizex*c->sizey;
+        qoi_desc desc;
+        desc.width = c->sizex;
+        desc.height = c->sizey;
+        desc.channels = 4;
+        desc.colorspace = QOI_SRGB;
+        int len;
+        unsigned char *encoded = (unsigned char *)qoi_encode(c->data, &desc, &len);
+        unsigned char *pixels = (unsigned char *)malloc(npixels*4);
+        for(int f=0; f<4; f++) {
+            _qom_fromrgba(pixels, c->data, npixels, formats[f]);
+            for(int k=0; k<2; k++) {
+                int specialized = (i+k) & 1;
+                usec[f][0][specialized] += _qom_benchdecode(specialized, encoded, len, formats[f], pixels, c->sizex, c->sizey);
+                usec[f][1][specialized] += _qom_benchencode(specialized, pixels, formats[f], c->sizex, c->sizey);
+            }
+        }
+        free(pixels);
+        QOI_FREE(encoded);
+        totpixels += npixels;
+        gfx_canvas_free(c);
+    }
+    double totMpix = totpixels/(1024.0*1024.0);
+    fprintf(stderr, "Codec benchmark (Mpix per sec, generic/specialized):\n");
+    for(int f=0; f<4; f++) {
+        fprintf(stderr, "    %s  decode %8.2f %8.2f   encode %8.2f %8.2f\n", names[f], 
+            1000.0*1000.0*totMpix/usec[f][0][0], 1000.0*1000.0*totMpix/usec[f][0][1], 
+            1000.0*1000.0*totMpix/usec[f][1][0], 1000.0*1000.0*totMpix/usec[f][1][1]);
+    }
     fprintf(stderr, "\n");
 }
 
+static void _qom_freeframe(void *arg, int n, gfx_canvas *c, double usec)
+{
+    (void)arg;
+    (void)n;
+    (void)usec;
+    gfx_canvas_free(c);
+}
+
 void qom_readbenchmark(const char *filename) 
 {
     qom *qm = qom_open(filename, "r");
@@ -909,13 +6629,22 @@ void qom_readbenchmark(const char *filename)
     int nframes = qom_getnframes(qm);
     int totpixels = 0;
     int totdata = 0;
-    for(int i=0; i<nframes; i++) {
-        double usec;
-        gfx_canvas *c = qom_getframe(qm, i, &usec);
-        gfx_canvas_free(c);
-        qom_frameinfo *fi = _qom_getframeinfo(qm, i);
-        totpixels += fi->sizex*fi->sizey;
-        totdata += fi->size;
+    gfx_canvas *frames[8];
+    for(int i=0; i<nframes; i += 8) {
+        int n = (nframes-i<8) ? nframes-i : 8;
+        if(qom_getframes(qm, i, n, frames, 0) != n) {
+            fprintf(stderr, "qom_readbenchmark: %s: can't read frames %d to %d\n", filename, i, i+n-1);
+            for(int j=0; j<n; j++)
+                gfx_canvas_free(frames[j]);
+            qom_close(qm);
+            return;
+        }
+        for(int j=0; j<n; j++) {
+            gfx_canvas_free(frames[j]);
+            qom_frameinfo *fi = _qom_getframeinfo(qm, i+j);
+            totpixels += fi->sizex*fi->sizey;
+            totdata += fi->size;
+        }
     }
     int tot_CPU_usec = _qom_getusec()-t0;
     float totMpix = totpixels/(1024.0*1024.0);
@@ -928,7 +6657,732 @@ void qom_readbenchmark(const char *filename)
     fprintf(stderr, "    Compressed bytes: %d  Expanded bytes: %d\n", totdata, totpixels*4);
     fprintf(stderr, "    Compression ratio: %f\n", totdata/(totpixels*4.0));
     fprintf(stderr, "\n");
+    t0 = _qom_getusec();
+    qom_reader *r = qom_reader_new(16, 0, 0);
+    for(int i=0; i<nframes; i++)
+        qom_reader_getframe(r, qm, i, _qom_freeframe, 0);
+    qom_reader_free(r);
+    tot_CPU_usec = _qom_getusec()-t0;
+    fprintf(stderr, "    qom_reader with 16 reads in flight: %f sec  Mpix per sec %f\n", tot_CPU_usec/(1000.0*1000.0), 1000.0*1000.0*(totMpix/tot_CPU_usec));
+    fprintf(stderr, "\n");
+    _qom_codecbenchmark(qm);
+    qom_close(qm);
+}
+
+/* check the QOI coder against the reference qoi_decode and qoi_encode */
+
+typedef struct _qom_verifyframes {
+    gfx_canvas **frames;
+    double *usecs;
+} _qom_verifyframes;
+
+static void _qom_verifyframe(void *arg, int n, gfx_canvas *c, double usec)
+{
+    _qom_verifyframes *vf = (_qom_verifyframes *)arg;
+    vf->frames[n] = c;
+    vf->usecs[n] = usec;
+}
+
+static void _qom_verifyrow(void *arg, int y, const unsigned int *row, int sizex)
+{
+    gfx_canvas *c = (gfx_canvas *)arg;
+    if((y<c->sizey) && (sizex == c->sizex))
+        memcpy(c->data+y*sizex, row, sizex*sizeof(unsigned int));
+}
+
+static int _qom_samepixels(const void *a, const void *b, int sizex, int sizey, const char *what, int frameno)
+{
+    if(a && b && (memcmp(a, b, sizex*sizey*sizeof(unsigned int)) == 0))
+        return 1;
+    fprintf(stderr, "qom_verify: frame %d: %s differs\n", frameno, what);
+    return 0;
+}
+
+/*
+ * A one pixel wide frame fed a row at a time, built so that a run is 
+ * pending at the last row and the buffer is within a pixel of full: the 
+ * run byte plus the last pixel plus the padding must still fit.  The 
+ * count of RGBA and RGB pixels is swept so that one of the frames lands 
+ * on the boundary.
+ */
+static int _qom_verifyrunboundary(void)
+{
+    int nerrors = 0;
+    for(int nrgba=QOM_WRITE_CHUNK/5-12; nrgba<QOM_WRITE_CHUNK/5-2; nrgba++) {
+        for(int nrgb=0; nrgb<5; nrgb++) {
+            int sizey = nrgba+nrgb+2;
+            qoi_rgba_t *px = (qoi_rgba_t *)malloc(sizey*sizeof(qoi_rgba_t));
+            int n = 0;
+            for(int i=0; i<nrgba; i++, n++) {           /* QOI_OP_RGBA, alpha changes */
+                px[n].rgba.r = i;
+                px[n].rgba.g = i>>8;
+                px[n].rgba.b = 0;
+                px[n].rgba.a = 254+(i&1);
+            }
+            for(int i=0; i<nrgb; i++, n++) {            /* QOI_OP_RGB, same alpha */
+                px[n] = px[n-1];
+                px[n].rgba.g += 128;
+                px[n].rgba.b = 200+i;
+            }
+            px[n] = px[n-1];                            /* starts a run */
+            n++;
+            px[n] = px[n-1];                            /* ends it, QOI_OP_RGBA */
+            px[n].rgba.b = 100;
+            px[n].rgba.a ^= 1;
+
+            qoi_desc desc;
+            desc.width = 1;
+            desc.height = sizey;
+            desc.channels = 4;
+            desc.colorspace = QOI_SRGB;
+            int ref_len;
+            unsigned char *ref_encoded = (unsigned char *)qoi_encode(px, &desc, &ref_len);
+            _qom_membuf mb;
+            mb.bytes = 0;
+            mb.size = 0;
+            mb.alloc = 0;
+            _qom_sink sink;
+            sink.write = _qom_memwrite;
+            sink.arg = &mb;
+            qom_frameside side;
+            _qom_rowencoder *re = _qom_rowencoder_new(1, sizey, qomFORMAT_RGBA, qomRESTART_NONE, &side, sink);
+            for(int y=0; y<sizey; y++)
+                _qom_rowencoder_rows(re, px+y, 1);
+            if((_qom_rowencoder_end(re) != ref_len) || memcmp(mb.bytes, ref_encoded, ref_len)) {
+                fprintf(stderr, "qom_verify: run across the last rows: %d pixels differ from qoi_encode\n", sizey);
+                nerrors++;
+            }
+            _qom_freeside(&side);
+            free(mb.bytes);
+            QOI_FREE(ref_encoded);
+            free(px);
+        }
+    }
+    return nerrors;
+}
+
+/* the restart points of frame i, and a decode from them on 4 threads */
+
+static int _qom_verifyrestarts(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    if(qm->sides[i].nrestarts>0) {
+        if(!_qom_restartsvalid(qm->sides+i, qm->frames[i].size-4, qm->frames[i].sizex, qm->frames[i].sizey)) {
+            fprintf(stderr, "qom_verify: frame %d: bad restart points\n", i);
+            nerrors++;
+        }
+        qom_setthreads(qm, 4);
+        gfx_canvas *cp = qom_getframe(qm, i, &usec);
+        nerrors += !_qom_samepixels(c->data, cp->data, sizex, sizey, "restart point decode", i);
+        gfx_canvas_free(cp);
+    }
+    return nerrors;
+}
+
+/* qom_getframe_rows gives the rows of frame i */
+
+static int _qom_verifyrowdecode(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    gfx_canvas *cr = gfx_canvas_new(sizex, sizey);
+    memset(cr->data, 0, sizex*sizey*sizeof(unsigned int));
+    qom_getframe_rows(qm, i, &usec, _qom_verifyrow, cr);
+    nerrors += !_qom_samepixels(c->data, cr->data, sizex, sizey, "row decode", i);
+    gfx_canvas_free(cr);
+    return nerrors;
+}
+
+/* the row encoder codes frame i as qoi_encode does */
+
+static int _qom_verifyrowencode(int i, gfx_canvas *c, const unsigned char *ref_encoded, int ref_len)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    _qom_membuf mb;
+    mb.bytes = 0;
+    mb.size = 0;
+    mb.alloc = 0;
+    _qom_sink sink;
+    sink.write = _qom_memwrite;
+    sink.arg = &mb;
+    qom_frameside rowside;
+    _qom_rowencoder *re = _qom_rowencoder_new(sizex, sizey, qomFORMAT_RGBA, qomRESTART_NONE, &rowside, sink);
+    for(int y=0; y<sizey; y++)
+        _qom_rowencoder_rows(re, c->data+y*sizex, 1);
+    if((_qom_rowencoder_end(re) != ref_len) || memcmp(mb.bytes, ref_encoded, ref_len)) {
+        fprintf(stderr, "qom_verify: frame %d: row encoding differs from qoi_encode\n", i);
+        nerrors++;
+    }
+    free(mb.bytes);
+    return nerrors;
+}
+
+/* the opaque mark, alpha plane and 3 channel canvas of frame i */
+
+static int _qom_verifyopaque(qom *qm, int i, gfx_canvas *c, const unsigned char *ref_encoded, int ref_len)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    if(qom_getframe_opaque(qm, i)) {
+        if(!_qom_isopaque(c->data, sizex*sizey)) {
+            fprintf(stderr, "qom_verify: frame %d: marked opaque but has alpha\n", i);
+            nerrors++;
+        }
+        int len;
+        qom_frameside side;
+        unsigned char *encoded = _qom_qoi_encode(c->data, sizex, sizey, qomFORMAT_RGBX, qomRESTART_NONE, 1, &side, &len);
+        if((len != ref_len) || (encoded[12] != 3) || memcmp(encoded, ref_encoded, 12) || memcmp(encoded+13, ref_encoded+13, len-13)) {
+            fprintf(stderr, "qom_verify: frame %d: opaque encoding differs from qoi_encode\n", i);
+            nerrors++;
+        }
+        free(encoded);
+    } else {
+        unsigned char *alpha;
+        unsigned char *ref = (unsigned char *)malloc(sizex*sizey);
+        _qom_fromrgba(ref, c->data, sizex*sizey, qomFORMAT_ALPHA);
+        if(!qom_getframe_alpha(qm, i, &alpha) || !alpha || memcmp(alpha, ref, sizex*sizey)) {
+            fprintf(stderr, "qom_verify: frame %d: alpha plane differs\n", i);
+            nerrors++;
+        }
+        free(ref);
+        free(alpha);
+    }
+    qom_setoutputchannels(qm, 3);
+    gfx_canvas *c3 = qom_getframe(qm, i, &usec);
+    qom_setoutputchannels(qm, 4);
+    unsigned char *rgb = (unsigned char *)malloc(sizex*sizey*3);
+    _qom_fromrgba(rgb, c->data, sizex*sizey, qomFORMAT_RGB);
+    if(!c3 || (c3->channels != 3) || memcmp(c3->data, rgb, sizex*sizey*3)) {
+        fprintf(stderr, "qom_verify: frame %d: 3 channel canvas differs\n", i);
+        nerrors++;
+    }
+    free(rgb);
+    gfx_canvas_free(c3);
+    return nerrors;
+}
+
+/* the palette and indices of a PALETTE frame */
+
+static int _qom_verifyindexed(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    if((qm->frames[i].encoding == qomENCODING_PALETTE) && !_qom_iscropped(qm, i)) {
+        unsigned char *indices;
+        unsigned int palette[QOM_PALETTE_COLORS];
+        int ncolors;
+        gfx_canvas *ci = gfx_canvas_new(sizex, sizey);
+        if(qom_getframe_indexed(qm, i, &usec, &indices, palette, &ncolors)) {
+            _qom_palette_expand(ci->data, indices, sizex*sizey, palette);
+            free(indices);
+        }
+        nerrors += !_qom_samepixels(c->data, ci->data, sizex, sizey, "indexed decode", i);
+        gfx_canvas_free(ci);
+    }
+    return nerrors;
+}
+
+/* the bounding box of frame i and the frame as it was cropped */
+
+static int _qom_verifycrop(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    int x0 = sizex;
+    int y0 = sizey;
+    int x1 = 0;
+    int y1 = 0;
+    for(int y=0; y<sizey; y++) {
+        for(int x=0; x<sizex; x++) {
+            if(_qom_rowvisible(c->data+y*sizex+x, 1)) {
+                x0 = (x<x0) ? x : x0;
+                y0 = (y<y0) ? y : y0;
+                x1 = (x>=x1) ? x+1 : x1;
+                y1 = (y>=y1) ? y+1 : y1;
+            }
+        }
+    }
+    int bx0, by0, bx1, by1;
+    if(!_qom_bbox(c->data, sizex, sizey, &bx0, &by0, &bx1, &by1)) {
+        bx0 = sizex;
+        by0 = sizey;
+        bx1 = 0;
+        by1 = 0;
+    }
+    if((bx0 != x0) || (by0 != y0) || (bx1 != x1) || (by1 != y1)) {
+        fprintf(stderr, "qom_verify: frame %d: bounding box differs\n", i);
+        nerrors++;
+    }
+    int cropx, cropy;
+    gfx_canvas *cc = qom_getframe_cropped(qm, i, &usec, &cropx, &cropy);
+    int bad = !cc || (cropx+cc->sizex>sizex) || (cropy+cc->sizey>sizey);
+    for(int y=0; !bad && (y<sizey); y++) {
+        for(int x=0; x<sizex; x++) {
+            int inside = (x>=cropx) && (x<cropx+cc->sizex) && (y>=cropy) && (y<cropy+cc->sizey);
+            bad |= (c->data[y*sizex+x] != (inside ? cc->data[(y-cropy)*cc->sizex+x-cropx] : 0));
+        }
+    }
+    if(bad) {
+        fprintf(stderr, "qom_verify: frame %d: cropped frame differs\n", i);
+        nerrors++;
+    }
+    gfx_canvas_free(cc);
+    return nerrors;
+}
+
+/* progressive coding of frame i, decoded from a few passes and read back */
+
+static int _qom_verifyprogressive(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    int len, sizes[QOM_NPASSES];
+    unsigned char *prog = _qom_adam7_encode(c->data, sizex, sizey, &len);
+    for(int npasses=1; npasses<=QOM_NPASSES; npasses+=3) {
+        int psizex, psizey;
+        int need = _qom_adam7_head(prog, len, npasses, &psizex, &psizey, sizes);
+        unsigned int *pixels = _qom_adam7_decode(prog, need, npasses, &psizex, &psizey);
+        int bad = !pixels || (psizex != sizex) || (psizey != sizey);
+        int bx = _qom_adam7block[npasses-1][0];
+        int by = _qom_adam7block[npasses-1][1];
+        for(int y=0; !bad && (y<sizey); y++) {
+            for(int x=0; x<sizex; x++)
+                bad |= (pixels[y*sizex+x] != c->data[(y-y%by)*sizex+x-x%bx]);
+        }
+        if(bad) {
+            fprintf(stderr, "qom_verify: frame %d: progressive decode of %d passes differs\n", i, npasses);
+            nerrors++;
+        }
+        qom_free(pixels);
+    }
+    free(prog);
+    if(qm->frames[i].encoding == qomENCODING_PROGRESSIVE) {
+        gfx_canvas *cp = qom_getframe_progressive(qm, i, &usec, QOM_NPASSES);
+        nerrors += !_qom_samepixels(c->data, cp->data, sizex, sizey, "progressive read", i);
+        gfx_canvas_free(cp);
+    }
+    return nerrors;
+}
+
+/* near-lossless coding of frame i stays within its tolerance */
+
+static int _qom_verifynearlossless(int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    qoi_desc desc;
+    int tolerances[] = { 1, 4 };
+    for(int t=0; t<2; t++) {
+        unsigned int *near = (unsigned int *)malloc(sizex*sizey*sizeof(unsigned int));
+        _qom_nearlossless(near, c->data, sizex*sizey, tolerances[t]);
+        int len;
+        qom_frameside side;
+        unsigned char *encoded = _qom_qoi_encode(near, sizex, sizey, qomFORMAT_RGBA, qomRESTART_NONE, 1, &side, &len);
+        qoi_rgba_t *pixels = (qoi_rgba_t *)qoi_decode(encoded, len, &desc, 4);
+        qoi_rgba_t *orig = (qoi_rgba_t *)c->data;
+        int bad = !pixels;
+        for(int p=0; !bad && (p<sizex*sizey); p++)
+            bad = (pixels[p].v != near[p]) || !_qom_within(orig[p], pixels[p], tolerances[t]);
+        if(bad) {
+            fprintf(stderr, "qom_verify: frame %d: near-lossless coding off by more than %d\n", i, tolerances[t]);
+            nerrors++;
+        }
+        QOI_FREE(pixels);
+        free(encoded);
+        free(near);
+    }
+    return nerrors;
+}
+
+/* frame i round trips through predictive coding */
+
+static int _qom_verifypredict(int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    int efforts[] = { qomEFFORT_FAST, qomEFFORT_HIGH };
+    for(int e=0; e<2; e++) {
+        int len, psizex, psizey;
+        unsigned char *encoded = _qom_predict_encode(c->data, sizex, sizey, efforts[e], &len);
+        unsigned int *pixels = _qom_predict_decode(encoded, len, &psizex, &psizey);
+        if(!pixels || (psizex != sizex) || (psizey != sizey)) {
+            fprintf(stderr, "qom_verify: frame %d: predict round trip failed\n", i);
+            nerrors++;
+        } else {
+            nerrors += !_qom_samepixels(c->data, pixels, sizex, sizey, "predict round trip", i);
+        }
+        qom_free(pixels);
+        free(encoded);
+    }
+    return nerrors;
+}
+
+/* frame i with fewer colors round trips through palette coding */
+
+static int _qom_verifypalette(int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    unsigned int masks[] = { 0xc0c0c0c0, 0x80808080 };     /* at most 256 and 16 colors */
+    for(int m=0; m<2; m++) {
+        gfx_canvas *cq = gfx_canvas_new(sizex, sizey);
+        for(int p=0; p<sizex*sizey; p++)
+            cq->data[p] = c->data[p] & masks[m];
+        int len, psizex, psizey, ncolors;
+        unsigned int palette[QOM_PALETTE_COLORS];
+        unsigned char *encoded = _qom_palette_encode(cq->data, sizex, sizey, &len);
+        unsigned char *indices = encoded ? _qom_palette_decode(encoded, len, &psizex, &psizey, palette, &ncolors) : 0;
+        if(!indices || (psizex != sizex) || (psizey != sizey)) {
+            fprintf(stderr, "qom_verify: frame %d: palette round trip failed\n", i);
+            nerrors++;
+        } else {
+            gfx_canvas *cp = gfx_canvas_new(sizex, sizey);
+            _qom_palette_expand(cp->data, indices, sizex*sizey, palette);
+            nerrors += !_qom_samepixels(cq->data, cp->data, sizex, sizey, "palette round trip", i);
+            gfx_canvas_free(cp);
+        }
+        free(indices);
+        free(encoded);
+        gfx_canvas_free(cq);
+    }
+    return nerrors;
+}
+
+/* the YUV420 planes of frame i */
+
+static int _qom_verifyyuv420(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    int len, psizex, psizey, cx, cy;
+    _qom_yuv420_planesize(sizex, sizey, &cx, &cy);
+    unsigned char *ref = (unsigned char *)malloc(sizex*sizey + 2*cx*cy);
+    _qom_yuv420_fromrgba(c->data, sizex, sizey, ref);
+    unsigned char *encoded = _qom_yuv420_encode(c->data, sizex, sizey, &len);
+    unsigned char *planes = _qom_yuv420_decode(encoded, len, &psizex, &psizey);
+    if(!planes || (psizex != sizex) || (psizey != sizey) || memcmp(ref, planes, sizex*sizey + 2*cx*cy)) {
+        fprintf(stderr, "qom_verify: frame %d: YUV420 planes differ\n", i);
+        nerrors++;
+    }
+    free(planes);
+    free(encoded);
+    if((qm->frames[i].encoding == qomENCODING_YUV420) && !_qom_iscropped(qm, i)) {
+        planes = qom_getframe_planes(qm, i, &usec, &psizex, &psizey);
+        gfx_canvas *cp = gfx_canvas_new(psizex, psizey);
+        _qom_yuv420_torgba(planes, psizex, psizey, cp->data);
+        nerrors += !_qom_samepixels(c->data, cp->data, sizex, sizey, "YUV420 planes", i);
+        gfx_canvas_free(cp);
+        free(planes);
+    }
+    free(ref);
+    return nerrors;
+}
+
+/* frame i decoded to the premultiplied formats */
+
+static int _qom_verifypremul(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    int premul[] = { qomFORMAT_RGBA_PREMUL, qomFORMAT_BGRA_PREMUL };
+    for(int f=0; f<2; f++) {
+        gfx_canvas *ref = gfx_canvas_new(sizex, sizey);
+        for(int k=0; k<sizex*sizey; k++) {
+            unsigned char *s = (unsigned char *)(c->data+k);
+            unsigned char *d = (unsigned char *)(ref->data+k);
+            int r = f ? 2 : 0;
+            d[r] = (s[0]*s[3]+127)/255;
+            d[1] = (s[1]*s[3]+127)/255;
+            d[2-r] = (s[2]*s[3]+127)/255;
+            d[3] = s[3];
+        }
+        qom_setoutputformat(qm, premul[f]);
+        gfx_canvas *cp = qom_getframe(qm, i, &usec);
+        qom_setoutputformat(qm, qomFORMAT_RGBA);
+        if(!cp || (cp->sizex != sizex) || (cp->sizey != sizey) || memcmp(ref->data, cp->data, sizex*sizey*4)) {
+            fprintf(stderr, "qom_verify: frame %d: decode to premultiplied format %d differs\n", i, premul[f]);
+            nerrors++;
+        }
+        if(cp)
+            gfx_canvas_free(cp);
+        gfx_canvas_free(ref);
+    }
+    return nerrors;
+}
+
+/* frame i decoded to and coded in the 16 bit formats */
+
+static int _qom_verifydepth16(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    int formats16[] = { qomFORMAT_RGB565, qomFORMAT_RGBA4444 };
+    for(int f=0; f<2; f++) {
+        const _qom_layout16 *l = _qom_formatlayout16(formats16[f]);
+        int stride = sizex+3;
+        unsigned short *ref = (unsigned short *)malloc(sizex*sizey*sizeof(unsigned short));
+        unsigned short *got = (unsigned short *)malloc(stride*sizey*sizeof(unsigned short));
+        _qom_fromrgba(ref, c->data, sizex*sizey, formats16[f]);
+        qom_getframe_format(qm, i, &usec, got, formats16[f]);
+        if(memcmp(ref, got, sizex*sizey*sizeof(unsigned short))) {
+            fprintf(stderr, "qom_verify: frame %d: decode to format %d differs\n", i, formats16[f]);
+            nerrors++;
+        }
+        for(int dither=0; dither<2; dither++) {
+            int len;
+            unsigned char *encoded = _qom_depth16_encode(c->data, sizex, sizey, l, dither, &len);
+            _qom_quant16 *qt = _qom_quant16_new(l, dither);
+            int ok = _qom_depth16_decodeinto(encoded, len, l, got, stride);
+            for(int y=0; ok && (y<sizey); y++) {
+                _qom_quant16_row(qt, ref, c->data+y*sizex, sizex, y);
+                ok = !memcmp(ref, got+y*stride, sizex*sizeof(unsigned short));
+            }
+            if(!ok) {
+                fprintf(stderr, "qom_verify: frame %d: 16 bit round trip of format %d dither %d differs\n", i, formats16[f], dither);
+                nerrors++;
+            }
+            free(qt);
+            free(encoded);
+        }
+        free(got);
+        free(ref);
+    }
+    return nerrors;
+}
+
+/* frame i decoded to and coded from the other byte formats */
+
+static int _qom_verifyformats(qom *qm, int i, gfx_canvas *c)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    double usec;
+    qoi_desc desc;
+    int formats[] = { qomFORMAT_BGRA, qomFORMAT_RGB, qomFORMAT_RGBX, qomFORMAT_BGRX };
+    for(int f=0; f<4; f++) {
+        int bpp = _qom_formatbytes(formats[f]);
+        unsigned char *ref = (unsigned char *)malloc(sizex*sizey*bpp);
+        unsigned char *got = (unsigned char *)malloc(sizex*sizey*bpp);
+        _qom_fromrgba(ref, c->data, sizex*sizey, formats[f]);
+        qom_getframe_format(qm, i, &usec, got, formats[f]);
+        if(memcmp(ref, got, sizex*sizey*bpp)) {
+            fprintf(stderr, "qom_verify: frame %d: decode to format %d differs\n", i, formats[f]);
+            nerrors++;
+        }
+        int len;
+        qom_frameside side;
+        unsigned char *encoded = _qom_qoi_encode(ref, sizex, sizey, formats[f], qomRESTART_NONE, 1, &side, &len);
+        unsigned int *pixels = (unsigned int *)qoi_decode(encoded, len, &desc, 4);
+        if(pixels) 
+            _qom_fromrgba(got, pixels, sizex*sizey, formats[f]);
+        if(!pixels || memcmp(ref, got, sizex*sizey*bpp)) {
+            fprintf(stderr, "qom_verify: frame %d: encode from format %d differs\n", i, formats[f]);
+            nerrors++;
+        }
+        QOI_FREE(pixels);
+        free(encoded);
+        free(got);
+        free(ref);
+    }
+    return nerrors;
+}
+
+/* frame i coded in stripes on 1 and 4 threads */
+
+static int _qom_verifystripes(int i, gfx_canvas *c, const unsigned char *ref_encoded, int ref_len)
+{
+    int nerrors = 0;
+    int sizex = c->sizex;
+    int sizey = c->sizey;
+    qoi_desc desc;
+    int restartrows[] = { qomRESTART_NONE, 1, 7, qomRESTART_AUTO };
+    int nthreads[] = { 1, 4 };
+    for(int r=0; r<(int)(sizeof(restartrows)/sizeof(int)); r++) {
+        for(int t=0; t<(int)(sizeof(nthreads)/sizeof(int)); t++) {
+            qom_frameside side;
+            int len;
+            int rows = _qom_restartrows(restartrows[r], sizex);
+            unsigned char *encoded = _qom_qoi_encode(c->data, sizex, sizey, qomFORMAT_RGBA, rows, nthreads[t], &side, &len);
+            if(nthreads[t] == 1) {
+                if((len != ref_len) || memcmp(encoded, ref_encoded, len)) {
+                    fprintf(stderr, "qom_verify: frame %d: encoding differs from qoi_encode\n", i);
+                    nerrors++;
+                }
+            }
+            unsigned int *pixels = (unsigned int *)qoi_decode(encoded, len, &desc, 4);
+            nerrors += !_qom_samepixels(c->data, pixels, sizex, sizey, "qoi_decode of stripe encoding", i);
+            QOI_FREE(pixels);
+            if(side.nrestarts>0) {
+                int psizex, psizey;
+                if(!_qom_restartsvalid(&side, len, sizex, sizey)) {
+                    fprintf(stderr, "qom_verify: frame %d: bad restart points in stripe encoding\n", i);
+                    nerrors++;
+                }
+                pixels = _qom_qoi_decode(encoded, len, &side, 4, &psizex, &psizey);
+                nerrors += !_qom_samepixels(c->data, pixels, sizex, sizey, "restart point decode of stripe encoding", i);
+                qom_free(pixels);
+            }
+            _qom_freeside(&side);
+            free(encoded);
+        }
+    }
+    return nerrors;
+}
+
+/* batched reads, in runs that don't line up with anything */
+
+static int _qom_verifybatch(qom *qm)
+{
+    int nerrors = 0;
+    int nframes = qom_getnframes(qm);
+    qom_setthreads(qm, 4);
+    for(int i=0; i<nframes; i += 7) {
+        gfx_canvas *frames[7];
+        double usecs[7];
+        int n = (nframes-i<7) ? nframes-i : 7;
+        if(qom_getframes(qm, i, n, frames, usecs) != n) {
+            fprintf(stderr, "qom_verify: frames %d to %d: qom_getframes failed\n", i, i+n-1);
+            nerrors++;
+            for(int j=0; j<n; j++)
+                gfx_canvas_free(frames[j]);
+            continue;
+        }
+        for(int j=0; j<n; j++) {
+            double usec;
+            gfx_canvas *c = qom_getframe(qm, i+j, &usec);
+            if((usec != usecs[j]) || (c->sizex != frames[j]->sizex) || (c->sizey != frames[j]->sizey)) {
+                fprintf(stderr, "qom_verify: frame %d: qom_getframes differs\n", i+j);
+                nerrors++;
+            } else {
+                nerrors += !_qom_samepixels(c->data, frames[j]->data, c->sizex, c->sizey, "qom_getframes", i+j);
+            }
+            gfx_canvas_free(c);
+            gfx_canvas_free(frames[j]);
+        }
+    }
+    return nerrors;
+}
+
+/* through a qom_reader, with O_DIRECT where it works */
+
+static int _qom_verifyreader(qom *qm, const char *filename)
+{
+    int nerrors = 0;
+    int nframes = qom_getnframes(qm);
+    gfx_canvas **frames = (gfx_canvas **)calloc(nframes, sizeof(gfx_canvas *));
+    double *usecs = (double *)calloc(nframes, sizeof(double));
+    qom_reader *r = qom_reader_new(4, 2, qomREADER_DIRECT);
+    _qom_verifyframes vf;
+    vf.frames = frames;
+    vf.usecs = usecs;
+    for(int i=nframes-1; i>=0; i--)
+        qom_reader_getframe(r, qm, i, _qom_verifyframe, &vf);
+    qom_reader_free(r);
+#ifdef __linux__
+    if(!qm->mem && !qm->segments && !qm->fddirect) {
+#ifdef _qom_O_DIRECT
+        int fd = open(filename, O_RDONLY | _qom_O_DIRECT);
+        if((fd >= 0) || (errno != EINVAL)) {
+            fprintf(stderr, "qom_verify: qom_reader didn't read with O_DIRECT\n");
+            nerrors++;
+        }
+        if(fd >= 0)
+            close(fd);
+#else
+        fprintf(stderr, "qom_verify: built without O_DIRECT\n");
+        nerrors++;
+#endif
+    }
+#endif
+    for(int i=0; i<nframes; i++) {
+        double usec;
+        gfx_canvas *c = qom_getframe(qm, i, &usec);
+        if(!frames[i] || (usec != usecs[i]) || (c->sizex != frames[i]->sizex) || (c->sizey != frames[i]->sizey)) {
+            fprintf(stderr, "qom_verify: frame %d: qom_reader differs\n", i);
+            nerrors++;
+        } else {
+            nerrors += !_qom_samepixels(c->data, frames[i]->data, c->sizex, c->sizey, "qom_reader", i);
+        }
+        gfx_canvas_free(c);
+        gfx_canvas_free(frames[i]);
+    }
+    free(frames);
+    free(usecs);
+    return nerrors;
+}
+
+int qom_verify(const char *filename)
+{
+    qom *qm = qom_open(filename, "r");
+    if(!qm)
+        exit(1);
+    int nerrors = 0;
+    int nframes = qom_getnframes(qm);
+    for(int i=0; i<nframes; i++) {
+        double usec;
+        qom_setthreads(qm, 1);
+        gfx_canvas *c = qom_getframe(qm, i, &usec);
+        if(!c) {
+            nerrors++;
+            continue;
+        }
+        qoi_desc desc;
+        desc.width = c->sizex;
+        desc.height = c->sizey;
+        desc.channels = 4;
+        desc.colorspace = QOI_SRGB;
+        int ref_len;
+        unsigned char *ref_encoded = (unsigned char *)qoi_encode(c->data, &desc, &ref_len);
+
+        nerrors += _qom_verifyrestarts(qm, i, c);
+        nerrors += _qom_verifyrowdecode(qm, i, c);
+        nerrors += _qom_verifyrowencode(i, c, ref_encoded, ref_len);
+        nerrors += _qom_verifyopaque(qm, i, c, ref_encoded, ref_len);
+        nerrors += _qom_verifyindexed(qm, i, c);
+        nerrors += _qom_verifycrop(qm, i, c);
+        nerrors += _qom_verifyprogressive(qm, i, c);
+        nerrors += _qom_verifynearlossless(i, c);
+        nerrors += _qom_verifypredict(i, c);
+        nerrors += _qom_verifypalette(i, c);
+        nerrors += _qom_verifyyuv420(qm, i, c);
+        nerrors += _qom_verifypremul(qm, i, c);
+        nerrors += _qom_verifydepth16(qm, i, c);
+        nerrors += _qom_verifyformats(qm, i, c);
+        nerrors += _qom_verifystripes(i, c, ref_encoded, ref_len);
+        QOI_FREE(ref_encoded);
+        gfx_canvas_free(c);
+    }
+    nerrors += _qom_verifybatch(qm);
+    nerrors += _qom_verifyreader(qm, filename);
+    nerrors += _qom_verifyrunboundary();
+    fprintf(stderr, "qom_verify %s: %d frames  %d errors\n", filename, nframes, nerrors);
     qom_close(qm);
+    return nerrors;
 }
 
 #endif /* QOM_IMPLEMENTATION */
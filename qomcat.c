@@ -44,6 +44,8 @@ Builds on top of Dominic Szablewski's QOI libary to store sequences of images.
 #define QOM_IMPLEMENTATION
 #include "qom.h"
 
+#define NBATCH          (8)         /* frames read at a time */
+
 int main(int argc, char **argv) 
 { 
     if(argc<3) {
@@ -53,11 +55,19 @@ int main(int argc, char **argv)
     qom *qm_out = qom_open(argv[argc-1], "w");
     for(int argp = 1; argp<argc-1; argp++) {
         qom *qm_in = qom_open(argv[argp], "r");
-        for(int frameno = 0; frameno < qom_getnframes(qm_in); frameno++) {
-            double usec;
-            gfx_canvas *c = qom_getframe(qm_in, frameno, &usec);
-            qom_putframe(qm_out, c, usec);
-            gfx_canvas_free(c);
+        for(int frameno = 0; frameno < qom_getnframes(qm_in); frameno += NBATCH) {
+            gfx_canvas *frames[NBATCH];
+            double usecs[NBATCH];
+            int nbatch = qom_getnframes(qm_in)-frameno;
+            int n = (nbatch<NBATCH) ? nbatch : NBATCH;
+            if(qom_getframes(qm_in, frameno, n, frames, usecs) != n) {
+                fprintf(stderr, "qomcat: %s: can't read frames %d to %d\n", argv[argp], frameno, frameno+n-1);
+                exit(1);
+            }
+            for(int i=0; i<n; i++) {
+                qom_putframe(qm_out, frames[i], usecs[i]);
+                gfx_canvas_free(frames[i]);
+            }
         }
         qom_close(qm_in);
     }
@@ -3,6 +3,7 @@
 #include "math.h"
 #include "unistd.h"
 #include "string.h"
+#include "ctype.h"
 #include <sys/time.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -70,7 +71,200 @@ void qom_randseg(qom *qm_in, qom *qm_out, int nframes)
     qom_trim(qm_in, qm_out, frame0, frame1);
 }
 
+// the name of a movie in a bundle is its file name without directory or .qom
+
+char *bundlename(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    base = base ? base+1 : filename;
+    char *name = strdup(base);
+    int len = strlen(name);
+    if((len>4) && (strcmp(name+len-4, ".qom") == 0))
+        name[len-4] = 0;
+    return name;
+}
+
+// count the frames of a movie that don't read the same as ref
+
+int moviecheck(const char *what, const char *name, qom *qm, qom *ref)
+{
+    if(!qm || !ref || (qom_getnframes(qm) != qom_getnframes(ref))) {
+        fprintf(stderr, "qomutil: %s movie [%s] differs\n", what, name);
+        return 1;
+    }
+    int nerrors = 0;
+    for(int frameno = 0; frameno<qom_getnframes(qm); frameno++) {
+        double usec, refusec;
+        gfx_canvas *c = qom_getframe(qm, frameno, &usec);
+        gfx_canvas *r = qom_getframe(ref, frameno, &refusec);
+        if((usec != refusec) || (c->sizex != r->sizex) || (c->sizey != r->sizey) || memcmp(c->data, r->data, c->sizex*c->sizey*4)) {
+            fprintf(stderr, "qomutil: %s movie [%s] frame %d differs\n", what, name, frameno);
+            nerrors++;
+        }
+        gfx_canvas_free(c);
+        gfx_canvas_free(r);
+    }
+    return nerrors;
+}
+
+// check that each movie in the bundle reads the same as its file
+
+int bundlecheck(const char *bundlefile, int nmovies, char **names, char **files)
+{
+    int nerrors = 0;
+    qom_bundle *b = qom_bundle_open(bundlefile);
+    if(!b)
+        return 1;
+    for(int i=0; i<nmovies; i++) {
+        qom *qm = qom_bundle_get(b, names[i]);
+        qom *ref = qom_open(files[i], "r");
+        nerrors += moviecheck("bundle", names[i], qm, ref);
+        if(qm)
+            qom_close(qm);
+        if(ref)
+            qom_close(ref);
+    }
+    fprintf(stderr, "bundle %s: %d movies  %ld bytes  %d errors\n", bundlefile, qom_bundle_getnmovies(b), b->size, nerrors);
+    qom_bundle_close(b);
+    return nerrors;
+}
+
+// write a movie as a C array, aligned like the movies in a bundle, so it
+// can be linked into a program and read with qom_open_memory
+
+int tocwrite(const char *infile, const char *outfile, const char *name)
+{
+    FILE *f = fopen(infile, "rb");
+    if(!f) {
+        fprintf(stderr, "qomutil: can't open [%s]\n", infile);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *data = (unsigned char *)malloc(len);
+    if(fread(data, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "qomutil: can't read [%s]\n", infile);
+        fclose(f);
+        free(data);
+        return 1;
+    }
+    fclose(f);
+
+    FILE *out = fopen(outfile, "w");
+    if(!out) {
+        fprintf(stderr, "qomutil: can't open [%s]\n", outfile);
+        free(data);
+        return 1;
+    }
+    fprintf(out, "/* %s made by qomutil -toc, open it with qom_open_memory(%s, %s_size) */\n\n", infile, name, name);
+    fprintf(out, "#include <stddef.h>\n\n");
+    fprintf(out, "__attribute__((aligned(64))) const unsigned char %s[%ld] = {\n", name, len);
+    for(long i=0; i<len; i++)
+        fprintf(out, "%s0x%02x,%s", (i%16) ? "" : "    ", data[i], ((i%16) == 15 || (i == len-1)) ? "\n" : "");
+    fprintf(out, "};\n\n");
+    fprintf(out, "const size_t %s_size = %ld;\n", name, len);
+    int nerrors = (fclose(out) != 0);
+
+    qom *qm = qom_open_memory(data, len);
+    qom *ref = qom_open(infile, "r");
+    nerrors += moviecheck("toc", name, qm, ref);
+    fprintf(stderr, "toc %s: %s  %ld bytes  %d frames  %d errors\n", outfile, name, len, qm ? qom_getnframes(qm) : 0, nerrors);
+    if(qm)
+        qom_close(qm);
+    if(ref)
+        qom_close(ref);
+    free(data);
+    return nerrors;
+}
+
+// a C name for a movie, from its file name
+
+char *tocname(const char *filename)
+{
+    char *name = bundlename(filename);
+    for(char *cp = name; *cp; cp++) {
+        if(!isalnum((unsigned char)*cp))
+            *cp = '_';
+    }
+    if(isdigit((unsigned char)name[0]) || !name[0]) {
+        char *named = (char *)malloc(strlen(name)+2);
+        sprintf(named, "_%s", name);
+        free(name);
+        name = named;
+    }
+    return name;
+}
+
+// copy a movie into segments of nframes frames, and check that the
+// manifest reads the same as the movie
+
+int segmentwrite(const char *infile, const char *manifest, int nframes)
+{
+    qom *ref = qom_open(infile, "r");
+    if(!ref)
+        return 1;
+    qom *qm = qom_open_segmented(manifest, nframes, 0);
+    if(!qm) {
+        qom_close(ref);
+        return 1;
+    }
+    for(int frameno = 0; frameno<qom_getnframes(ref); frameno++) {
+        double usec;
+        gfx_canvas *c = qom_getframe(ref, frameno, &usec);
+        qom_putframe(qm, c, usec);
+        gfx_canvas_free(c);
+    }
+    int nerrors = (qom_close(qm) != qomERROR_NONE);
+    qm = qom_open(manifest, "r");
+    nerrors += moviecheck("segmented", manifest, qm, ref);
+    fprintf(stderr, "segments %s: %d segments  %d frames  %d errors\n", manifest, qm ? qom_getnsegments(qm) : 0, qm ? qom_getnframes(qm) : 0, nerrors);
+    if(qm)
+        qom_close(qm);
+    qom_close(ref);
+    return nerrors;
+}
+
+// copy a movie through write-behind buffers, reserving space for it and
+// syncing every 8 frames, and check that the copy reads the same
+
+int writebehindcopy(const char *infile, const char *outfile, int buffersize)
+{
+    qom *ref = qom_open(infile, "r");
+    if(!ref)
+        return 1;
+    FILE *f = fopen(infile, "rb");
+    fseek(f, 0, SEEK_END);
+    long estimate = ftell(f);
+    fclose(f);
+    qom *qm = qom_open(outfile, "w");
+    if(!qm) {
+        qom_close(ref);
+        return 1;
+    }
+    qom_setwritebehind(qm, buffersize);
+    qom_setpreallocate(qm, estimate);
+    qom_setsync(qm, 8);
+    double t0 = _qom_getusec();
+    for(int frameno = 0; frameno<qom_getnframes(ref); frameno++) {
+        double usec;
+        gfx_canvas *c = qom_getframe(ref, frameno, &usec);
+        qom_putframe(qm, c, usec);
+        gfx_canvas_free(c);
+    }
+    int nerrors = (qom_close(qm) != qomERROR_NONE);
+    double t1 = _qom_getusec();
+    qm = qom_open(outfile, "r");
+    nerrors += moviecheck("write-behind", outfile, qm, ref);
+    fprintf(stderr, "writebehind %s: %d frames  %.1f msec  %d errors\n", outfile, qm ? qom_getnframes(qm) : 0, (t1-t0)/1000.0, nerrors);
+    if(qm)
+        qom_close(qm);
+    qom_close(ref);
+    return nerrors;
+}
+
 #define DEFAULT_FRAMETIME       ((1000*1000)/30.0)
+#define NBATCH                  (8)         /* frames read at a time */
 
 int main(int argc, char **argv) 
 { 
@@ -80,6 +274,11 @@ int main(int argc, char **argv)
         fprintf(stderr, "usage: qomutil -print in.qom\n\n");
         fprintf(stderr, "usage: qomutil -trim in.qom out.qom startframe endframe\n\n");
         fprintf(stderr, "usage: qomutil -benchmark in.qom\n\n");
+        fprintf(stderr, "usage: qomutil -verify in.qom\n\n");
+        fprintf(stderr, "usage: qomutil -bundle out.qomb in1.qom in2.qom ...\n\n");
+        fprintf(stderr, "usage: qomutil -toc in.qom out.c [name]\n\n");
+        fprintf(stderr, "usage: qomutil -segment in.qom out.qoms framespersegment\n\n");
+        fprintf(stderr, "usage: qomutil -writebehind in.qom out.qom [buffersize]\n\n");
         exit(1);
     }
     if(strcmp(argv[1], "-toqom") == 0) {
@@ -98,13 +297,20 @@ int main(int argc, char **argv)
         qom *qm = qom_open(argv[2], "r");
         if(!qm)
             exit(1);
-        for(int frameno = 0; frameno<qom_getnframes(qm); frameno++) {
-            char outfname[1024];
-            double usec;
-            gfx_canvas *c = qom_getframe(qm, frameno, &usec);
-            sprintf(outfname, "%s%04d.png", argv[3], frameno);
-            canvas_topng(c, outfname);
-            gfx_canvas_free(c);
+        for(int frameno = 0; frameno<qom_getnframes(qm); frameno += NBATCH) {
+            gfx_canvas *frames[NBATCH];
+            int nbatch = qom_getnframes(qm)-frameno;
+            int n = (nbatch<NBATCH) ? nbatch : NBATCH;
+            if(qom_getframes(qm, frameno, n, frames, 0) != n) {
+                fprintf(stderr, "qomutil: %s: can't read frames %d to %d\n", argv[2], frameno, frameno+n-1);
+                exit(1);
+            }
+            for(int i=0; i<n; i++) {
+                char outfname[1024];
+                sprintf(outfname, "%s%04d.png", argv[3], frameno+i);
+                canvas_topng(frames[i], outfname);
+                gfx_canvas_free(frames[i]);
+            }
         }
         qom_close(qm);
     } else if(strcmp(argv[1], "-print") == 0) {
@@ -135,6 +341,44 @@ int main(int argc, char **argv)
         qom_close(qm_in);
     } else if(strcmp(argv[1], "-benchmark") == 0) {
         qom_readbenchmark(argv[2]);
+    } else if(strcmp(argv[1], "-verify") == 0) {
+        if(qom_verify(argv[2]))
+            exit(1);
+    } else if(strcmp(argv[1], "-bundle") == 0) {
+        int nmovies = argc-3;
+        char **names = (char **)malloc((nmovies+1)*sizeof(char *));
+        for(int i=0; i<nmovies; i++)
+            names[i] = bundlename(argv[3+i]);
+        if(!qom_bundle_write(argv[2], nmovies, (const char **)names, (const char **)(argv+3)))
+            exit(1);
+        if(bundlecheck(argv[2], nmovies, names, argv+3))
+            exit(1);
+        for(int i=0; i<nmovies; i++)
+            free(names[i]);
+        free(names);
+    } else if(strcmp(argv[1], "-toc") == 0) {
+        if(argc<4) {
+            fprintf(stderr, "usage: qomutil -toc in.qom out.c [name]\n");
+            exit(1);
+        }
+        char *name = (argc>4) ? strdup(argv[4]) : tocname(argv[2]);
+        if(tocwrite(argv[2], argv[3], name))
+            exit(1);
+        free(name);
+    } else if(strcmp(argv[1], "-segment") == 0) {
+        if(argc<5) {
+            fprintf(stderr, "usage: qomutil -segment in.qom out.qoms framespersegment\n");
+            exit(1);
+        }
+        if(segmentwrite(argv[2], argv[3], atoi(argv[4])))
+            exit(1);
+    } else if(strcmp(argv[1], "-writebehind") == 0) {
+        if(argc<4) {
+            fprintf(stderr, "usage: qomutil -writebehind in.qom out.qom [buffersize]\n");
+            exit(1);
+        }
+        if(writebehindcopy(argv[2], argv[3], (argc>4) ? atoi(argv[4]) : 1024*1024))
+            exit(1);
     } else {
         fprintf(stderr, "strange option [%s]\n", argv[1]);
         exit(1);